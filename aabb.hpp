@@ -10,6 +10,20 @@ struct AABB {
   AABB(const Vec3 &min, const Vec3 &max) : min(min), max(max) {}
   Vec3 calc_extent() const { return max - min; }
   Vec3 calc_center() const { return (min * 0.5f) + (max * 0.5f); }
+  float calc_surface_area() const {
+    Vec3 e = calc_extent();
+    return 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+  }
+  void grow(const AABB &other) {
+    min = Vec3::min(min, other.min);
+    max = Vec3::max(max, other.max);
+  }
+  // Touching boxes overlap
+  bool overlaps(const AABB &other) const {
+    return min.x <= other.max.x && other.min.x <= max.x &&
+           min.y <= other.max.y && other.min.y <= max.y &&
+           min.z <= other.max.z && other.min.z <= max.z;
+  }
   std::array<Vec3, 8> vertices() const {
     return {
         min,
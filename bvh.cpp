@@ -1,103 +1,1126 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <fstream>
+#include <limits>
+#include <omp.h>
+#include <random>
 #include <stack>
+#include <string>
+#include <utility>
 
 #include "bvh.hpp"
+#include "bvh_visitors.hpp"
 #include "distance.hpp"
+#include "morton.hpp"
+#include "radix_sort.hpp"
 
-BVH_Tree::BVH_Tree(const std::vector<AABB> &aabbs) {
+std::optional<uint32_t>
+BVH_Tree::split_midpoint(const BVH_Node &node, const std::vector<AABB> &aabbs) {
+  if (node.num_primitives <= options.max_leaf_size) return std::nullopt;
+  Vec3 extent = node.aabb.calc_extent();
+  uint8_t split_axis = 0;
+  if (extent.y > extent.x) split_axis = 1;
+  if (extent.z > extent[split_axis]) split_axis = 2;
+  float split_pos =
+      node.aabb.min[split_axis] * 0.5f + node.aabb.max[split_axis] * 0.5f;
+  uint32_t i = node.start();
+  uint32_t j = node.end();
+  while (i < j) {
+    if (aabbs[map[j - 1]].calc_center()[split_axis] > split_pos) j--;
+    else std::swap(map[j - 1], map[i++]);
+  }
+  // Partitioning failed
+  if (i == node.start() || i == node.end()) return std::nullopt;
+  return i;
+}
+
+namespace {
+// Loops over the primitives of the few top level nodes would otherwise run on
+// a single thread, so they are split into a fixed number of chunks that are
+// processed in parallel and reduced in chunk order. The number of chunks does
+// not depend on the number of threads, which keeps the built tree identical
+// for any number of threads.
+constexpr uint32_t PARALLEL_LOOP_THRESHOLD = 1 << 16;
+constexpr uint32_t NUM_CHUNKS = 64;
+// Subtrees with at least this many primitives are built in their own task
+constexpr uint32_t SUBTREE_TASK_THRESHOLD = 1 << 12;
+
+template <typename T, typename Reduce_Range, typename Join>
+T reduce_range(uint32_t start, uint32_t end, const T &identity,
+               Reduce_Range reduce, Join join) {
+  T result = identity;
+  if (end - start < PARALLEL_LOOP_THRESHOLD) {
+    reduce(start, end, result);
+    return result;
+  }
+  uint64_t n = end - start;
+  std::vector<T> partials(NUM_CHUNKS, identity);
+#pragma omp taskloop shared(partials)
+  for (uint32_t c = 0; c < NUM_CHUNKS; c++) {
+    uint32_t chunk_start = start + uint32_t(n * c / NUM_CHUNKS);
+    uint32_t chunk_end = start + uint32_t(n * (c + 1) / NUM_CHUNKS);
+    reduce(chunk_start, chunk_end, partials[c]);
+  }
+  for (const T &partial : partials) join(result, partial);
+  return result;
+}
+
+// Call update_node on all nodes of the subtree stored in nodes
+// [subtree_root, subtree_end), children before their parents
+template <typename Update_Node>
+void for_each_node_bottom_up(const std::vector<BVH_Node> &nodes,
+                             uint32_t subtree_root, uint32_t subtree_end,
+                             const Update_Node &update_node) {
+  const BVH_Node &node = nodes[subtree_root];
+  if (node.is_leaf() || subtree_end - subtree_root < SUBTREE_TASK_THRESHOLD) {
+    // Children are always stored after their parents
+    for (uint32_t i = subtree_end; i-- > subtree_root;) update_node(i);
+    return;
+  }
+  uint32_t left = BVH_Node::left_child(subtree_root);
+  uint32_t right = node.right_child();
+#pragma omp task shared(nodes, update_node)
+  for_each_node_bottom_up(nodes, left, right, update_node);
+  for_each_node_bottom_up(nodes, right, subtree_end, update_node);
+#pragma omp taskwait
+  update_node(subtree_root);
+}
+
+uint32_t ceil_log2(uint32_t n) {
+  uint32_t log = 0;
+  while ((uint64_t(1) << log) < n) log++;
+  return log;
+}
+
+// Subtrees with less nodes than this are not worth rebuilding
+constexpr uint32_t MIN_REBUILD_SUBTREE_SIZE = 64;
+
+AABB empty_aabb() {
+  constexpr float inf = std::numeric_limits<float>::infinity();
+  return AABB(Vec3(inf), Vec3(-inf));
+}
+
+struct SAH_Bin {
+  AABB aabb = empty_aabb();
+  uint32_t count = 0;
+  void add(const AABB &other) {
+    aabb.grow(other);
+    count++;
+  }
+  void add(const SAH_Bin &other) {
+    aabb.grow(other.aabb);
+    count += other.count;
+  }
+};
+} // namespace
+
+AABB BVH_Tree::join_aabbs(const std::vector<AABB> &aabbs,
+                          const std::vector<uint32_t> &map, uint32_t start,
+                          uint32_t end) {
+  return reduce_range(
+      start, end, empty_aabb(),
+      [&](uint32_t range_start, uint32_t range_end, AABB &aabb) {
+        for (uint32_t i = range_start; i < range_end; i++)
+          aabb.grow(aabbs[map[i]]);
+      },
+      [](AABB &aabb, const AABB &other) { aabb.grow(other); });
+}
+
+// https://jacco.ompf2.com/2022/04/21/how-to-build-a-bvh-part-3-quick-builds/
+std::optional<uint32_t> BVH_Tree::split_sah(const BVH_Node &node,
+                                            const std::vector<AABB> &aabbs) {
+  uint32_t n = node.num_primitives;
+  if (n == 1) return std::nullopt;
+
+  // Bin by centroid bounds instead of node bounds to not waste bins on empty
+  // space
+  AABB centroid_bounds = reduce_range(
+      node.start(), node.end(), empty_aabb(),
+      [&](uint32_t range_start, uint32_t range_end, AABB &bounds) {
+        for (uint32_t i = range_start; i < range_end; i++) {
+          Vec3 c = aabbs[map[i]].calc_center();
+          bounds.grow(AABB(c, c));
+        }
+      },
+      [](AABB &bounds, const AABB &other) { bounds.grow(other); });
+  Vec3 extent = centroid_bounds.calc_extent();
+
+  const uint32_t num_bins = std::max(options.num_bins, 2u);
+  Vec3 scale(0.0f);
+  for (uint8_t axis = 0; axis < 3; axis++)
+    if (extent[axis] > 0.0f) scale[axis] = float(num_bins) / extent[axis];
+  auto bin_index = [&](const Vec3 &center, uint8_t axis) {
+    float offset = center[axis] - centroid_bounds.min[axis];
+    return uint32_t(std::min(float(num_bins - 1), offset * scale[axis]));
+  };
+
+  // Bins of all three axes, filled in a single pass over the primitives
+  std::vector<SAH_Bin> bins = reduce_range(
+      node.start(), node.end(), std::vector<SAH_Bin>(3 * num_bins),
+      [&](uint32_t range_start, uint32_t range_end,
+          std::vector<SAH_Bin> &range_bins) {
+        for (uint32_t i = range_start; i < range_end; i++) {
+          const AABB &aabb = aabbs[map[i]];
+          Vec3 center = aabb.calc_center();
+          for (uint8_t axis = 0; axis < 3; axis++) {
+            if (!(extent[axis] > 0.0f)) continue;
+            range_bins[axis * num_bins + bin_index(center, axis)].add(aabb);
+          }
+        }
+      },
+      [&](std::vector<SAH_Bin> &range_bins,
+          const std::vector<SAH_Bin> &other) {
+        for (size_t b = 0; b < range_bins.size(); b++)
+          range_bins[b].add(other[b]);
+      });
+
+  std::vector<float> right_areas(num_bins);
+  float best_cost = std::numeric_limits<float>::infinity();
+  uint8_t best_axis = 0;
+  uint32_t best_bin = 0;
+  for (uint8_t axis = 0; axis < 3; axis++) {
+    if (!(extent[axis] > 0.0f)) continue;
+    const SAH_Bin *axis_bins = &bins[axis * num_bins];
+    // Sweep from the right to get area of everything right of each split
+    SAH_Bin right;
+    for (uint32_t b = num_bins - 1; b > 0; b--) {
+      right.add(axis_bins[b]);
+      right_areas[b] = right.aabb.calc_surface_area();
+    }
+    // Sweep from the left and evaluate split between bins b - 1 and b
+    SAH_Bin left;
+    for (uint32_t b = 1; b < num_bins; b++) {
+      left.add(axis_bins[b - 1]);
+      uint32_t right_count = n - left.count;
+      if (left.count == 0 || right_count == 0) continue;
+      float cost = left.count * left.aabb.calc_surface_area() +
+                   right_count * right_areas[b];
+      if (cost < best_cost) {
+        best_cost = cost;
+        best_axis = axis;
+        best_bin = b;
+      }
+    }
+  }
+
+  if (best_cost == std::numeric_limits<float>::infinity()) {
+    // All centroids coincide, no spatial split exists
+    if (n <= options.max_leaf_size) return std::nullopt;
+    return node.start() + n / 2;
+  }
+
+  if (n <= options.max_leaf_size) {
+    float area = node.aabb.calc_surface_area();
+    float leaf_cost = options.intersection_cost * n;
+    float split_cost = options.traversal_cost;
+    if (area > 0.0f) split_cost += options.intersection_cost * best_cost / area;
+    if (split_cost >= leaf_cost) return std::nullopt;
+  }
+
+  uint32_t i = node.start();
+  uint32_t j = node.end();
+  while (i < j) {
+    Vec3 center = aabbs[map[j - 1]].calc_center();
+    if (bin_index(center, best_axis) >= best_bin) j--;
+    else std::swap(map[j - 1], map[i++]);
+  }
+  assert(i != node.start() && i != node.end());
+  return i;
+}
+
+// https://research.nvidia.com/sites/default/files/pubs/2009-03_Fast-BVH-Construction/LBVH-Eurographics09.pdf
+std::optional<uint32_t>
+BVH_Tree::split_morton(const BVH_Node &node,
+                       const std::vector<uint64_t> &codes) {
+  if (node.num_primitives <= options.max_leaf_size) return std::nullopt;
+  uint64_t first = codes[node.start()];
+  uint64_t last = codes[node.end() - 1];
+  // Primitives in the same cell are split at the object median
+  if (first == last) return node.start() + node.num_primitives / 2;
+  // Codes are sorted and share all bits above the highest differing one, so
+  // the codes with that bit set form the right child
+  uint64_t diff = first ^ last;
+  uint64_t bit = uint64_t(1) << 63;
+  while (!(diff & bit)) bit >>= 1;
+  auto it = std::partition_point(
+      codes.begin() + node.start(), codes.begin() + node.end(),
+      [bit](uint64_t code) { return !(code & bit); });
+  return uint32_t(it - codes.begin());
+}
+
+std::vector<uint64_t>
+BVH_Tree::sort_by_morton_codes(const std::vector<AABB> &aabbs) {
+  AABB centroid_bounds;
+#pragma omp parallel
+#pragma omp single
+  centroid_bounds = reduce_range(
+      0, aabbs.size(), empty_aabb(),
+      [&](uint32_t range_start, uint32_t range_end, AABB &bounds) {
+        for (uint32_t i = range_start; i < range_end; i++) {
+          Vec3 c = aabbs[i].calc_center();
+          bounds.grow(AABB(c, c));
+        }
+      },
+      [](AABB &bounds, const AABB &other) { bounds.grow(other); });
+
+  std::vector<uint64_t> codes(aabbs.size());
+#pragma omp parallel for
+  for (uint32_t i = 0; i < aabbs.size(); i++) {
+    codes[i] = calc_morton_code(aabbs[i].calc_center(), centroid_bounds,
+                                options.morton_code_bits);
+    map[i] = i;
+  }
+  radix_sort(codes, map, options.morton_code_bits);
+  return codes;
+}
+
+void BVH_Tree::build_subtree(uint32_t subtree_root, uint32_t depth,
+                             const Build_Input &input) {
+  const std::vector<AABB> &aabbs = input.aabbs;
+  // Morton splits do not depend on node bounds, they are computed once the
+  // whole tree is built
+  bool update_child_aabbs = options.split_method != BVH_Split_Method::Morton;
+  std::stack<std::pair<uint32_t, uint32_t>> stack;
+  stack.push({subtree_root, depth});
+  while (!stack.empty()) {
+    auto [node_index, node_depth] = stack.top();
+    stack.pop();
+    BVH_Node &node = nodes[node_index];
+    std::optional<uint32_t> split;
+    // Splitting at the object median from here on still keeps all leaves
+    // within BVH_MAX_DEPTH
+    bool force_median =
+        node_depth + ceil_log2(node.num_primitives) >= BVH_MAX_DEPTH - 1;
+    if (force_median) {
+      if (node.num_primitives > options.max_leaf_size)
+        split = node.start() + node.num_primitives / 2;
+    } else {
+      switch (options.split_method) {
+      case BVH_Split_Method::Midpoint:
+        split = split_midpoint(node, aabbs);
+        break;
+      case BVH_Split_Method::SAH:
+        split = split_sah(node, aabbs);
+        break;
+      case BVH_Split_Method::Morton:
+        split = split_morton(node, input.morton_codes);
+        break;
+      }
+    }
+    if (!split.has_value()) continue;
+
+    // A subtree with n primitives has at most 2n - 1 nodes, give each child
+    // that many slots after its parent so that node placement does not depend
+    // on which thread builds which subtree
+    uint32_t left_index = BVH_Node::left_child(node_index);
+    BVH_Node &left = nodes[left_index];
+    left.offset = node.start();
+    left.num_primitives = *split - node.start();
+    if (update_child_aabbs)
+      left.aabb = join_aabbs(aabbs, map, left.start(), left.end());
+
+    uint32_t right_index = node_index + 2 * left.num_primitives;
+    BVH_Node &right = nodes[right_index];
+    right.offset = *split;
+    right.num_primitives = node.end() - *split;
+    if (update_child_aabbs)
+      right.aabb = join_aabbs(aabbs, map, right.start(), right.end());
+
+    node.offset = right_index;
+    node.num_primitives = 0;
+
+    for (uint32_t child : {left_index, right_index}) {
+      if (nodes[child].num_primitives >= SUBTREE_TASK_THRESHOLD) {
+#pragma omp task shared(input)
+        build_subtree(child, node_depth + 1, input);
+      } else {
+        stack.push({child, node_depth + 1});
+      }
+    }
+  }
+}
+
+BVH_Tree::BVH_Tree(const std::vector<AABB> &aabbs,
+                   const BVH_Build_Options &options)
+    : BVH_Tree(aabbs, options, 0) {}
+
+BVH_Tree::BVH_Tree(const std::vector<AABB> &aabbs,
+                   const BVH_Build_Options &options, uint32_t root_depth)
+    : options(options) {
   assert(!aabbs.empty());
   // Number of nodes of full binary tree with n leaves is 2n - 1
-  nodes_buffer = (BVH_Node *)malloc(sizeof(BVH_Node) * (aabbs.size() * 2 - 1));
-  current_free_node = nodes_buffer;
+  nodes.resize(aabbs.size() * 2 - 1);
+  map.resize(aabbs.size());
+
+  BVH_Node &root = nodes[ROOT];
+  root.offset = 0;
+  root.num_primitives = aabbs.size();
 
-  root = new_node();
-  root->start = 0;
-  root->end = aabbs.size();
-  root->aabb = join_aabbs(aabbs);
+  bool morton = options.split_method == BVH_Split_Method::Morton;
+  Build_Input input{aabbs, {}};
+  if (morton) input.morton_codes = sort_by_morton_codes(aabbs);
 
-  // Initialize indices map
-  map.reserve(aabbs.size());
-  for (uint32_t i = 0; i < aabbs.size(); i++) map.push_back(i);
+#pragma omp parallel
+#pragma omp single
+  {
+    if (!morton) {
+      // Initialize indices map
+#pragma omp taskloop
+      for (uint32_t i = 0; i < aabbs.size(); i++) map[i] = i;
+      root.aabb = join_aabbs(aabbs, map, root.start(), root.end());
+    }
+    build_subtree(ROOT, root_depth, input);
+  }
+  compact_nodes();
+  if (morton) refit_bounds(aabbs);
+  update_views();
+}
 
-  std::stack<BVH_Node *> stack;
-  stack.push(root);
+BVH_Tree::BVH_Tree(const BVH_Tree &other)
+    : nodes(other.nodes), map(other.map), file(other.file),
+      node_data(other.node_data), map_data(other.map_data),
+      num_nodes(other.num_nodes), num_primitives(other.num_primitives),
+      options(other.options), reference_costs(other.reference_costs) {
+  // Views of copied vectors must point at the copies
+  if (!file) update_views();
+}
+
+BVH_Tree &BVH_Tree::operator=(const BVH_Tree &other) {
+  if (this != &other) *this = BVH_Tree(other);
+  return *this;
+}
+
+void BVH_Tree::update_views() {
+  assert(!file);
+  node_data = nodes.data();
+  map_data = map.data();
+  num_nodes = nodes.size();
+  num_primitives = map.size();
+}
+
+void BVH_Tree::detach_from_file() {
+  if (!file) return;
+  nodes.assign(node_data, node_data + num_nodes);
+  map.assign(map_data, map_data + num_primitives);
+  file.reset();
+  update_views();
+}
+
+void BVH_Tree::compact_nodes() {
+  std::vector<BVH_Node> compacted;
+  compacted.reserve(nodes.size());
+  struct Stack_Item {
+    uint32_t node;
+    // Index of the parent in the compact nodes if this is a right child
+    std::optional<uint32_t> parent;
+  };
+  std::stack<Stack_Item> stack;
+  stack.push({ROOT, std::nullopt});
   while (!stack.empty()) {
-    BVH_Node *node = stack.top();
+    auto [node_index, parent] = stack.top();
     stack.pop();
-    if (node->num_primitives() == 1) continue;
-    Vec3 extent = node->aabb.calc_extent();
-    uint8_t split_axis = 0;
-    if (extent.y > extent.x) split_axis = 1;
-    if (extent.z > extent[split_axis]) split_axis = 2;
-    float split_pos =
-        node->aabb.min[split_axis] * 0.5f + node->aabb.max[split_axis] * 0.5f;
-    uint32_t i = node->start;
-    uint32_t j = node->end;
-    while (i < j) {
-      if (aabbs[map[j - 1]].calc_center()[split_axis] > split_pos) j--;
-      else std::swap(map[j - 1], map[i++]);
-    }
-    if (i == node->start || i == node->end) continue; // Partitioning failed
-
-    BVH_Node *left = new_node();
-    left->start = node->start;
-    left->end = i;
-    left->aabb = join_aabbs(aabbs, map, left->start, left->end);
-    node->left = left;
-    stack.push(left);
-
-    BVH_Node *right = new_node();
-    right->start = i;
-    right->end = node->end;
-    right->aabb = join_aabbs(aabbs, map, right->start, right->end);
-    node->right = right;
-    stack.push(right);
+    uint32_t compact_index = compacted.size();
+    if (parent.has_value()) compacted[*parent].offset = compact_index;
+    const BVH_Node &node = nodes[node_index];
+    compacted.push_back(node);
+    if (node.is_leaf()) continue;
+    // Push left child last so it is placed right after its parent
+    stack.push({node.right_child(), compact_index});
+    stack.push({BVH_Node::left_child(node_index), std::nullopt});
   }
+  compacted.shrink_to_fit();
+  nodes = std::move(compacted);
 }
 
-std::optional<Closest_Point_Result>
-closest_point(const Vec3 &p, const std::vector<Vec3> &points,
-              const BVH_Tree &bvh) {
-  std::optional<Closest_Point_Result> result;
-  std::stack<const BVH_Node *> stack;
-  stack.push(bvh.get_root());
+void BVH_Tree::refit(const std::vector<AABB> &aabbs) {
+  detach_from_file();
+  // Node bounds still match the geometry the tree was built for, later
+  // refits compare against these costs
+  if (reference_costs.empty()) reference_costs = calc_node_costs();
+  refit_bounds(aabbs);
+}
+
+void BVH_Tree::refit_bounds(const std::vector<AABB> &aabbs) {
+  assert(aabbs.size() == map.size());
+#pragma omp parallel
+#pragma omp single
+  for_each_node_bottom_up(nodes, ROOT, nodes.size(), [&](uint32_t i) {
+    BVH_Node &node = nodes[i];
+    if (node.is_leaf()) {
+      node.aabb = aabbs[map[node.start()]];
+      for (uint32_t j = node.start() + 1; j < node.end(); j++)
+        node.aabb.grow(aabbs[map[j]]);
+      return;
+    }
+    node.aabb = nodes[BVH_Node::left_child(i)].aabb;
+    node.aabb.grow(nodes[node.right_child()].aabb);
+  });
+}
+
+std::vector<float> BVH_Tree::calc_node_costs() const {
+  std::vector<float> costs(nodes.size());
+#pragma omp parallel
+#pragma omp single
+  for_each_node_bottom_up(nodes, ROOT, nodes.size(), [&](uint32_t i) {
+    const BVH_Node &node = nodes[i];
+    if (node.is_leaf()) {
+      costs[i] = options.intersection_cost * node.num_primitives;
+      return;
+    }
+    uint32_t left = BVH_Node::left_child(i);
+    uint32_t right = node.right_child();
+    float area = node.aabb.calc_surface_area();
+    float children_cost = std::max(costs[left], costs[right]);
+    if (area > 0.0f)
+      children_cost = (nodes[left].aabb.calc_surface_area() * costs[left] +
+                       nodes[right].aabb.calc_surface_area() * costs[right]) /
+                      area;
+    costs[i] = options.traversal_cost + children_cost;
+  });
+  return costs;
+}
+
+uint32_t BVH_Tree::refit(const std::vector<AABB> &aabbs,
+                         float max_cost_growth) {
+  refit(aabbs);
+  std::vector<float> costs = calc_node_costs();
+
+  // Rebuild the largest degraded subtrees, so degradation spread over the
+  // whole tree ends in a full rebuild and local degradation in small ones
+  std::vector<std::pair<uint32_t, uint32_t>> subtree_roots;
+  struct Stack_Item {
+    uint32_t node;
+    // Nodes of the subtree are stored in [node, end)
+    uint32_t end;
+    uint32_t depth;
+  };
+  std::stack<Stack_Item> stack;
+  stack.push({ROOT, uint32_t(nodes.size()), 0});
   while (!stack.empty()) {
-    const BVH_Node *node = stack.top();
+    auto [node_index, end, depth] = stack.top();
     stack.pop();
-    if (!node->is_leaf()) {
-      // Pick closest AABB
-      float ld = distance_to_volume(p, node->left->aabb);
-      float rd = distance_to_volume(p, node->right->aabb);
-      stack.push((ld < rd) ? node->left : node->right);
+    if (end - node_index < MIN_REBUILD_SUBTREE_SIZE) continue;
+    const BVH_Node &node = nodes[node_index];
+    if (node.is_leaf()) continue;
+    if (costs[node_index] > max_cost_growth * reference_costs[node_index]) {
+      subtree_roots.push_back({node_index, depth});
       continue;
     }
-    for (uint32_t i = node->start; i < node->end; i++) {
-      uint32_t pi = bvh.remap_index(i);
-      const Vec3 &other_p = points[pi];
-      float t = p.dist(other_p);
-      if (!result.has_value() || t < result->t) result = {pi, t};
+    stack.push({BVH_Node::left_child(node_index), node.right_child(),
+                depth + 1});
+    stack.push({node.right_child(), end, depth + 1});
+  }
+  if (!subtree_roots.empty()) rebuild_subtrees(subtree_roots, aabbs);
+  return subtree_roots.size();
+}
+
+void BVH_Tree::rebuild_subtrees(
+    const std::vector<std::pair<uint32_t, uint32_t>> &subtree_roots,
+    const std::vector<AABB> &aabbs) {
+  struct Rebuilt_Subtree {
+    BVH_Tree tree;
+    std::vector<float> costs;
+    // Index of the first primitive of the subtree in map
+    uint32_t start;
+  };
+  std::vector<std::pair<uint32_t, Rebuilt_Subtree>> rebuilt;
+  for (auto [subtree_root, depth] : subtree_roots) {
+    // The first leaf in depth first order is the leftmost one
+    uint32_t first_leaf = subtree_root;
+    while (!nodes[first_leaf].is_leaf()) first_leaf++;
+    uint32_t start = nodes[first_leaf].start();
+    // Right children are stored after left children, so the primitives of
+    // the rightmost leaf are the last of the subtree
+    uint32_t last_leaf = subtree_root;
+    while (!nodes[last_leaf].is_leaf()) last_leaf = nodes[last_leaf].offset;
+    uint32_t end = nodes[last_leaf].end();
+
+    std::vector<AABB> subtree_aabbs;
+    subtree_aabbs.reserve(end - start);
+    for (uint32_t i = start; i < end; i++)
+      subtree_aabbs.push_back(aabbs[map[i]]);
+    BVH_Tree tree(subtree_aabbs, options, depth);
+    std::vector<float> costs = tree.calc_node_costs();
+    rebuilt.push_back(
+        {subtree_root, {std::move(tree), std::move(costs), start}});
+  }
+  std::sort(rebuilt.begin(), rebuilt.end(),
+            [](const auto &a, const auto &b) { return a.first < b.first; });
+
+  // Copy nodes in depth first order like compact_nodes, splicing in the
+  // rebuilt subtrees
+  std::vector<BVH_Node> new_nodes;
+  std::vector<float> new_costs;
+  new_nodes.reserve(nodes.size());
+  new_costs.reserve(nodes.size());
+  std::stack<std::pair<uint32_t, std::optional<uint32_t>>> stack;
+  stack.push({ROOT, std::nullopt});
+  while (!stack.empty()) {
+    auto [node_index, parent] = stack.top();
+    stack.pop();
+    uint32_t new_index = new_nodes.size();
+    if (parent.has_value()) new_nodes[*parent].offset = new_index;
+    auto it = std::lower_bound(
+        rebuilt.begin(), rebuilt.end(), node_index,
+        [](const auto &item, uint32_t i) { return item.first < i; });
+    if (it == rebuilt.end() || it->first != node_index) {
+      const BVH_Node &node = nodes[node_index];
+      new_nodes.push_back(node);
+      new_costs.push_back(reference_costs[node_index]);
+      if (node.is_leaf()) continue;
+      stack.push({node.right_child(), new_index});
+      stack.push({BVH_Node::left_child(node_index), std::nullopt});
+      continue;
     }
+    const Rebuilt_Subtree &subtree = it->second;
+    for (const BVH_Node &node : subtree.tree.nodes) {
+      new_nodes.push_back(node);
+      new_nodes.back().offset += node.is_leaf() ? subtree.start : new_index;
+    }
+    new_costs.insert(new_costs.end(), subtree.costs.begin(),
+                     subtree.costs.end());
+    std::vector<uint32_t> old_map(map.begin() + subtree.start,
+                                  map.begin() + subtree.start +
+                                      subtree.tree.map.size());
+    for (uint32_t i = 0; i < old_map.size(); i++)
+      map[subtree.start + i] = old_map[subtree.tree.map[i]];
   }
-  if (!result.has_value()) return std::nullopt;
+  new_nodes.shrink_to_fit();
+  nodes = std::move(new_nodes);
+  reference_costs = std::move(new_costs);
+  update_views();
+}
 
-  // Second pass to ensure closest point
-  stack.push(bvh.get_root());
+BVH_Stats BVH_Tree::calc_stats() const {
+  BVH_Stats stats;
+  float root_area = get_aabb().calc_surface_area();
+  // Avoid division by zero for flat or degenerate trees
+  if (!(root_area > 0.0f)) root_area = 1.0f;
+  uint64_t sum_leaf_depth = 0;
+  std::stack<std::pair<uint32_t, uint32_t>> stack;
+  stack.push({ROOT, 0});
   while (!stack.empty()) {
-    const BVH_Node *node = stack.top();
+    auto [node_index, depth] = stack.top();
     stack.pop();
-    if (!node->is_leaf()) {
-      float ld = distance_to_volume(p, node->left->aabb);
-      float rd = distance_to_volume(p, node->right->aabb);
-      if (ld < result->t) distance_to_volume(p, node->left->aabb);
-      if (rd < result->t) distance_to_volume(p, node->right->aabb);
+    const BVH_Node &node = node_data[node_index];
+    stats.num_nodes++;
+    stats.max_depth = std::max(stats.max_depth, depth);
+    float relative_area = node.aabb.calc_surface_area() / root_area;
+    if (!node.is_leaf()) {
+      stats.sah_cost += options.traversal_cost * relative_area;
+      stack.push({BVH_Node::left_child(node_index), depth + 1});
+      stack.push({node.right_child(), depth + 1});
       continue;
     }
-    for (uint32_t i = node->start; i < node->end; i++) {
+    uint32_t n = node.num_primitives;
+    stats.sah_cost += options.intersection_cost * relative_area * n;
+    stats.num_leaves++;
+    sum_leaf_depth += depth;
+    if (stats.leaf_size_histogram.size() <= n)
+      stats.leaf_size_histogram.resize(n + 1, 0);
+    stats.leaf_size_histogram[n]++;
+  }
+  stats.avg_leaf_depth = float(sum_leaf_depth) / float(stats.num_leaves);
+  return stats;
+}
+
+std::ostream &operator<<(std::ostream &os, const BVH_Stats &stats) {
+  os << "SAH cost: " << stats.sah_cost << "\n";
+  os << "Nodes: " << stats.num_nodes << ", leaves: " << stats.num_leaves
+     << "\n";
+  os << "Max depth: " << stats.max_depth
+     << ", average leaf depth: " << stats.avg_leaf_depth << "\n";
+  os << "Leaf sizes:";
+  for (size_t n = 0; n < stats.leaf_size_histogram.size(); n++) {
+    if (stats.leaf_size_histogram[n] == 0) continue;
+    os << " " << n << ": " << stats.leaf_size_histogram[n];
+  }
+  return os;
+}
+
+namespace {
+constexpr char BVH_CACHE_MAGIC[8] = "GPBVH";
+// Increment whenever the layout of the file or of BVH_Node changes
+constexpr uint32_t BVH_CACHE_VERSION = 1;
+
+// Cache files hold this header followed by the nodes and the map, all in
+// native byte order so they can be used in place
+struct BVH_Cache_Header {
+  char magic[8];
+  uint32_t version;
+  // Written as 1, files from machines with another byte order are rejected
+  uint32_t byte_order;
+  uint64_t mesh_hash;
+  uint32_t num_nodes;
+  uint32_t num_primitives;
+  uint32_t split_method;
+  uint32_t num_bins;
+  uint32_t max_leaf_size;
+  float traversal_cost;
+  float intersection_cost;
+  uint32_t morton_code_bits;
+  uint32_t reserved[2];
+};
+// Keeps the nodes aligned in the mapped file
+static_assert(sizeof(BVH_Cache_Header) == 2 * sizeof(BVH_Node));
+
+BVH_Cache_Header make_cache_header(uint64_t mesh_hash,
+                                   const BVH_Build_Options &options) {
+  BVH_Cache_Header header = {};
+  std::memcpy(header.magic, BVH_CACHE_MAGIC, sizeof(header.magic));
+  header.version = BVH_CACHE_VERSION;
+  header.byte_order = 1;
+  header.mesh_hash = mesh_hash;
+  header.split_method = uint32_t(options.split_method);
+  header.num_bins = options.num_bins;
+  header.max_leaf_size = options.max_leaf_size;
+  header.traversal_cost = options.traversal_cost;
+  header.intersection_cost = options.intersection_cost;
+  header.morton_code_bits = options.morton_code_bits;
+  return header;
+}
+
+// Whether nodes and map of a cache file form a tree that traversals can walk
+// without reading out of bounds, checked in one pass since children are
+// stored after their parents
+bool is_valid_cache_tree(const BVH_Node *nodes, uint32_t num_nodes,
+                         const uint32_t *map, uint32_t num_primitives) {
+  std::vector<uint8_t> depths(num_nodes, 0);
+  for (uint32_t i = 0; i < num_nodes; i++) {
+    const BVH_Node &node = nodes[i];
+    if (depths[i] >= BVH_MAX_DEPTH) return false;
+    if (node.is_leaf()) {
+      if (uint64_t(node.offset) + node.num_primitives > num_primitives)
+        return false;
+      continue;
+    }
+    // The left child directly follows, so the right one comes after it
+    if (node.offset <= i + 1 || node.offset >= num_nodes) return false;
+    depths[i + 1] = std::max<uint8_t>(depths[i + 1], depths[i] + 1);
+    depths[node.offset] = std::max<uint8_t>(depths[node.offset], depths[i] + 1);
+  }
+  for (uint32_t i = 0; i < num_primitives; i++)
+    if (map[i] >= num_primitives) return false;
+  return true;
+}
+} // namespace
+
+bool BVH_Tree::save(std::string_view filepath, uint64_t mesh_hash) const {
+  BVH_Cache_Header header = make_cache_header(mesh_hash, options);
+  header.num_nodes = num_nodes;
+  header.num_primitives = num_primitives;
+  // Write a new file next to the old one and move it into place, other
+  // processes may have the old file mapped and must not see it truncated
+  std::string target_filepath(filepath);
+  std::string temp_filepath = target_filepath + "." +
+                              std::to_string(std::random_device()()) + ".tmp";
+  std::ofstream ofs(temp_filepath, std::ios_base::binary);
+  ofs.write((const char *)&header, sizeof(header));
+  ofs.write((const char *)node_data, num_nodes * sizeof(BVH_Node));
+  ofs.write((const char *)map_data, num_primitives * sizeof(uint32_t));
+  ofs.close();
+  if (!ofs.good() ||
+      std::rename(temp_filepath.c_str(), target_filepath.c_str()) != 0) {
+    std::remove(temp_filepath.c_str());
+    return false;
+  }
+  return true;
+}
+
+std::optional<BVH_Tree> BVH_Tree::load(std::string_view filepath,
+                                       uint64_t mesh_hash,
+                                       const BVH_Build_Options &options) {
+  std::optional<Mapped_File> mapped = Mapped_File::open(filepath);
+  if (!mapped.has_value()) return std::nullopt;
+  BVH_Cache_Header header;
+  if (mapped->get_size() < sizeof(header)) return std::nullopt;
+  std::memcpy(&header, mapped->get_data(), sizeof(header));
+
+  BVH_Cache_Header expected = make_cache_header(mesh_hash, options);
+  expected.num_nodes = header.num_nodes;
+  expected.num_primitives = header.num_primitives;
+  expected.reserved[0] = header.reserved[0];
+  expected.reserved[1] = header.reserved[1];
+  if (std::memcmp(&header, &expected, sizeof(header)) != 0) return std::nullopt;
+  if (header.num_primitives == 0 || header.num_nodes == 0) return std::nullopt;
+  uint64_t expected_size = sizeof(header) +
+                           uint64_t(header.num_nodes) * sizeof(BVH_Node) +
+                           uint64_t(header.num_primitives) * sizeof(uint32_t);
+  if (mapped->get_size() != expected_size) return std::nullopt;
+
+  BVH_Tree tree;
+  tree.options = options;
+  tree.num_nodes = header.num_nodes;
+  tree.num_primitives = header.num_primitives;
+  const std::byte *data = mapped->get_data() + sizeof(header);
+  tree.node_data = reinterpret_cast<const BVH_Node *>(data);
+  data += tree.num_nodes * sizeof(BVH_Node);
+  tree.map_data = reinterpret_cast<const uint32_t *>(data);
+  if (!is_valid_cache_tree(tree.node_data, tree.num_nodes, tree.map_data,
+                           tree.num_primitives))
+    return std::nullopt;
+  tree.file = std::make_shared<const Mapped_File>(std::move(*mapped));
+  return tree;
+}
+
+std::optional<std::string> get_bvh_cache_filepath(std::string_view filepath) {
+  const char *cache_dir = std::getenv("GEOPROC_BVH_CACHE");
+  if (cache_dir == nullptr || *cache_dir == '\0')
+    return std::string(filepath) + ".bvh";
+  if (std::string_view(cache_dir) == "off") return std::nullopt;
+  std::filesystem::path path = std::filesystem::path(cache_dir) /
+                               std::filesystem::path(filepath).filename();
+  return path.string() + ".bvh";
+}
+
+namespace {
+struct Closest_Point_Visitor {
+  const Vec3 &p;
+  const std::vector<Vec3> &points;
+  const BVH_Tree &bvh;
+  std::optional<Closest_Point_Result> result;
+
+  std::optional<float> intersect(const AABB &aabb) const {
+    return distance_to_volume(p, aabb);
+  }
+  float get_max_distance() const {
+    if (!result.has_value()) return std::numeric_limits<float>::infinity();
+    return result->t;
+  }
+  bool visit_leaf(const BVH_Node &leaf) {
+    for (uint32_t i = leaf.start(); i < leaf.end(); i++) {
       uint32_t pi = bvh.remap_index(i);
-      const Vec3 &other_p = points[pi];
-      float t = p.dist(other_p);
-      if (t < result->t) result = {pi, t};
+      float t = p.dist(points[pi]);
+      if (!result.has_value() || t < result->t) result = {pi, t};
     }
+    return false;
   }
+};
 
-  return result;
+// Counts hits until max_count is reached, any hit is a count of one
+struct Count_Hits_Visitor {
+  const Slab_Ray slab_r;
+  const Watertight_Ray watertight_r;
+  const std::vector<Triangle> &tris;
+  const BVH_Tree &bvh;
+  float t_max;
+  size_t max_count;
+  size_t num_hits = 0;
+
+  std::optional<float> intersect(const AABB &aabb) const {
+    return ::intersect(slab_r, aabb, t_max);
+  }
+  float get_max_distance() const { return t_max; }
+  bool visit_leaf(const BVH_Node &leaf) {
+    for (uint32_t i = leaf.start(); i < leaf.end(); i++) {
+      if (!::intersect(watertight_r, tris[bvh.remap_index(i)], t_max)
+               .has_value())
+        continue;
+      if (++num_hits >= max_count) return true;
+    }
+    return false;
+  }
+};
+
+struct Radius_Visitor {
+  const Vec3 &p;
+  float radius;
+  const std::vector<Vec3> &points;
+  const BVH_Tree &bvh;
+  std::vector<Closest_Point_Result> &results;
+
+  std::optional<float> intersect(const AABB &aabb) const {
+    float d = distance_to_volume(p, aabb);
+    if (d > radius) return std::nullopt;
+    return d;
+  }
+  float get_max_distance() const { return radius; }
+  bool visit_leaf(const BVH_Node &leaf) {
+    for (uint32_t i = leaf.start(); i < leaf.end(); i++) {
+      uint32_t pi = bvh.remap_index(i);
+      float t = p.dist(points[pi]);
+      if (t <= radius) results.push_back({pi, t});
+    }
+    return false;
+  }
+};
+
+bool is_closer(const Closest_Point_Result &a, const Closest_Point_Result &b) {
+  return a.t < b.t;
+}
+
+// Indices of queries sorted along a Morton curve through their bounds
+std::vector<uint32_t> sort_by_morton_order(const std::vector<Vec3> &queries) {
+  AABB bounds = empty_aabb();
+  for (const Vec3 &q : queries) bounds.grow(AABB(q, q));
+  constexpr uint32_t MORTON_CODE_BITS = 30;
+  std::vector<uint64_t> codes(queries.size());
+  std::vector<uint32_t> order(queries.size());
+#pragma omp parallel for
+  for (size_t i = 0; i < queries.size(); i++) {
+    codes[i] = calc_morton_code(queries[i], bounds, MORTON_CODE_BITS);
+    order[i] = i;
+  }
+  radix_sort(codes, order, MORTON_CODE_BITS);
+  return order;
+}
+
+// Chunks of consecutive sorted queries handed to each thread at a time
+constexpr size_t BATCH_CHUNK_SIZE = 1024;
+} // namespace
+
+std::optional<Closest_Point_Result>
+closest_point(const Vec3 &p, const std::vector<Vec3> &points,
+              const BVH_Tree &bvh) {
+  Closest_Point_Visitor visitor{p, points, bvh, std::nullopt};
+  traverse(bvh, visitor);
+  return visitor.result;
+}
+
+std::optional<Closest_Triangle_Result>
+closest_triangle(const Vec3 &p, const std::vector<Triangle> &tris,
+                 const BVH_Tree &bvh, float max_distance) {
+  Closest_Triangle_Visitor<BVH_Tree> visitor{
+      p, tris, bvh, max_distance * max_distance, std::nullopt};
+  traverse(bvh, visitor);
+  if (visitor.result.has_value())
+    visitor.result->distance = std::sqrt(visitor.max_d2);
+  return visitor.result;
+}
+
+std::optional<Ray_Hit> closest_hit(const Ray &r,
+                                   const std::vector<Triangle> &tris,
+                                   const BVH_Tree &bvh, float t_max) {
+  Closest_Hit_Visitor<BVH_Tree> visitor{
+      Slab_Ray(r), Watertight_Ray(r), tris, bvh, t_max, std::nullopt};
+  traverse(bvh, visitor);
+  return visitor.result;
+}
+
+bool any_hit(const Ray &r, const std::vector<Triangle> &tris,
+             const BVH_Tree &bvh, float t_max) {
+  return count_intersections(r, tris, bvh, t_max, 1) > 0;
+}
+
+bool any_hit(const Segment &s, const std::vector<Triangle> &tris,
+             const BVH_Tree &bvh) {
+  return any_hit(Ray{s.a, s.b - s.a}, tris, bvh, 1.0f);
+}
+
+size_t count_intersections(const Ray &r, const std::vector<Triangle> &tris,
+                           const BVH_Tree &bvh, float t_max,
+                           size_t max_count) {
+  if (max_count == 0) return 0;
+  Count_Hits_Visitor visitor{Slab_Ray(r), Watertight_Ray(r), tris, bvh, t_max,
+                             max_count};
+  traverse(bvh, visitor);
+  return visitor.num_hits;
+}
+
+const std::vector<Closest_Point_Result> &
+k_nearest_points(const Vec3 &p, uint32_t k, const std::vector<Vec3> &points,
+                 const BVH_Tree &bvh, BVH_Query_Scratch &scratch) {
+  auto &queue = scratch.node_queue;
+  // Max heap of the closest points found so far, with squared distances until
+  // the search is done
+  auto &results = scratch.results;
+  queue.clear();
+  results.clear();
+  if (k == 0) return results;
+  auto max_d2 = [&] {
+    if (results.size() < k) return std::numeric_limits<float>::infinity();
+    return results.front().t;
+  };
+  auto push_node = [&](uint32_t node_index) {
+    float d2 = squared_distance_to_volume(p, bvh.get_node(node_index).aabb);
+    if (d2 > max_d2()) return;
+    queue.push_back({d2, node_index});
+    std::push_heap(queue.begin(), queue.end(), std::greater<>());
+  };
+
+  push_node(BVH_Tree::ROOT);
+  while (!queue.empty()) {
+    std::pop_heap(queue.begin(), queue.end(), std::greater<>());
+    auto [d2, node_index] = queue.back();
+    queue.pop_back();
+    // All remaining nodes are further away
+    if (d2 > max_d2()) break;
+    const BVH_Node &node = bvh.get_node(node_index);
+    if (!node.is_leaf()) {
+      push_node(BVH_Node::left_child(node_index));
+      push_node(node.right_child());
+      continue;
+    }
+    for (uint32_t i = node.start(); i < node.end(); i++) {
+      uint32_t pi = bvh.remap_index(i);
+      Vec3 d = points[pi] - p;
+      float other_d2 = d.dot(d);
+      if (results.size() < k) {
+        results.push_back({pi, other_d2});
+        std::push_heap(results.begin(), results.end(), is_closer);
+      } else if (other_d2 < results.front().t) {
+        std::pop_heap(results.begin(), results.end(), is_closer);
+        results.back() = {pi, other_d2};
+        std::push_heap(results.begin(), results.end(), is_closer);
+      }
+    }
+  }
+  std::sort_heap(results.begin(), results.end(), is_closer);
+  for (Closest_Point_Result &result : results)
+    result.t = p.dist(points[result.i]);
+  return results;
+}
+
+const std::vector<Closest_Point_Result> &
+points_in_radius(const Vec3 &p, float radius, const std::vector<Vec3> &points,
+                 const BVH_Tree &bvh, BVH_Query_Scratch &scratch) {
+  scratch.results.clear();
+  Radius_Visitor visitor{p, radius, points, bvh, scratch.results};
+  traverse(bvh, visitor);
+  return scratch.results;
+}
+
+std::vector<std::optional<Closest_Point_Result>>
+closest_points(const std::vector<Vec3> &queries,
+               const std::vector<Vec3> &points, const BVH_Tree &bvh) {
+  std::vector<uint32_t> order = sort_by_morton_order(queries);
+  std::vector<std::optional<Closest_Point_Result>> results(queries.size());
+#pragma omp parallel for schedule(dynamic, BATCH_CHUNK_SIZE)
+  for (size_t i = 0; i < order.size(); i++)
+    results[order[i]] = closest_point(queries[order[i]], points, bvh);
+  return results;
+}
+
+std::vector<Closest_Point_Result>
+k_nearest_points(const std::vector<Vec3> &queries, uint32_t k,
+                 const std::vector<Vec3> &points, const BVH_Tree &bvh) {
+  std::vector<uint32_t> order = sort_by_morton_order(queries);
+  size_t stride = std::min<size_t>(k, points.size());
+  std::vector<Closest_Point_Result> results(queries.size() * stride);
+#pragma omp parallel
+  {
+    BVH_Query_Scratch scratch;
+#pragma omp for schedule(dynamic, BATCH_CHUNK_SIZE)
+    for (size_t i = 0; i < order.size(); i++) {
+      uint32_t qi = order[i];
+      const auto &nearest =
+          k_nearest_points(queries[qi], k, points, bvh, scratch);
+      std::copy(nearest.begin(), nearest.end(), results.begin() + qi * stride);
+    }
+  }
+  return results;
+}
+
+namespace {
+using Index_Pair = std::pair<uint32_t, uint32_t>;
+
+// Node pairs expanded breadth first on one thread before the remaining pairs
+// are split between threads
+constexpr size_t MIN_PARALLEL_NODE_PAIRS = 1024;
+
+// With self set, a and b are the same tree and each unordered pair of distinct
+// primitives is reported once
+std::vector<Index_Pair>
+find_overlapping_pairs_impl(const BVH_Tree &a, const std::vector<AABB> &a_aabbs,
+                            const BVH_Tree &b, const std::vector<AABB> &b_aabbs,
+                            bool self) {
+  auto emit_if_overlapping = [&](uint32_t i, uint32_t j, auto &&emit) {
+    uint32_t pi = a.remap_index(i);
+    uint32_t pj = b.remap_index(j);
+    if (!a_aabbs[pi].overlaps(b_aabbs[pj])) return;
+    if (self && pj < pi) std::swap(pi, pj);
+    emit(Index_Pair(pi, pj));
+  };
+  // Replace a pair of overlapping nodes by pairs of their children, or emit the
+  // overlapping primitives of two leaves
+  auto expand = [&](Index_Pair node_pair, auto &&push, auto &&emit) {
+    auto [na, nb] = node_pair;
+    const BVH_Node &node_a = a.get_node(na);
+    const BVH_Node &node_b = b.get_node(nb);
+    if (!node_a.aabb.overlaps(node_b.aabb)) return;
+    if (self && na == nb) {
+      if (node_a.is_leaf()) {
+        for (uint32_t i = node_a.start(); i < node_a.end(); i++)
+          for (uint32_t j = i + 1; j < node_a.end(); j++)
+            emit_if_overlapping(i, j, emit);
+        return;
+      }
+      uint32_t left = BVH_Node::left_child(na);
+      uint32_t right = node_a.right_child();
+      push(Index_Pair(left, left));
+      push(Index_Pair(right, right));
+      push(Index_Pair(left, right));
+      return;
+    }
+    if (node_a.is_leaf() && node_b.is_leaf()) {
+      for (uint32_t i = node_a.start(); i < node_a.end(); i++)
+        for (uint32_t j = node_b.start(); j < node_b.end(); j++)
+          emit_if_overlapping(i, j, emit);
+      return;
+    }
+    // Descend into the larger node so that both sides shrink together
+    bool descend_a =
+        !node_a.is_leaf() &&
+        (node_b.is_leaf() || node_a.aabb.calc_surface_area() >=
+                                 node_b.aabb.calc_surface_area());
+    if (descend_a) {
+      push(Index_Pair(BVH_Node::left_child(na), nb));
+      push(Index_Pair(node_a.right_child(), nb));
+    } else {
+      push(Index_Pair(na, BVH_Node::left_child(nb)));
+      push(Index_Pair(na, node_b.right_child()));
+    }
+  };
+
+  std::vector<Index_Pair> results;
+  auto emit_result = [&](Index_Pair p) { results.push_back(p); };
+  std::vector<Index_Pair> frontier = {{BVH_Tree::ROOT, BVH_Tree::ROOT}};
+  std::vector<Index_Pair> next;
+  while (!frontier.empty() && frontier.size() < MIN_PARALLEL_NODE_PAIRS) {
+    next.clear();
+    for (Index_Pair node_pair : frontier)
+      expand(node_pair, [&](Index_Pair p) { next.push_back(p); }, emit_result);
+    std::swap(frontier, next);
+  }
+
+  // Each thread descends its node pairs depth first into its own buffer
+  std::vector<std::vector<Index_Pair>> thread_results(omp_get_max_threads());
+#pragma omp parallel
+  {
+    std::vector<Index_Pair> &local = thread_results[omp_get_thread_num()];
+    auto emit_local = [&](Index_Pair p) { local.push_back(p); };
+    std::vector<Index_Pair> stack;
+    auto push = [&](Index_Pair p) { stack.push_back(p); };
+#pragma omp for schedule(dynamic, 1)
+    for (size_t f = 0; f < frontier.size(); f++) {
+      stack.push_back(frontier[f]);
+      while (!stack.empty()) {
+        Index_Pair node_pair = stack.back();
+        stack.pop_back();
+        expand(node_pair, push, emit_local);
+      }
+    }
+  }
+  for (const std::vector<Index_Pair> &local : thread_results)
+    results.insert(results.end(), local.begin(), local.end());
+  // Threads finish in any order
+  std::sort(results.begin(), results.end());
+  return results;
+}
+} // namespace
+
+std::vector<std::pair<uint32_t, uint32_t>>
+find_overlapping_pairs(const BVH_Tree &a, const std::vector<AABB> &a_aabbs,
+                       const BVH_Tree &b, const std::vector<AABB> &b_aabbs) {
+  return find_overlapping_pairs_impl(a, a_aabbs, b, b_aabbs, false);
+}
+
+std::vector<std::pair<uint32_t, uint32_t>>
+find_overlapping_pairs(const BVH_Tree &tree, const std::vector<AABB> &aabbs) {
+  return find_overlapping_pairs_impl(tree, aabbs, tree, aabbs, true);
 }
@@ -1,80 +1,275 @@
 #pragma once
 
+#include <cstdint>
+#include <limits>
+#include <memory>
 #include <optional>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <utility>
 #include <vector>
 
 #include "aabb.hpp"
+#include "hash.hpp"
+#include "intersect.hpp"
+#include "mapped_file.hpp"
+#include "ray.hpp"
+#include "segment.hpp"
+#include "triangle.hpp"
 
+// Nodes are stored in a flat array in depth first order, so the left child of
+// an inner node always directly follows it and only the index of the right
+// child needs to be stored
 struct BVH_Node {
   AABB aabb;
-  uint32_t start, end;
-  BVH_Node *right, *left;
-  BVH_Node() {
-    start = 0;
-    end = 0;
-    right = nullptr;
-    left = nullptr;
+  // Index of first primitive for leaves, index of right child for inner nodes
+  uint32_t offset = 0;
+  // Zero for inner nodes
+  uint32_t num_primitives = 0;
+  bool is_leaf() const { return num_primitives > 0; }
+  uint32_t start() const {
+    assert(is_leaf());
+    return offset;
   }
-  uint32_t num_primitives() const {
-    assert(end >= start);
-    return end - start;
+  uint32_t end() const {
+    assert(is_leaf());
+    return offset + num_primitives;
   }
-  bool is_leaf() const { return left == nullptr && right == nullptr; }
+  static uint32_t left_child(uint32_t i) { return i + 1; }
+  uint32_t right_child() const {
+    assert(!is_leaf());
+    return offset;
+  }
+};
+static_assert(sizeof(BVH_Node) == 32);
+
+// Leaves of trees built by BVH_Tree are never deeper than BVH_MAX_DEPTH - 1,
+// which bounds the size of traversal stacks
+constexpr uint32_t BVH_MAX_DEPTH = 64;
+
+enum class BVH_Split_Method {
+  // Split at the spatial middle of the longest axis
+  Midpoint,
+  // Split where the binned surface area heuristic is lowest
+  SAH,
+  // Sort centroids along a Morton curve and split where the highest differing
+  // bit of their codes flips (LBVH), much faster to build but lower quality
+  Morton,
+};
+
+struct BVH_Build_Options {
+  BVH_Split_Method split_method = BVH_Split_Method::Midpoint;
+  // Number of bins per axis used to evaluate SAH split candidates
+  uint32_t num_bins = 16;
+  // Nodes with more primitives than this are always split, nodes with less may
+  // become leaves if splitting them does not lower the SAH cost
+  uint32_t max_leaf_size = 1;
+  // Relative costs of visiting a node and of testing a primitive, used by the
+  // SAH to decide where to split and when to stop splitting
+  float traversal_cost = 1.0f;
+  float intersection_cost = 1.0f;
+  // Length of Morton codes, either 30 (10 bits per axis) or 63 (21 bits per
+  // axis), longer codes keep splitting dense clusters of primitives spatially
+  uint32_t morton_code_bits = 30;
+};
+
+struct BVH_Stats {
+  // Expected cost of a random ray query, following the SAH cost model
+  float sah_cost = 0.0f;
+  uint32_t num_nodes = 0;
+  uint32_t num_leaves = 0;
+  uint32_t max_depth = 0;
+  float avg_leaf_depth = 0.0f;
+  // Number of leaves indexed by their number of primitives
+  std::vector<uint32_t> leaf_size_histogram;
+
+  friend std::ostream &operator<<(std::ostream &os, const BVH_Stats &stats);
 };
 
 class BVH_Tree {
-  BVH_Node *root = nullptr;
-  BVH_Node *nodes_buffer = nullptr;
-  BVH_Node *current_free_node = nullptr;
+  std::vector<BVH_Node> nodes;
   std::vector<uint32_t> map;
+  // Cache file the tree was loaded from, nodes and map are left empty then
+  // and the views below point into the file instead
+  std::shared_ptr<const Mapped_File> file;
+  const BVH_Node *node_data = nullptr;
+  const uint32_t *map_data = nullptr;
+  uint32_t num_nodes = 0;
+  uint32_t num_primitives = 0;
+  BVH_Build_Options options;
+  // SAH cost of the subtree below each node relative to the area of the node,
+  // as of the last time the subtree was built. Computed by the first refit,
+  // before it changes any bounds.
+  std::vector<float> reference_costs;
 
-  static AABB join_aabbs(const std::vector<AABB> &aabs) {
-    AABB aabb = aabs[0];
-    for (size_t i = 1; i < aabs.size(); i++) {
-      aabb.min = Vec3::min(aabb.min, aabs[i].min);
-      aabb.max = Vec3::max(aabb.max, aabs[i].max);
-    }
-    return aabb;
-  }
+  BVH_Tree() = default;
+  // Build a tree that will become a subtree at root_depth in another tree
+  BVH_Tree(const std::vector<AABB> &aabbs, const BVH_Build_Options &options,
+           uint32_t root_depth);
+  // Point the views at nodes and map after they changed
+  void update_views();
+  // Copy nodes and map out of the cache file before they are modified
+  void detach_from_file();
+
+  struct Build_Input {
+    const std::vector<AABB> &aabbs;
+    // Morton codes of primitive centroids in map order, only for Morton builds
+    std::vector<uint64_t> morton_codes;
+  };
 
-  static AABB join_aabbs(const std::vector<AABB> &aabs,
+  static AABB join_aabbs(const std::vector<AABB> &aabbs,
                          const std::vector<uint32_t> &map, uint32_t start,
-                         uint32_t end) {
-    AABB aabb = aabs[map[start]];
-    for (uint32_t i = start + 1; i < end; i++) {
-      aabb.min = Vec3::min(aabb.min, aabs[map[i]].min);
-      aabb.max = Vec3::max(aabb.max, aabs[map[i]].max);
-    }
-    return aabb;
-  }
+                         uint32_t end);
 
-  BVH_Node *new_node() {
-    BVH_Node *result = current_free_node++;
-    *result = BVH_Node();
-    return result;
-  }
+  // Partition primitives of node and return index of first primitive of the
+  // right child, or nothing if node should stay a leaf
+  std::optional<uint32_t> split_midpoint(const BVH_Node &node,
+                                         const std::vector<AABB> &aabbs);
+  std::optional<uint32_t> split_sah(const BVH_Node &node,
+                                    const std::vector<AABB> &aabbs);
+  std::optional<uint32_t> split_morton(const BVH_Node &node,
+                                       const std::vector<uint64_t> &codes);
+  // Fill map with primitive indices sorted by the Morton codes of their
+  // centroids and return the sorted codes
+  std::vector<uint64_t> sort_by_morton_codes(const std::vector<AABB> &aabbs);
+  // Split nodes until they become leaves, larger subtrees are handed off to
+  // new OpenMP tasks
+  void build_subtree(uint32_t subtree_root, uint32_t depth,
+                     const Build_Input &input);
+  // Remove the unused slots left by the build
+  void compact_nodes();
+  // Recompute bounds of all nodes bottom up from the primitives
+  void refit_bounds(const std::vector<AABB> &aabbs);
+  std::vector<float> calc_node_costs() const;
+  // Replace the subtrees below the given nodes, given with their depth, with
+  // newly built ones
+  void rebuild_subtrees(
+      const std::vector<std::pair<uint32_t, uint32_t>> &subtree_roots,
+      const std::vector<AABB> &aabbs);
 
 public:
-  // Memory is freed in destructor, avoid double free and freeing nullptr by
-  // disabling copy and move
-  BVH_Tree(const BVH_Tree &) = delete;
-  BVH_Tree(BVH_Tree &&) = delete;
-  BVH_Tree &operator=(const BVH_Tree &) = delete;
-  BVH_Tree &operator=(BVH_Tree &&) = delete;
-
-  explicit BVH_Tree(const std::vector<AABB> &aabbs);
+  explicit BVH_Tree(const std::vector<AABB> &aabbs,
+                    const BVH_Build_Options &options = {});
+  BVH_Tree(const BVH_Tree &other);
+  BVH_Tree &operator=(const BVH_Tree &other);
+  BVH_Tree(BVH_Tree &&other) = default;
+  BVH_Tree &operator=(BVH_Tree &&other) = default;
   // Remap an index stored in a BVH node to an valid index in the primitives
   // array
   uint32_t remap_index(uint32_t i) const {
-    assert(i < map.size());
-    return map[i];
+    assert(i < num_primitives);
+    return map_data[i];
+  }
+  static constexpr uint32_t ROOT = 0;
+  const BVH_Node &get_node(uint32_t i) const {
+    assert(i < num_nodes);
+    return node_data[i];
   }
-  const BVH_Node *get_root() const { return root; }
-  const AABB &get_aabb() const { return root->aabb; }
+  uint32_t get_num_nodes() const { return num_nodes; }
+  uint32_t get_num_primitives() const { return num_primitives; }
+  const AABB &get_aabb() const { return node_data[ROOT].aabb; }
+  const BVH_Build_Options &get_options() const { return options; }
+  BVH_Stats calc_stats() const;
+  // Recompute bounds of all nodes bottom up after primitives moved, keeping
+  // the topology
+  void refit(const std::vector<AABB> &aabbs);
+  // Refit, then rebuild subtrees whose SAH cost grew to more than
+  // max_cost_growth times their cost when they were last built. Returns the
+  // number of rebuilt subtrees.
+  uint32_t refit(const std::vector<AABB> &aabbs, float max_cost_growth);
 
-  ~BVH_Tree() { free(nodes_buffer); }
+  // Write tree to a cache file that load can memory map, mesh_hash identifies
+  // the primitives the tree was built for
+  bool save(std::string_view filepath, uint64_t mesh_hash) const;
+  // Memory map a tree from a cache file written by save without copying it.
+  // Nothing if the file is missing, damaged, from another version, or was
+  // written for other primitives or build options.
+  static std::optional<BVH_Tree> load(std::string_view filepath,
+                                      uint64_t mesh_hash,
+                                      const BVH_Build_Options &options);
 };
 
+// Depth first traversal of tree without heap allocations, specialized at
+// compile time for a visitor that provides:
+//   std::optional<float> intersect(const AABB &aabb): nothing if the node can
+//     be skipped, otherwise its distance, closer children are visited first
+//   float get_max_distance(): nodes further than this are skipped when they
+//     are popped, so queries can shrink their range as they find results
+//   bool visit_leaf(const BVH_Node &leaf): process the primitives of a leaf,
+//     returning true ends the traversal
+template <typename Visitor>
+void traverse(const BVH_Tree &tree, Visitor &visitor) {
+  struct Stack_Item {
+    uint32_t node;
+    float distance;
+  };
+  // Each popped node pushes at most two children, one of them is popped next
+  Stack_Item stack[BVH_MAX_DEPTH];
+  uint32_t stack_size = 0;
+  std::optional<float> root_distance = visitor.intersect(tree.get_aabb());
+  if (!root_distance.has_value()) return;
+  stack[stack_size++] = {BVH_Tree::ROOT, *root_distance};
+  while (stack_size > 0) {
+    Stack_Item item = stack[--stack_size];
+    if (item.distance > visitor.get_max_distance()) continue;
+    const BVH_Node &node = tree.get_node(item.node);
+    if (node.is_leaf()) {
+      if (visitor.visit_leaf(node)) return;
+      continue;
+    }
+    uint32_t left = BVH_Node::left_child(item.node);
+    uint32_t right = node.right_child();
+    std::optional<float> left_distance =
+        visitor.intersect(tree.get_node(left).aabb);
+    std::optional<float> right_distance =
+        visitor.intersect(tree.get_node(right).aabb);
+    assert(stack_size + 2 <= BVH_MAX_DEPTH);
+    if (left_distance.has_value() && right_distance.has_value()) {
+      // Push the closer child last so it is visited first
+      if (*left_distance < *right_distance) {
+        stack[stack_size++] = {right, *right_distance};
+        stack[stack_size++] = {left, *left_distance};
+      } else {
+        stack[stack_size++] = {left, *left_distance};
+        stack[stack_size++] = {right, *right_distance};
+      }
+    } else if (left_distance.has_value()) {
+      stack[stack_size++] = {left, *left_distance};
+    } else if (right_distance.has_value()) {
+      stack[stack_size++] = {right, *right_distance};
+    }
+  }
+}
+
+// Cache file for the tree of the mesh at filepath, filepath.bvh by default.
+// The GEOPROC_BVH_CACHE environment variable either names a directory to keep
+// cache files in instead, or disables caching when set to "off".
+std::optional<std::string> get_bvh_cache_filepath(std::string_view filepath);
+
+// Load tree from cache_filepath if it was written for the same primitives and
+// build options, otherwise build it from the bounds of the primitives and
+// write the cache. Always builds without a cache file.
+template <typename Primitive>
+BVH_Tree load_or_build_bvh(const std::optional<std::string> &cache_filepath,
+                           const std::vector<Primitive> &primitives,
+                           const BVH_Build_Options &options) {
+  uint64_t hash =
+      calc_hash(primitives.data(), primitives.size() * sizeof(Primitive));
+  if (cache_filepath.has_value()) {
+    std::optional<BVH_Tree> cached =
+        BVH_Tree::load(*cache_filepath, hash, options);
+    if (cached.has_value()) return std::move(*cached);
+  }
+  std::vector<AABB> aabbs;
+  aabbs.reserve(primitives.size());
+  for (const Primitive &p : primitives) aabbs.push_back(p.calc_aabb());
+  BVH_Tree tree(aabbs, options);
+  // Failing to write the cache only costs a rebuild next time
+  if (cache_filepath.has_value()) tree.save(*cache_filepath, hash);
+  return tree;
+}
+
 struct Closest_Point_Result {
   uint32_t i;
   float t;
@@ -83,3 +278,83 @@ struct Closest_Point_Result {
 std::optional<Closest_Point_Result>
 closest_point(const Vec3 &p, const std::vector<Vec3> &points,
               const BVH_Tree &bvh);
+
+struct Closest_Triangle_Result {
+  uint32_t triangle_index;
+  // Closest point on the triangle and its barycentric coordinates
+  Vec3 point;
+  Vec3 barycentric;
+  float distance;
+};
+
+// Closest point to p on the surface formed by tris, nothing if no triangle is
+// within max_distance, which also prunes the search
+std::optional<Closest_Triangle_Result>
+closest_triangle(const Vec3 &p, const std::vector<Triangle> &tris,
+                 const BVH_Tree &bvh,
+                 float max_distance = std::numeric_limits<float>::infinity());
+
+struct Ray_Hit {
+  float t;
+  uint32_t triangle_index;
+};
+
+// Closest hit of r within t_max, nodes are visited front to back and culled
+// once they are behind the closest hit found so far
+std::optional<Ray_Hit> closest_hit(const Ray &r,
+                                   const std::vector<Triangle> &tris,
+                                   const BVH_Tree &bvh, float t_max = RAY_MAX);
+// Whether r hits any triangle within t_max, returns on the first hit found
+bool any_hit(const Ray &r, const std::vector<Triangle> &tris,
+             const BVH_Tree &bvh, float t_max = RAY_MAX);
+// Whether the segment is occluded by any triangle
+bool any_hit(const Segment &s, const std::vector<Triangle> &tris,
+             const BVH_Tree &bvh);
+// Number of hits of r within t_max, counting stops once max_count is reached
+size_t count_intersections(
+    const Ray &r, const std::vector<Triangle> &tris, const BVH_Tree &bvh,
+    float t_max = RAY_MAX,
+    size_t max_count = std::numeric_limits<size_t>::max());
+
+// Pairs of primitives (i of a, j of b) whose bounds overlap, found by
+// descending both trees together in parallel. Sorted by i, then by j.
+std::vector<std::pair<uint32_t, uint32_t>>
+find_overlapping_pairs(const BVH_Tree &a, const std::vector<AABB> &a_aabbs,
+                       const BVH_Tree &b, const std::vector<AABB> &b_aabbs);
+// Pairs of distinct primitives (i, j) of one tree whose bounds overlap, each
+// pair once with i < j. Sorted by i, then by j.
+std::vector<std::pair<uint32_t, uint32_t>>
+find_overlapping_pairs(const BVH_Tree &tree, const std::vector<AABB> &aabbs);
+
+// Memory for queries that need more than a fixed size stack, reuse one per
+// thread so that queries do not allocate once it has grown large enough
+struct BVH_Query_Scratch {
+  // Nodes to visit, with their distance, as a min heap
+  std::vector<std::pair<float, uint32_t>> node_queue;
+  std::vector<Closest_Point_Result> results;
+};
+
+// Exact k nearest points of p in order of increasing distance, found by best
+// first search. The result is stored in scratch and has less than k entries
+// only if there are less than k points.
+const std::vector<Closest_Point_Result> &
+k_nearest_points(const Vec3 &p, uint32_t k, const std::vector<Vec3> &points,
+                 const BVH_Tree &bvh, BVH_Query_Scratch &scratch);
+
+// Batched queries sort the query points along a Morton curve, so that
+// consecutive queries visit the same nodes, and process them in parallel.
+// Results are in the order of the queries.
+std::vector<std::optional<Closest_Point_Result>>
+closest_points(const std::vector<Vec3> &queries,
+               const std::vector<Vec3> &points, const BVH_Tree &bvh);
+// The k nearest points of each query, stored in min(k, points.size())
+// consecutive entries per query
+std::vector<Closest_Point_Result>
+k_nearest_points(const std::vector<Vec3> &queries, uint32_t k,
+                 const std::vector<Vec3> &points, const BVH_Tree &bvh);
+
+// All points at most radius away from p in no particular order, stored in
+// scratch
+const std::vector<Closest_Point_Result> &
+points_in_radius(const Vec3 &p, float radius, const std::vector<Vec3> &points,
+                 const BVH_Tree &bvh, BVH_Query_Scratch &scratch);
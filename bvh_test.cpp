@@ -0,0 +1,816 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <omp.h>
+#include <random>
+#include <stack>
+#include <vector>
+
+#include "aabb.hpp"
+#include "bvh.hpp"
+#include "compressed_bvh.hpp"
+#include "distance.hpp"
+#include "hash.hpp"
+#include "instance_bvh.hpp"
+#include "intersect.hpp"
+#include "ray_packet.hpp"
+#include "test.hpp"
+#include "transform.hpp"
+#include "triangle.hpp"
+#include "triangle_block.hpp"
+#include "vec.hpp"
+#include "wide_bvh.hpp"
+
+static bool contains(const AABB &outer, const AABB &inner) {
+  for (int i = 0; i < 3; i++) {
+    if (inner.min[i] < outer.min[i]) return false;
+    if (inner.max[i] > outer.max[i]) return false;
+  }
+  return true;
+}
+
+static std::vector<AABB> random_aabbs(uint32_t seed, uint32_t n) {
+  std::mt19937 e(seed);
+  std::uniform_real_distribution<float> pos_dist(-10.0f, 10.0f);
+  std::uniform_real_distribution<float> size_dist(0.0f, 0.5f);
+  std::vector<AABB> aabbs;
+  aabbs.reserve(n);
+  for (uint32_t i = 0; i < n; i++) {
+    Vec3 min(pos_dist(e), pos_dist(e), pos_dist(e));
+    Vec3 size(size_dist(e), size_dist(e), size_dist(e));
+    aabbs.emplace_back(min, min + size);
+  }
+  return aabbs;
+}
+
+static void check_tree(const BVH_Tree &tree, const std::vector<AABB> &aabbs) {
+  std::vector<uint32_t> visits(aabbs.size(), 0);
+  // The midpoint builder gives up on nodes it fails to partition
+  const BVH_Build_Options &options = tree.get_options();
+  bool check_leaf_size = options.split_method != BVH_Split_Method::Midpoint;
+  std::stack<uint32_t> stack;
+  stack.push(BVH_Tree::ROOT);
+  while (!stack.empty()) {
+    uint32_t node_index = stack.top();
+    stack.pop();
+    const BVH_Node &node = tree.get_node(node_index);
+    if (!node.is_leaf()) {
+      uint32_t left = BVH_Node::left_child(node_index);
+      uint32_t right = node.right_child();
+      assert_equals(contains(node.aabb, tree.get_node(left).aabb), true);
+      assert_equals(contains(node.aabb, tree.get_node(right).aabb), true);
+      stack.push(left);
+      stack.push(right);
+      continue;
+    }
+    if (check_leaf_size)
+      assert_equals(node.num_primitives <= options.max_leaf_size, true);
+    for (uint32_t i = node.start(); i < node.end(); i++) {
+      uint32_t pi = tree.remap_index(i);
+      assert_equals(contains(node.aabb, aabbs[pi]), true);
+      visits[pi]++;
+    }
+  }
+  for (uint32_t v : visits) assert_equals(v, 1u);
+
+  BVH_Stats stats = tree.calc_stats();
+  assert_equals(stats.num_nodes, stats.num_leaves * 2 - 1);
+  assert_equals(stats.num_nodes, tree.get_num_nodes());
+  uint32_t num_leaves = 0;
+  uint32_t num_primitives = 0;
+  for (uint32_t n = 0; n < stats.leaf_size_histogram.size(); n++) {
+    num_leaves += stats.leaf_size_histogram[n];
+    num_primitives += n * stats.leaf_size_histogram[n];
+  }
+  assert_equals(num_leaves, stats.num_leaves);
+  assert_equals(num_primitives, aabbs.size());
+}
+
+static bool is_same_aabb(const AABB &a, const AABB &b) {
+  for (int i = 0; i < 3; i++) {
+    if (a.min[i] != b.min[i]) return false;
+    if (a.max[i] != b.max[i]) return false;
+  }
+  return true;
+}
+
+static void check_same_tree(const BVH_Tree &a, const BVH_Tree &b) {
+  assert_equals(a.get_num_nodes(), b.get_num_nodes());
+  for (uint32_t i = 0; i < a.get_num_nodes(); i++) {
+    const BVH_Node &node_a = a.get_node(i);
+    const BVH_Node &node_b = b.get_node(i);
+    assert_equals(is_same_aabb(node_a.aabb, node_b.aabb), true);
+    assert_equals(node_a.offset, node_b.offset);
+    assert_equals(node_a.num_primitives, node_b.num_primitives);
+    if (!node_a.is_leaf()) continue;
+    for (uint32_t j = node_a.start(); j < node_a.end(); j++)
+      assert_equals(a.remap_index(j), b.remap_index(j));
+  }
+}
+
+static void check_thread_count_independence(const std::vector<AABB> &aabbs,
+                                            const BVH_Build_Options &options) {
+  int max_threads = omp_get_max_threads();
+  omp_set_num_threads(1);
+  BVH_Tree single_threaded(aabbs, options);
+  omp_set_num_threads(4);
+  BVH_Tree multi_threaded(aabbs, options);
+  omp_set_num_threads(max_threads);
+  check_tree(multi_threaded, aabbs);
+  check_same_tree(single_threaded, multi_threaded);
+}
+
+static void check_refit(const std::vector<AABB> &aabbs,
+                        const BVH_Build_Options &options) {
+  BVH_Tree tree(aabbs, options);
+  // Refitting to the same primitives must reproduce the tight bounds
+  BVH_Tree refitted = tree;
+  refitted.refit(aabbs);
+  check_same_tree(refitted, tree);
+
+  // Small motion keeps the tree valid without rebuilding anything
+  std::vector<AABB> moved;
+  for (const AABB &aabb : aabbs)
+    moved.emplace_back(aabb.min + Vec3(0.01f), aabb.max + Vec3(0.02f));
+  assert_equals(refitted.refit(moved, 2.0f), 0u);
+  check_tree(refitted, moved);
+
+  // Swapping primitives around destroys the spatial coherence of the
+  // subtrees, which must trigger rebuilds that lower the cost again
+  std::vector<AABB> shuffled = moved;
+  std::shuffle(shuffled.begin(), shuffled.end(), std::mt19937(42));
+  BVH_Tree only_refitted = refitted;
+  only_refitted.refit(shuffled);
+  assert_equals(refitted.refit(shuffled, 2.0f) > 0, true);
+  check_tree(refitted, shuffled);
+  assert_equals(refitted.calc_stats().sah_cost <
+                    only_refitted.calc_stats().sah_cost,
+                true);
+
+  // Degradation is measured against the built tree even when it was only
+  // refitted before
+  BVH_Tree refitted_first = tree;
+  refitted_first.refit(shuffled);
+  assert_equals(refitted_first.refit(shuffled, 2.0f) > 0, true);
+  check_tree(refitted_first, shuffled);
+}
+
+static void check_cache(const BVH_Tree &tree,
+                        const std::vector<AABB> &aabbs) {
+  const char *filepath = "test_bvh_cache.bvh";
+  uint64_t hash = calc_hash(aabbs.data(), aabbs.size() * sizeof(AABB));
+  assert_equals(tree.save(filepath, hash), true);
+  std::optional<BVH_Tree> loaded =
+      BVH_Tree::load(filepath, hash, tree.get_options());
+  assert_equals(loaded.has_value(), true);
+  check_same_tree(*loaded, tree);
+  check_tree(*loaded, aabbs);
+
+  // Copies share the mapping, refitting copies the tree out of it first
+  BVH_Tree refitted = *loaded;
+  refitted.refit(aabbs);
+  check_same_tree(refitted, tree);
+  loaded.reset();
+  check_same_tree(refitted, tree);
+
+  // Saving replaces the file instead of truncating the mapped one
+  loaded = BVH_Tree::load(filepath, hash, tree.get_options());
+  assert_equals(loaded.has_value(), true);
+  assert_equals(refitted.save(filepath, hash), true);
+  check_same_tree(*loaded, tree);
+  loaded.reset();
+
+  // Stale caches
+  assert_equals(BVH_Tree::load(filepath, hash + 1, tree.get_options())
+                    .has_value(),
+                false);
+  BVH_Build_Options other_options = tree.get_options();
+  other_options.max_leaf_size++;
+  assert_equals(BVH_Tree::load(filepath, hash, other_options).has_value(),
+                false);
+  assert_equals(
+      BVH_Tree::load("missing.bvh", hash, tree.get_options()).has_value(),
+      false);
+
+  // Damaged caches with indices out of range
+  auto corrupt = [&](uint64_t position, uint32_t value) {
+    assert_equals(tree.save(filepath, hash), true);
+    std::fstream fs(filepath,
+                    std::ios_base::in | std::ios_base::out |
+                        std::ios_base::binary);
+    fs.seekp(position);
+    fs.write((const char *)&value, sizeof(value));
+    fs.close();
+    return BVH_Tree::load(filepath, hash, tree.get_options()).has_value();
+  };
+  uint64_t header_size = 2 * sizeof(BVH_Node);
+  uint64_t root_offset = header_size + offsetof(BVH_Node, offset);
+  uint64_t map_start =
+      header_size + uint64_t(tree.get_num_nodes()) * sizeof(BVH_Node);
+  assert_equals(corrupt(root_offset, tree.get_num_nodes()), false);
+  assert_equals(corrupt(map_start, tree.get_num_primitives()), false);
+  if (!tree.get_node(BVH_Tree::ROOT).is_leaf())
+    assert_equals(corrupt(root_offset, BVH_Node::left_child(BVH_Tree::ROOT)),
+                  false);
+  assert_equals(corrupt(map_start, 0), true);
+  std::remove(filepath);
+}
+
+static void check_neighbor_queries(const BVH_Tree &tree,
+                                   const std::vector<Vec3> &points,
+                                   const std::vector<Vec3> &queries) {
+  BVH_Query_Scratch scratch;
+  std::vector<float> expected;
+  for (const Vec3 &q : queries) {
+    expected.clear();
+    for (const Vec3 &p : points) expected.push_back(q.dist(p));
+    std::sort(expected.begin(), expected.end());
+    for (uint32_t k : {1u, 5u, 32u, uint32_t(points.size() + 1)}) {
+      const auto &nearest = k_nearest_points(q, k, points, tree, scratch);
+      assert_equals(nearest.size(), std::min<size_t>(k, points.size()));
+      for (size_t i = 0; i < nearest.size(); i++) {
+        assert_equals(nearest[i].t, expected[i]);
+        assert_equals(nearest[i].t, q.dist(points[nearest[i].i]));
+      }
+    }
+    float radius = expected[std::min<size_t>(20, expected.size() - 1)];
+    size_t expected_count =
+        std::upper_bound(expected.begin(), expected.end(), radius) -
+        expected.begin();
+    const auto &in_radius = points_in_radius(q, radius, points, tree, scratch);
+    assert_equals(in_radius.size(), expected_count);
+    for (const Closest_Point_Result &r : in_radius)
+      assert_equals(q.dist(points[r.i]) <= radius, true);
+  }
+
+  // Batches give the same results in the order of the queries
+  auto closest = closest_points(queries, points, tree);
+  std::vector<Closest_Point_Result> nearest =
+      k_nearest_points(queries, 5, points, tree);
+  assert_equals(closest.size(), queries.size());
+  assert_equals(nearest.size(), queries.size() * 5);
+  for (size_t i = 0; i < queries.size(); i++) {
+    assert_equals(closest[i]->t, closest_point(queries[i], points, tree)->t);
+    const auto &expected =
+        k_nearest_points(queries[i], 5, points, tree, scratch);
+    for (size_t j = 0; j < 5; j++)
+      assert_equals(nearest[i * 5 + j].t, expected[j].t);
+  }
+}
+
+static std::vector<Triangle> random_triangles(uint32_t seed, uint32_t n) {
+  std::mt19937 e(seed);
+  std::uniform_real_distribution<float> pos_dist(-10.0f, 10.0f);
+  std::uniform_real_distribution<float> offset_dist(-1.0f, 1.0f);
+  auto random_offset = [&] {
+    return Vec3(offset_dist(e), offset_dist(e), offset_dist(e));
+  };
+  std::vector<Triangle> tris;
+  tris.reserve(n);
+  for (uint32_t i = 0; i < n; i++) {
+    Vec3 a(pos_dist(e), pos_dist(e), pos_dist(e));
+    tris.emplace_back(a, a + random_offset(), a + random_offset());
+  }
+  return tris;
+}
+
+static std::vector<Ray> random_rays(uint32_t seed, uint32_t n) {
+  std::mt19937 e(seed);
+  std::uniform_real_distribution<float> pos_dist(-12.0f, 12.0f);
+  std::uniform_real_distribution<float> dir_dist(-1.0f, 1.0f);
+  std::vector<Ray> rays;
+  rays.reserve(n);
+  for (uint32_t i = 0; i < n; i++) {
+    Vec3 origin(pos_dist(e), pos_dist(e), pos_dist(e));
+    Vec3 direction(dir_dist(e), dir_dist(e), dir_dist(e));
+    rays.push_back({origin, direction.normalized()});
+  }
+  // Axis aligned directions have infinite reciprocals in slab tests
+  rays.push_back({Vec3(0.0f), Vec3(0, 0, 1)});
+  rays.push_back({Vec3(1, 2, -11), Vec3(0, 0, 1)});
+  return rays;
+}
+
+static void check_closest_triangle(const BVH_Tree &tree,
+                                   const std::vector<Triangle> &tris,
+                                   const std::vector<Vec3> &queries) {
+  for (const Vec3 &q : queries) {
+    float expected = std::numeric_limits<float>::infinity();
+    for (const Triangle &t : tris) {
+      Vec3 closest = closest_point_on_triangle(q, t).point;
+      expected = std::min(expected, q.dist(closest));
+    }
+    auto result = closest_triangle(q, tris, tree);
+    assert_equals(result.has_value(), true);
+    assert_close(result->distance, expected, 1e-5f);
+    const Triangle &t = tris[result->triangle_index];
+    Vec3 closest = closest_point_on_triangle(q, t).point;
+    assert_close(closest.dist(result->point), 0.0f, 1e-5f);
+    // Cut off just below and above the closest distance
+    assert_equals(closest_triangle(q, tris, tree, expected * 0.99f).has_value(),
+                  false);
+    assert_equals(closest_triangle(q, tris, tree, expected * 1.01f).has_value(),
+                  true);
+  }
+}
+
+static void check_ray_queries(const BVH_Tree &tree,
+                              const std::vector<Triangle> &tris,
+                              const std::vector<Ray> &rays) {
+  const float t_max = 5.0f;
+  for (const Ray &r : rays) {
+    size_t expected_count = 0;
+    size_t expected_count_within = 0;
+    std::optional<float> expected_t;
+    for (const Triangle &t : tris) {
+      auto hit = intersect(r, t);
+      if (!hit.has_value()) continue;
+      expected_count++;
+      if (*hit <= t_max) expected_count_within++;
+      if (!expected_t.has_value() || *hit < *expected_t) expected_t = hit;
+    }
+    assert_equals(count_intersections(r, tris, tree), expected_count);
+    assert_equals(count_intersections(r, tris, tree, t_max),
+                  expected_count_within);
+    assert_equals(count_intersections(r, tris, tree, RAY_MAX, 3),
+                  std::min<size_t>(expected_count, 3));
+    assert_equals(any_hit(r, tris, tree), expected_count > 0);
+    Segment s{r.origin, r.origin + r.direction * t_max};
+    assert_equals(any_hit(s, tris, tree), expected_count_within > 0);
+    auto hit = closest_hit(r, tris, tree);
+    assert_equals(hit.has_value(), expected_t.has_value());
+    if (!hit.has_value()) continue;
+    assert_equals(hit->t, *expected_t);
+    assert_equals(intersect(r, tris[hit->triangle_index]).value(), hit->t);
+    assert_equals(closest_hit(r, tris, tree, hit->t * 0.99f).has_value(),
+                  false);
+  }
+}
+
+template <uint32_t N>
+static void check_ray_packets(const BVH_Tree &tree,
+                              const std::vector<Triangle> &tris,
+                              const std::vector<Ray> &rays) {
+  Triangle_Blocks blocks(tris, tree);
+  for (size_t start = 0; start < rays.size(); start += N) {
+    Ray_Packet<N> packet;
+    for (size_t i = start; i < std::min(start + N, rays.size()); i++)
+      packet.push(rays[i]);
+    std::optional<Ray_Hit> hits[N];
+    std::optional<Ray_Hit> block_hits[N];
+    closest_hits(packet, tris, tree, hits);
+    closest_hits(packet, blocks, tree, block_hits);
+    for (uint32_t i = 0; i < N; i++) {
+      if (i >= packet.num_rays) {
+        assert_equals(hits[i].has_value(), false);
+        assert_equals(block_hits[i].has_value(), false);
+        continue;
+      }
+      auto expected = closest_hit(rays[start + i], tris, tree);
+      assert_equals(hits[i].has_value(), expected.has_value());
+      assert_equals(block_hits[i].has_value(), expected.has_value());
+      if (!expected.has_value()) continue;
+      assert_equals(hits[i]->t, expected->t);
+      assert_equals(block_hits[i]->triangle_index, expected->triangle_index);
+    }
+  }
+}
+
+// Packet box tests must agree with Slab_Ray for each ray, also for rays
+// parallel to a slab with their origin on its min or max plane
+template <uint32_t N> static void check_packet_slabs(SIMD_Level level) {
+  AABB box(Vec3(-1.0f), Vec3(2.0f));
+  std::vector<Ray> rays;
+  for (int axis = 0; axis < 3; axis++)
+    for (float plane : {box.min[axis], box.max[axis], 0.5f, 3.0f})
+      for (float dir : {0.0f, -0.0f})
+        for (float way : {1.0f, -1.0f}) {
+          int along = axis == 2 ? 0 : 2;
+          Vec3 origin(0.5f);
+          Vec3 direction(0.25f * way, 0.5f * way, 0.75f * way);
+          origin[axis] = plane;
+          origin[along] = -5.0f * way;
+          direction[axis] = dir;
+          rays.push_back({origin, direction});
+        }
+  alignas(32) float t_max[N];
+  for (uint32_t i = 0; i < N; i++) t_max[i] = RAY_MAX;
+  for (size_t start = 0; start < rays.size(); start += N) {
+    Ray_Packet<N> packet;
+    for (size_t i = start; i < std::min(start + N, rays.size()); i++)
+      packet.push(rays[i]);
+    uint32_t mask = intersect_packet(box, packet, t_max, level);
+    for (uint32_t i = 0; i < N; i++) {
+      bool expected = i < packet.num_rays &&
+                      intersect(Slab_Ray(rays[start + i]), box).has_value();
+      assert_equals(bool((mask >> i) & 1), expected);
+    }
+  }
+}
+
+// Checks that every primitive is in exactly one leaf whose decoded bounds
+// contain it
+template <typename T>
+static void check_compressed_bounds(const Compressed_BVH<T> &compressed,
+                                    const std::vector<AABB> &aabbs) {
+  struct Leaf_Visitor {
+    const Compressed_BVH<T> &bvh;
+    const std::vector<AABB> &aabbs;
+    std::vector<uint32_t> num_visits;
+    std::optional<float> intersect(const AABB &) const { return 0.0f; }
+    float get_max_distance() const { return 0.0f; }
+    bool visit_leaf(const BVH_Node &leaf) {
+      for (uint32_t i = leaf.start(); i < leaf.end(); i++) {
+        uint32_t pi = bvh.remap_index(i);
+        assert_equals(contains(leaf.aabb, aabbs[pi]), true);
+        num_visits[pi]++;
+      }
+      return false;
+    }
+  };
+  Leaf_Visitor visitor{compressed, aabbs,
+                       std::vector<uint32_t>(aabbs.size(), 0)};
+  traverse(compressed, visitor);
+  for (uint32_t n : visitor.num_visits) assert_equals(n, 1u);
+}
+
+template <typename T>
+static void check_compressed_bvh(const BVH_Tree &tree,
+                                 const std::vector<Triangle> &tris,
+                                 const std::vector<Ray> &rays,
+                                 const std::vector<Vec3> &queries) {
+  Compressed_BVH<T> compressed(tree);
+  std::vector<AABB> aabbs;
+  for (const Triangle &t : tris) aabbs.push_back(t.calc_aabb());
+  check_compressed_bounds(compressed, aabbs);
+  assert_equals(compressed.calc_memory_size() <
+                    tree.get_num_nodes() * sizeof(BVH_Node),
+                true);
+  for (const Ray &r : rays) {
+    auto expected = closest_hit(r, tris, tree);
+    auto hit = closest_hit(r, tris, compressed);
+    assert_equals(hit.has_value(), expected.has_value());
+    if (hit.has_value()) assert_equals(hit->t, expected->t);
+  }
+  for (const Vec3 &q : queries) {
+    auto expected = closest_triangle(q, tris, tree);
+    auto result = closest_triangle(q, tris, compressed);
+    assert_equals(result->distance, expected->distance);
+  }
+}
+
+// Compares an instance BVH against one BVH over all instances flattened into
+// world space triangles
+static void check_instance_hits(const Instance_BVH &scene,
+                                const std::vector<Ray> &rays) {
+  std::vector<Triangle> world_tris;
+  for (uint32_t i = 0; i < scene.get_num_instances(); i++) {
+    const BVH_Instance &instance = scene.get_instance(i);
+    for (const Triangle &t : instance.geometry->tris)
+      world_tris.emplace_back(instance.transform.apply_to_point(t.a),
+                              instance.transform.apply_to_point(t.b),
+                              instance.transform.apply_to_point(t.c));
+  }
+  std::vector<AABB> aabbs;
+  for (const Triangle &t : world_tris) aabbs.push_back(t.calc_aabb());
+  BVH_Tree flat(aabbs);
+  for (const Ray &r : rays) {
+    auto expected = closest_hit(r, world_tris, flat);
+    auto hit = closest_hit(r, scene);
+    assert_equals(hit.has_value(), expected.has_value());
+    assert_equals(any_hit(r, scene), expected.has_value());
+    if (!hit.has_value()) continue;
+    assert_close(hit->t, expected->t, 1e-3f);
+  }
+}
+
+static void check_instance_bvh(const std::vector<Triangle> &tris,
+                               const std::vector<Ray> &rays) {
+  Affine_Transform t = Affine_Transform::translate(Vec3(1, 2, 3)) *
+                       Affine_Transform::rotate_z(0.5f) *
+                       Affine_Transform::scale(Vec3(2, 1, 0.5f));
+  Affine_Transform round_trip = *t.inverted() * t;
+  Vec3 p(3, -4, 5);
+  assert_close(round_trip.apply_to_point(p).dist(p), 0.0f, 1e-5f);
+  AABB box(Vec3(-1, 0, 1), Vec3(2, 3, 4));
+  for (const Vec3 &v : box.vertices())
+    assert_equals(contains(t.apply_to_aabb(box),
+                           AABB(t.apply_to_point(v), t.apply_to_point(v))),
+                  true);
+
+  // Few small meshes instanced many times
+  auto geometry = std::make_shared<const BVH_Geometry>(
+      std::vector<Triangle>(tris.begin(), tris.begin() + 100),
+      BVH_Build_Options());
+  std::vector<BVH_Instance> instances;
+  for (int i = 0; i < 20; i++) {
+    Affine_Transform transform =
+        Affine_Transform::translate(Vec3(float(i % 5) * 4.0f - 8.0f,
+                                         float(i / 5) * 4.0f - 8.0f, 0)) *
+        Affine_Transform::rotate_z(float(i)) *
+        Affine_Transform::scale(Vec3(0.3f + 0.02f * float(i)));
+    instances.push_back({geometry, transform});
+  }
+  Instance_BVH scene(instances);
+  check_instance_hits(scene, rays);
+  // Move instances and update the top level tree only
+  for (uint32_t i = 0; i < scene.get_num_instances(); i += 3)
+    scene.set_transform(i, Affine_Transform::translate(Vec3(0, 0, 5)) *
+                               scene.get_instance(i).transform);
+  scene.update();
+  check_instance_hits(scene, rays);
+}
+
+static void check_overlapping_pairs(const std::vector<AABB> &a_aabbs,
+                                    const std::vector<AABB> &b_aabbs,
+                                    const BVH_Build_Options &options) {
+  BVH_Tree a(a_aabbs, options);
+  BVH_Tree b(b_aabbs, options);
+  std::vector<std::pair<uint32_t, uint32_t>> expected;
+  for (uint32_t i = 0; i < a_aabbs.size(); i++)
+    for (uint32_t j = 0; j < b_aabbs.size(); j++)
+      if (a_aabbs[i].overlaps(b_aabbs[j])) expected.push_back({i, j});
+  assert_equals(find_overlapping_pairs(a, a_aabbs, b, b_aabbs) == expected,
+                true);
+  expected.clear();
+  for (uint32_t i = 0; i < a_aabbs.size(); i++)
+    for (uint32_t j = i + 1; j < a_aabbs.size(); j++)
+      if (a_aabbs[i].overlaps(a_aabbs[j])) expected.push_back({i, j});
+  assert_equals(find_overlapping_pairs(a, a_aabbs) == expected, true);
+}
+
+static void check_wide_bvh(const BVH_Tree &tree,
+                           const std::vector<Triangle> &tris,
+                           const std::vector<Ray> &rays,
+                           const std::vector<Vec3> &queries,
+                           const std::vector<Vec3> &points,
+                           const BVH_Tree &points_tree, SIMD_Level level) {
+  Wide_BVH wide(tree, level);
+  for (const Ray &r : rays) {
+    size_t expected_count = 0;
+    std::optional<float> expected_t;
+    for (const Triangle &t : tris) {
+      auto hit = intersect(r, t);
+      if (!hit.has_value()) continue;
+      expected_count++;
+      if (!expected_t.has_value() || *hit < *expected_t) expected_t = hit;
+    }
+    assert_equals(count_intersections(r, wide, tris), expected_count);
+    auto hit = closest_hit(r, wide, tris);
+    assert_equals(hit.has_value(), expected_t.has_value());
+    if (hit.has_value()) assert_equals(hit->t, *expected_t);
+  }
+
+  Wide_BVH wide_points(points_tree, level);
+  for (const Vec3 &q : queries) {
+    float expected = std::numeric_limits<float>::infinity();
+    for (const Vec3 &p : points) expected = std::min(expected, q.dist(p));
+    auto result = closest_point(q, points, wide_points);
+    assert_equals(result.has_value(), true);
+    assert_equals(result->t, expected);
+  }
+}
+
+// Children boxes tested by wide nodes must agree with Slab_Ray, also for rays
+// parallel to a slab with their origin on its min or max plane, which gives
+// NaN slab distances
+template <uint32_t N> static void check_wide_node_slabs(SIMD_Level level) {
+  AABB box(Vec3(-1.0f), Vec3(2.0f));
+  Wide_BVH_Node<N> node;
+  for (uint32_t i = 0; i < N; i++) {
+    node.min_x[i] = box.min.x;
+    node.min_y[i] = box.min.y;
+    node.min_z[i] = box.min.z;
+    node.max_x[i] = box.max.x;
+    node.max_y[i] = box.max.y;
+    node.max_z[i] = box.max.z;
+    node.offset[i] = 0;
+    node.num_primitives[i] = 1;
+  }
+  node.num_children = N;
+  alignas(32) float t_near[N];
+  for (int axis = 0; axis < 3; axis++)
+    for (float plane : {box.min[axis], box.max[axis], 0.5f, 3.0f})
+      for (float dir : {0.0f, -0.0f}) {
+        Vec3 origin(0.5f, 0.5f, -5.0f);
+        Vec3 direction(0.25f, 0.5f, 1.0f);
+        if (axis == 2) {
+          origin = Vec3(-5.0f, 0.5f, 0.5f);
+          direction = Vec3(1.0f, 0.5f, 0.25f);
+        }
+        origin[axis] = plane;
+        direction[axis] = dir;
+        Slab_Ray r(Ray{origin, direction});
+        std::optional<float> expected = intersect(r, box);
+        uint32_t mask = intersect_children(node, r, RAY_MAX, t_near, level);
+        assert_equals(mask, expected.has_value() ? node.children_mask() : 0u);
+        for (uint32_t i = 0; i < N && expected.has_value(); i++)
+          assert_equals(t_near[i], *expected);
+      }
+}
+
+static void check_triangle_blocks(const BVH_Tree &tree,
+                                  const std::vector<Triangle> &tris,
+                                  const std::vector<Ray> &rays,
+                                  SIMD_Level level) {
+  Triangle_Blocks blocks(tris, tree, level);
+  assert_equals(blocks.size(), tris.size());
+  float t[TRIANGLE_BLOCK_SIZE];
+  for (const Ray &r : rays) {
+    Watertight_Ray ray(r);
+    // Blocks at every offset and of every size, with a limit that culls some
+    // of the hits
+    for (float t_max : {RAY_MAX, 5.0f})
+      for (uint32_t start = 0; start < blocks.size(); start += 5) {
+        uint32_t count = std::min<uint32_t>(1 + start % TRIANGLE_BLOCK_SIZE,
+                                            blocks.size() - start);
+        uint32_t mask = intersect(ray, blocks, start, count, t_max, t);
+        for (uint32_t i = 0; i < count; i++) {
+          const Triangle &tri = tris[blocks.remap_index(start + i)];
+          auto expected = intersect(ray, tri, t_max);
+          assert_equals(bool((mask >> i) & 1), expected.has_value());
+          if (expected.has_value()) assert_equals(t[i], *expected);
+        }
+        assert_equals(mask >> count, 0u);
+      }
+    auto hit = closest_hit(ray, blocks, 0, blocks.size());
+    auto expected = closest_hit(r, tris, tree);
+    assert_equals(hit.has_value(), expected.has_value());
+    if (hit.has_value()) assert_equals(hit->t, expected->t);
+  }
+
+  // Rays exactly through the vertices and edges of a grid hit it once
+  std::vector<Triangle> grid;
+  for (int x = 0; x < 4; x++)
+    for (int y = 0; y < 4; y++) {
+      Vec3 p(float(x), float(y), 0.0f);
+      grid.emplace_back(p, p + Vec3(1, 0, 0), p + Vec3(1, 1, 0));
+      grid.emplace_back(p, p + Vec3(1, 1, 0), p + Vec3(0, 1, 0));
+    }
+  std::vector<AABB> grid_aabbs;
+  for (const Triangle &tri : grid) grid_aabbs.push_back(tri.calc_aabb());
+  BVH_Build_Options options;
+  options.max_leaf_size = TRIANGLE_BLOCK_SIZE;
+  BVH_Tree grid_tree(grid_aabbs, options);
+  Triangle_Blocks grid_blocks(grid, grid_tree, level);
+  for (float x = 0.5f; x < 4.0f; x += 0.5f)
+    for (float y = 0.5f; y < 4.0f; y += 0.5f)
+      for (float dz : {-1.0f, 1.0f}) {
+        Watertight_Ray ray(Ray{Vec3(x, y, -dz), Vec3(0.0f, 0.0f, dz)});
+        uint32_t num_hits = 0;
+        for (uint32_t start = 0; start < grid_blocks.size();
+             start += TRIANGLE_BLOCK_SIZE) {
+          uint32_t count = std::min(TRIANGLE_BLOCK_SIZE,
+                                    grid_blocks.size() - start);
+          uint32_t mask = intersect(ray, grid_blocks, start, count, RAY_MAX, t);
+          for (; mask != 0; mask >>= 1) num_hits += mask & 1;
+        }
+        assert_equals(num_hits, 1u);
+      }
+}
+
+int main() {
+  std::vector<AABB> aabbs = random_aabbs(1234, 5000);
+
+  BVH_Tree midpoint_tree(aabbs);
+  check_tree(midpoint_tree, aabbs);
+
+  for (uint32_t max_leaf_size : {1u, 4u, 8u}) {
+    BVH_Build_Options options;
+    options.split_method = BVH_Split_Method::SAH;
+    options.max_leaf_size = max_leaf_size;
+    BVH_Tree sah_tree(aabbs, options);
+    check_tree(sah_tree, aabbs);
+  }
+
+  for (uint32_t morton_code_bits : {30u, 63u}) {
+    BVH_Build_Options options;
+    options.split_method = BVH_Split_Method::Morton;
+    options.morton_code_bits = morton_code_bits;
+    BVH_Tree morton_tree(aabbs, options);
+    check_tree(morton_tree, aabbs);
+    // Points share cells on the flat axis
+    std::vector<AABB> flat;
+    for (const AABB &aabb : aabbs)
+      flat.emplace_back(Vec3(aabb.min.x, aabb.min.y, 0.0f),
+                        Vec3(aabb.min.x, aabb.min.y, 0.0f));
+    options.max_leaf_size = 4;
+    BVH_Tree flat_tree(flat, options);
+    check_tree(flat_tree, flat);
+  }
+
+  // Identical primitives can not be split spatially
+  std::vector<AABB> same(37, AABB(Vec3(1.0f), Vec3(2.0f)));
+  BVH_Build_Options options;
+  options.split_method = BVH_Split_Method::SAH;
+  options.max_leaf_size = 4;
+  BVH_Tree same_tree(same, options);
+  check_tree(same_tree, same);
+
+  // Large enough for the parallel build to split loops and spawn tasks
+  std::vector<AABB> many_aabbs = random_aabbs(4321, 100000);
+  check_thread_count_independence(many_aabbs, BVH_Build_Options());
+  check_thread_count_independence(many_aabbs, options);
+  BVH_Build_Options morton_options;
+  morton_options.split_method = BVH_Split_Method::Morton;
+  check_thread_count_independence(many_aabbs, morton_options);
+
+  check_refit(aabbs, BVH_Build_Options());
+  check_refit(aabbs, options);
+  check_refit(many_aabbs, morton_options);
+
+  check_cache(BVH_Tree(many_aabbs, options), many_aabbs);
+
+  // Points packed exponentially closer together would make the midpoint
+  // builder split off one point per level
+  std::vector<AABB> clustered;
+  for (int i = 0; i < 120; i++) {
+    Vec3 p(std::ldexp(1.0f, -i), 0.0f, 0.0f);
+    clustered.emplace_back(p, p);
+  }
+  for (BVH_Split_Method split_method :
+       {BVH_Split_Method::Midpoint, BVH_Split_Method::SAH}) {
+    BVH_Build_Options clustered_options;
+    clustered_options.split_method = split_method;
+    BVH_Tree clustered_tree(clustered, clustered_options);
+    check_tree(clustered_tree, clustered);
+    assert_equals(clustered_tree.calc_stats().max_depth < BVH_MAX_DEPTH, true);
+  }
+
+  BVH_Tree copy = same_tree;
+  check_same_tree(copy, same_tree);
+
+  std::vector<Triangle> tris = random_triangles(5678, 3000);
+  std::vector<AABB> tri_aabbs;
+  for (const Triangle &t : tris) tri_aabbs.push_back(t.calc_aabb());
+  BVH_Tree tri_tree(tri_aabbs, options);
+  std::vector<Ray> rays = random_rays(8765, 300);
+  std::vector<Vec3> points;
+  std::vector<AABB> point_aabbs;
+  for (const AABB &aabb : random_aabbs(1111, 3000)) {
+    points.push_back(aabb.min);
+    point_aabbs.emplace_back(aabb.min, aabb.min);
+  }
+  BVH_Tree points_tree(point_aabbs);
+  std::vector<Vec3> queries;
+  for (const AABB &aabb : random_aabbs(2222, 300)) queries.push_back(aabb.max);
+  for (const Vec3 &q : queries) {
+    float expected = std::numeric_limits<float>::infinity();
+    for (const Vec3 &p : points) expected = std::min(expected, q.dist(p));
+    auto result = closest_point(q, points, points_tree);
+    assert_equals(result.has_value(), true);
+    assert_equals(result->t, expected);
+  }
+  check_closest_triangle(tri_tree, tris, queries);
+  check_ray_queries(tri_tree, tris, rays);
+  check_ray_packets<4>(tri_tree, tris, rays);
+  check_ray_packets<8>(tri_tree, tris, rays);
+  check_ray_packets<16>(tri_tree, tris, rays);
+  check_compressed_bvh<uint8_t>(tri_tree, tris, rays, queries);
+  check_compressed_bvh<uint16_t>(tri_tree, tris, rays, queries);
+  check_instance_bvh(tris, rays);
+  check_overlapping_pairs(aabbs, random_aabbs(3333, 700), BVH_Build_Options());
+  check_overlapping_pairs(aabbs, random_aabbs(3333, 700), options);
+  check_overlapping_pairs(tri_aabbs, tri_aabbs, morton_options);
+  {
+    // A single leaf too large for compressed nodes
+    std::vector<AABB> same_aabbs(70000, AABB(Vec3(1.0f), Vec3(2.0f)));
+    BVH_Tree one_leaf(same_aabbs);
+    assert_equals(one_leaf.get_num_nodes(), 1u);
+    check_compressed_bounds(Compressed_BVH<uint8_t>(one_leaf), same_aabbs);
+  }
+  std::vector<std::optional<Ray_Hit>> batch_hits =
+      closest_hits(rays, tris, tri_tree);
+  for (size_t i = 0; i < rays.size(); i++) {
+    auto expected = closest_hit(rays[i], tris, tri_tree);
+    assert_equals(batch_hits[i].has_value(), expected.has_value());
+    if (expected.has_value())
+      assert_equals(batch_hits[i]->triangle_index, expected->triangle_index);
+  }
+  check_neighbor_queries(points_tree, points, queries);
+  BVH_Build_Options points_options;
+  points_options.split_method = BVH_Split_Method::Morton;
+  points_options.max_leaf_size = 8;
+  check_neighbor_queries(BVH_Tree(point_aabbs, points_options), points,
+                         queries);
+  std::vector<SIMD_Level> levels = {SIMD_Level::Scalar};
+  if (detect_simd_level() >= SIMD_Level::SSE) levels.push_back(SIMD_Level::SSE);
+  if (detect_simd_level() >= SIMD_Level::AVX2)
+    levels.push_back(SIMD_Level::AVX2);
+  for (SIMD_Level level : levels) {
+    check_wide_bvh(tri_tree, tris, rays, queries, points, points_tree, level);
+    if (level != SIMD_Level::AVX2) check_wide_node_slabs<4>(level);
+    if (level != SIMD_Level::SSE) check_wide_node_slabs<8>(level);
+    check_packet_slabs<4>(level);
+    check_packet_slabs<8>(level);
+    check_packet_slabs<16>(level);
+    check_triangle_blocks(tri_tree, tris, rays, level);
+  }
+  return 0;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+#include "aabb.hpp"
+#include "bvh.hpp"
+#include "distance.hpp"
+#include "intersect.hpp"
+#include "ray.hpp"
+#include "triangle.hpp"
+#include "vec.hpp"
+
+// Visitors for traverse() shared by the tree layouts, Tree is any tree that
+// provides remap_index(), like BVH_Tree and Compressed_BVH
+
+template <typename Tree> struct Closest_Triangle_Visitor {
+  const Vec3 &p;
+  const std::vector<Triangle> &tris;
+  const Tree &bvh;
+  // Squared distances are compared to avoid square roots
+  float max_d2;
+  std::optional<Closest_Triangle_Result> result;
+
+  std::optional<float> intersect(const AABB &aabb) const {
+    float d2 = squared_distance_to_volume(p, aabb);
+    if (d2 > max_d2) return std::nullopt;
+    return d2;
+  }
+  float get_max_distance() const { return max_d2; }
+  bool visit_leaf(const BVH_Node &leaf) {
+    for (uint32_t i = leaf.start(); i < leaf.end(); i++) {
+      uint32_t ti = bvh.remap_index(i);
+      Closest_Point_On_Triangle cp = closest_point_on_triangle(p, tris[ti]);
+      Vec3 d = cp.point - p;
+      float d2 = d.dot(d);
+      // Ties keep the triangle found first
+      if (d2 > max_d2 || (result.has_value() && d2 == max_d2)) continue;
+      max_d2 = d2;
+      result = {ti, cp.point, cp.barycentric, 0.0f};
+    }
+    return false;
+  }
+};
+
+template <typename Tree> struct Closest_Hit_Visitor {
+  const Slab_Ray slab_r;
+  const Watertight_Ray watertight_r;
+  const std::vector<Triangle> &tris;
+  const Tree &bvh;
+  float t_max;
+  std::optional<Ray_Hit> result;
+
+  std::optional<float> intersect(const AABB &aabb) const {
+    return ::intersect(slab_r, aabb, t_max);
+  }
+  float get_max_distance() const { return t_max; }
+  bool visit_leaf(const BVH_Node &leaf) {
+    for (uint32_t i = leaf.start(); i < leaf.end(); i++) {
+      uint32_t ti = bvh.remap_index(i);
+      auto hit = ::intersect(watertight_r, tris[ti], t_max);
+      // Ties keep the triangle found first
+      if (!hit.has_value() || (result.has_value() && *hit == t_max)) continue;
+      t_max = *hit;
+      result = {*hit, ti};
+    }
+    return false;
+  }
+};
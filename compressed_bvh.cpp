@@ -0,0 +1,137 @@
+#include <cmath>
+#include <cstdint>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "bvh_visitors.hpp"
+#include "compressed_bvh.hpp"
+
+static_assert(sizeof(Compressed_BVH_Node<uint8_t>) == 12);
+static_assert(sizeof(Compressed_BVH_Node<uint16_t>) == 20);
+
+namespace {
+// Largest q whose decoded value is at most value, and smallest q whose decoded
+// value is at least value. Values are inside the parent bounds, so the search
+// ends at the exact ends of the range at the latest.
+template <typename T>
+T quantize_down(float value, float parent_min, float parent_max, float scale) {
+  using Node = Compressed_BVH_Node<T>;
+  float q = scale > 0.0f ? std::floor((value - parent_min) / scale) : 0.0f;
+  q = std::fmin(std::fmax(q, 0.0f), float(Node::QUANTIZATION_MAX));
+  T result = T(q);
+  while (result > 0 &&
+         Node::dequantize(result, parent_min, parent_max, scale) > value)
+    result--;
+  return result;
+}
+
+template <typename T>
+T quantize_up(float value, float parent_min, float parent_max, float scale) {
+  using Node = Compressed_BVH_Node<T>;
+  float q = scale > 0.0f ? std::ceil((value - parent_min) / scale)
+                         : float(Node::QUANTIZATION_MAX);
+  q = std::fmin(std::fmax(q, 0.0f), float(Node::QUANTIZATION_MAX));
+  T result = T(q);
+  while (result < Node::QUANTIZATION_MAX &&
+         Node::dequantize(result, parent_min, parent_max, scale) < value)
+    result++;
+  return result;
+}
+} // namespace
+
+template <typename T>
+std::pair<uint32_t, AABB> Compressed_BVH<T>::add_node(const AABB &node_aabb,
+                                                      const AABB &parent) {
+  Compressed_BVH_Node<T> node;
+  Vec3 scale = parent.calc_extent() *
+               (1.0f / float(Compressed_BVH_Node<T>::QUANTIZATION_MAX));
+  for (int axis = 0; axis < 3; axis++) {
+    node.min[axis] = quantize_down<T>(node_aabb.min[axis], parent.min[axis],
+                                      parent.max[axis], scale[axis]);
+    node.max[axis] = quantize_up<T>(node_aabb.max[axis], parent.min[axis],
+                                    parent.max[axis], scale[axis]);
+  }
+  node.num_primitives = 0;
+  node.offset = 0;
+  nodes.push_back(node);
+  return {uint32_t(nodes.size() - 1), node.decode(parent)};
+}
+
+template <typename T>
+void Compressed_BVH<T>::add_subtree(const BVH_Tree &tree, uint32_t node_index,
+                                    const AABB &parent) {
+  const BVH_Node &node = tree.get_node(node_index);
+  if (node.is_leaf()) {
+    add_leaf(node.aabb, node.start(), node.num_primitives, parent);
+    return;
+  }
+  auto [index, decoded] = add_node(node.aabb, parent);
+  add_subtree(tree, BVH_Node::left_child(node_index), decoded);
+  nodes[index].offset = nodes.size();
+  add_subtree(tree, node.right_child(), decoded);
+}
+
+template <typename T>
+void Compressed_BVH<T>::add_leaf(const AABB &leaf_aabb, uint32_t start,
+                                 uint32_t count, const AABB &parent) {
+  auto [index, decoded] = add_node(leaf_aabb, parent);
+  if (count <= Compressed_BVH_Node<T>::MAX_LEAF_SIZE) {
+    nodes[index].offset = start;
+    nodes[index].num_primitives = count;
+    return;
+  }
+  uint32_t half = count / 2;
+  add_leaf(leaf_aabb, start, half, decoded);
+  nodes[index].offset = nodes.size();
+  add_leaf(leaf_aabb, start + half, count - half, decoded);
+}
+
+template <typename T>
+Compressed_BVH<T>::Compressed_BVH(const BVH_Tree &tree)
+    : aabb(tree.get_aabb()) {
+  if (tree.get_num_primitives() == 0) return;
+  map.reserve(tree.get_num_primitives());
+  for (uint32_t i = 0; i < tree.get_num_primitives(); i++)
+    map.push_back(tree.remap_index(i));
+  nodes.reserve(tree.get_num_nodes());
+  add_subtree(tree, BVH_Tree::ROOT, aabb);
+}
+
+template class Compressed_BVH<uint8_t>;
+template class Compressed_BVH<uint16_t>;
+
+template <typename T>
+std::optional<Ray_Hit> closest_hit(const Ray &r,
+                                   const std::vector<Triangle> &tris,
+                                   const Compressed_BVH<T> &bvh, float t_max) {
+  Closest_Hit_Visitor<Compressed_BVH<T>> visitor{
+      Slab_Ray(r), Watertight_Ray(r), tris, bvh, t_max, std::nullopt};
+  traverse(bvh, visitor);
+  return visitor.result;
+}
+
+template <typename T>
+std::optional<Closest_Triangle_Result>
+closest_triangle(const Vec3 &p, const std::vector<Triangle> &tris,
+                 const Compressed_BVH<T> &bvh, float max_distance) {
+  Closest_Triangle_Visitor<Compressed_BVH<T>> visitor{
+      p, tris, bvh, max_distance * max_distance, std::nullopt};
+  traverse(bvh, visitor);
+  if (visitor.result.has_value())
+    visitor.result->distance = std::sqrt(visitor.max_d2);
+  return visitor.result;
+}
+
+template std::optional<Ray_Hit>
+closest_hit(const Ray &, const std::vector<Triangle> &,
+            const Compressed_BVH<uint8_t> &, float);
+template std::optional<Ray_Hit>
+closest_hit(const Ray &, const std::vector<Triangle> &,
+            const Compressed_BVH<uint16_t> &, float);
+template std::optional<Closest_Triangle_Result>
+closest_triangle(const Vec3 &, const std::vector<Triangle> &,
+                 const Compressed_BVH<uint8_t> &, float);
+template std::optional<Closest_Triangle_Result>
+closest_triangle(const Vec3 &, const std::vector<Triangle> &,
+                 const Compressed_BVH<uint16_t> &, float);
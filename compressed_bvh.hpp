@@ -0,0 +1,164 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <type_traits>
+#include <vector>
+
+#include "aabb.hpp"
+#include "bvh.hpp"
+#include "intersect.hpp"
+#include "ray.hpp"
+#include "triangle.hpp"
+#include "vec.hpp"
+
+// Node of a BVH_Tree with its bounds quantized to 8 or 16 bits per component,
+// as fractions of the bounds of its parent. Bounds are rounded outwards, so a
+// decoded node always contains the node it was quantized from and queries stay
+// exact. Nodes take 12 bytes with 8 bits and 20 bytes with 16 bits, instead of
+// 32 bytes.
+template <typename T> struct Compressed_BVH_Node {
+  static_assert(std::is_same_v<T, uint8_t> || std::is_same_v<T, uint16_t>,
+                "Bounds are quantized to 8 or 16 bits");
+  static constexpr T QUANTIZATION_MAX = std::numeric_limits<T>::max();
+  // Leaves with more primitives are split into inner nodes with the same
+  // bounds when a tree is compressed
+  static constexpr uint32_t MAX_LEAF_SIZE =
+      std::numeric_limits<uint16_t>::max();
+  T min[3], max[3];
+  // Zero for inner nodes
+  uint16_t num_primitives;
+  // Index of first primitive for leaves, index of right child for inner nodes,
+  // the left child directly follows its parent as in BVH_Node
+  uint32_t offset;
+
+  bool is_leaf() const { return num_primitives > 0; }
+
+  static float dequantize(T q, float parent_min, float parent_max,
+                          float scale) {
+    // Both ends are exact so that the parent always covers its children
+    if (q == 0) return parent_min;
+    if (q == QUANTIZATION_MAX) return parent_max;
+    return parent_min + float(q) * scale;
+  }
+
+  AABB decode(const AABB &parent) const {
+    Vec3 scale = parent.calc_extent() * (1.0f / float(QUANTIZATION_MAX));
+    AABB aabb;
+    for (int axis = 0; axis < 3; axis++) {
+      aabb.min[axis] = dequantize(min[axis], parent.min[axis],
+                                  parent.max[axis], scale[axis]);
+      aabb.max[axis] = dequantize(max[axis], parent.min[axis],
+                                  parent.max[axis], scale[axis]);
+    }
+    return aabb;
+  }
+};
+
+// Maximum traversal stack size, splitting oversized leaves adds at most 17
+// levels below the BVH_MAX_DEPTH levels of the source tree
+constexpr uint32_t COMPRESSED_BVH_MAX_DEPTH = BVH_MAX_DEPTH + 17;
+
+// Read only copy of a BVH_Tree with quantized nodes, bounds are decoded during
+// traversal from the bounds of the parent
+template <typename T> class Compressed_BVH {
+  // Bounds of the whole tree, the root is quantized relative to it
+  AABB aabb;
+  std::vector<Compressed_BVH_Node<T>> nodes;
+  std::vector<uint32_t> map;
+
+  // Append the node quantized relative to parent and return its index and
+  // decoded bounds
+  std::pair<uint32_t, AABB> add_node(const AABB &node_aabb,
+                                     const AABB &parent);
+  void add_subtree(const BVH_Tree &tree, uint32_t node_index,
+                   const AABB &parent);
+  void add_leaf(const AABB &leaf_aabb, uint32_t start, uint32_t count,
+                const AABB &parent);
+
+public:
+  static constexpr uint32_t ROOT = 0;
+  explicit Compressed_BVH(const BVH_Tree &tree);
+  uint32_t remap_index(uint32_t i) const {
+    assert(i < map.size());
+    return map[i];
+  }
+  const Compressed_BVH_Node<T> &get_node(uint32_t i) const {
+    assert(i < nodes.size());
+    return nodes[i];
+  }
+  uint32_t get_num_nodes() const { return nodes.size(); }
+  const AABB &get_aabb() const { return aabb; }
+  // Bytes taken by nodes and the primitive map
+  size_t calc_memory_size() const {
+    return nodes.size() * sizeof(Compressed_BVH_Node<T>) +
+           map.size() * sizeof(uint32_t);
+  }
+};
+
+// Same as traverse() for a BVH_Tree, leaves are passed to the visitor as
+// BVH_Nodes with their decoded bounds
+template <typename T, typename Visitor>
+void traverse(const Compressed_BVH<T> &tree, Visitor &visitor) {
+  struct Stack_Item {
+    uint32_t node;
+    float distance;
+    AABB aabb;
+  };
+  if (tree.get_num_nodes() == 0) return;
+  Stack_Item stack[COMPRESSED_BVH_MAX_DEPTH];
+  uint32_t stack_size = 0;
+  AABB root_aabb =
+      tree.get_node(Compressed_BVH<T>::ROOT).decode(tree.get_aabb());
+  std::optional<float> root_distance = visitor.intersect(root_aabb);
+  if (!root_distance.has_value()) return;
+  stack[stack_size++] = {Compressed_BVH<T>::ROOT, *root_distance, root_aabb};
+  while (stack_size > 0) {
+    Stack_Item item = stack[--stack_size];
+    if (item.distance > visitor.get_max_distance()) continue;
+    const Compressed_BVH_Node<T> &node = tree.get_node(item.node);
+    if (node.is_leaf()) {
+      BVH_Node leaf;
+      leaf.aabb = item.aabb;
+      leaf.offset = node.offset;
+      leaf.num_primitives = node.num_primitives;
+      if (visitor.visit_leaf(leaf)) return;
+      continue;
+    }
+    uint32_t left = item.node + 1;
+    uint32_t right = node.offset;
+    AABB left_aabb = tree.get_node(left).decode(item.aabb);
+    AABB right_aabb = tree.get_node(right).decode(item.aabb);
+    std::optional<float> left_distance = visitor.intersect(left_aabb);
+    std::optional<float> right_distance = visitor.intersect(right_aabb);
+    assert(stack_size + 2 <= COMPRESSED_BVH_MAX_DEPTH);
+    if (left_distance.has_value() && right_distance.has_value()) {
+      // Push the closer child last so it is visited first
+      if (*left_distance < *right_distance) {
+        stack[stack_size++] = {right, *right_distance, right_aabb};
+        stack[stack_size++] = {left, *left_distance, left_aabb};
+      } else {
+        stack[stack_size++] = {left, *left_distance, left_aabb};
+        stack[stack_size++] = {right, *right_distance, right_aabb};
+      }
+    } else if (left_distance.has_value()) {
+      stack[stack_size++] = {left, *left_distance, left_aabb};
+    } else if (right_distance.has_value()) {
+      stack[stack_size++] = {right, *right_distance, right_aabb};
+    }
+  }
+}
+
+// Same as the queries on a BVH_Tree
+template <typename T>
+std::optional<Ray_Hit> closest_hit(const Ray &r,
+                                   const std::vector<Triangle> &tris,
+                                   const Compressed_BVH<T> &bvh,
+                                   float t_max = RAY_MAX);
+template <typename T>
+std::optional<Closest_Triangle_Result>
+closest_triangle(const Vec3 &p, const std::vector<Triangle> &tris,
+                 const Compressed_BVH<T> &bvh,
+                 float max_distance = std::numeric_limits<float>::infinity());
@@ -4,9 +4,7 @@
 #include <chrono>
 #include <cmath>
 #include <fstream>
-#include <functional>
 #include <optional>
-#include <queue>
 #include <random>
 #include <string>
 #include <utility>
@@ -112,19 +110,6 @@ static void draw_line(Image &image, const Vec3 &start, const Vec3 &end,
 }
 
 namespace Closest_Point {
-struct Closest_Point_Result {
-  uint32_t i;
-  float distance;
-};
-
-struct Queue_Item {
-  const BVH_Node *node;
-  float distance;
-  bool operator>(const Queue_Item &other) const {
-    return distance > other.distance;
-  }
-};
-
 // FIXMEEEEEEEEEEEEEEEEEEEEEEEEEEEE
 bool is_outside_half_spaces(const Vec3 &p, const std::vector<Vec3> &points,
                             const std::vector<uint32_t> &adj_list) {
@@ -147,50 +132,6 @@ bool is_outside_half_spaces(const AABB &aabb, const std::vector<Vec3> &points,
   return true;
 }
 
-std::optional<Closest_Point_Result>
-closest_point(uint32_t pi, const std::vector<Vec3> &points, const BVH_Tree &bvh,
-              const std::vector<uint32_t> &adj_list) {
-
-  const Vec3 &p = points[pi];
-  std::optional<Closest_Point_Result> result;
-  std::priority_queue<Queue_Item, std::vector<Queue_Item>, std::greater<>>
-      queue;
-  const BVH_Node *root = bvh.get_root();
-  queue.push({root, distance_to_volume(p, root->aabb)});
-
-  while (!queue.empty()) {
-    auto [node, d] = queue.top();
-    queue.pop();
-
-    if (result.has_value() && d > result->distance) {
-      continue;
-    }
-
-    // if (is_outside_half_spaces(node->aabb, points, adj_list)) continue;
-
-    if (!node->is_leaf()) {
-      float dl = distance_to_volume(p, node->left->aabb);
-      float dr = distance_to_volume(p, node->right->aabb);
-
-      queue.push({node->left, dl});
-      queue.push({node->right, dr});
-      continue;
-    }
-
-    for (uint32_t i = node->start; i < node->end; i++) {
-      uint32_t real_i = bvh.remap_index(i);
-      if (pi == real_i) continue;
-      const Vec3 &other = points[real_i];
-      // if (is_outside_half_spaces(other, points, adj_list)) continue;
-      float t = other.dist(p);
-      if (!result.has_value() || t < result->distance) {
-        result = Closest_Point_Result{real_i, t};
-      }
-    }
-  }
-
-  return result;
-}
 } // namespace Closest_Point
 
 int main() {
@@ -215,18 +156,26 @@ int main() {
   std::vector<AABB> aabbs;
   aabbs.reserve(num_points);
   for (const Vec3 &p : points) aabbs.emplace_back(p, p);
-  BVH_Tree bvh(aabbs);
+  BVH_Build_Options options;
+  options.split_method = BVH_Split_Method::Morton;
+  options.max_leaf_size = 4;
+  BVH_Tree bvh(aabbs, options);
 
   // Compute delaunay triangulation
   std::vector<std::vector<uint32_t>> adj_lists;
   adj_lists.resize(points.size());
+  // The two nearest points of each point are itself and its closest neighbor
+  std::vector<Closest_Point_Result> nearest =
+      k_nearest_points(points, 2, points, bvh);
+  size_t stride = nearest.size() / points.size();
   for (uint32_t i = 0; i < points.size(); i++) {
-    // while (true) {
-    auto cp = Closest_Point::closest_point(i, points, bvh, adj_lists[i]);
-    if (!cp.has_value()) continue;
-    adj_lists[i].push_back(cp->i);
-    adj_lists[cp->i].push_back(i);
-    // }
+    for (size_t j = i * stride; j < (i + 1) * stride; j++) {
+      uint32_t other = nearest[j].i;
+      if (other == i) continue;
+      adj_lists[i].push_back(other);
+      adj_lists[other].push_back(i);
+      break;
+    }
   }
 
   // Render result
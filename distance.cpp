@@ -8,3 +8,53 @@ static Vec3 closest_in_volume(const Vec3 &p, const AABB &aabb) {
 float distance_to_volume(const Vec3 &p, const AABB &aabb) {
   return p.dist(closest_in_volume(p, aabb));
 }
+
+float squared_distance_to_volume(const Vec3 &p, const AABB &aabb) {
+  Vec3 d = closest_in_volume(p, aabb) - p;
+  return d.dot(d);
+}
+
+// Real-Time Collision Detection, Christer Ericson, 5.1.5
+Closest_Point_On_Triangle closest_point_on_triangle(const Vec3 &p,
+                                                    const Triangle &t) {
+  Vec3 ab = t.b - t.a;
+  Vec3 ac = t.c - t.a;
+  // Vertex region of a
+  Vec3 ap = p - t.a;
+  float d1 = ab.dot(ap);
+  float d2 = ac.dot(ap);
+  if (d1 <= 0.0f && d2 <= 0.0f) return {t.a, Vec3(1, 0, 0)};
+  // Vertex region of b
+  Vec3 bp = p - t.b;
+  float d3 = ab.dot(bp);
+  float d4 = ac.dot(bp);
+  if (d3 >= 0.0f && d4 <= d3) return {t.b, Vec3(0, 1, 0)};
+  // Edge region of ab
+  float vc = d1 * d4 - d3 * d2;
+  if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) {
+    float v = d1 / (d1 - d3);
+    return {t.a + ab * v, Vec3(1.0f - v, v, 0.0f)};
+  }
+  // Vertex region of c
+  Vec3 cp = p - t.c;
+  float d5 = ab.dot(cp);
+  float d6 = ac.dot(cp);
+  if (d6 >= 0.0f && d5 <= d6) return {t.c, Vec3(0, 0, 1)};
+  // Edge region of ac
+  float vb = d5 * d2 - d1 * d6;
+  if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) {
+    float w = d2 / (d2 - d6);
+    return {t.a + ac * w, Vec3(1.0f - w, 0.0f, w)};
+  }
+  // Edge region of bc
+  float va = d3 * d6 - d5 * d4;
+  if (va <= 0.0f && (d4 - d3) >= 0.0f && (d5 - d6) >= 0.0f) {
+    float w = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+    return {t.b + (t.c - t.b) * w, Vec3(0.0f, 1.0f - w, w)};
+  }
+  // Face region
+  float denom = 1.0f / (va + vb + vc);
+  float v = vb * denom;
+  float w = vc * denom;
+  return {t.a + ab * v + ac * w, Vec3(1.0f - v - w, v, w)};
+}
@@ -1,6 +1,18 @@
 #pragma once
 
 #include "aabb.hpp"
+#include "triangle.hpp"
 #include "vec.hpp"
 
 float distance_to_volume(const Vec3 &p, const AABB &aabb);
+// Cheaper when distances are only compared
+float squared_distance_to_volume(const Vec3 &p, const AABB &aabb);
+
+struct Closest_Point_On_Triangle {
+  Vec3 point;
+  // Weights of the vertices a, b and c that give point
+  Vec3 barycentric;
+};
+
+Closest_Point_On_Triangle closest_point_on_triangle(const Vec3 &p,
+                                                    const Triangle &t);
@@ -1,11 +1,20 @@
 #include <cmath>
+#include <cstdint>
+#include <utility>
 #include <vector>
 
 #include "aabb.hpp"
 #include "distance.hpp"
+#include "pseudonormals.hpp"
 #include "test.hpp"
+#include "triangle.hpp"
 #include "vec.hpp"
 
+struct Triangle_Test_Case {
+  Vec3 p;
+  Vec3 expected_point;
+};
+
 struct Test_Case {
   Vec3 p;
   AABB aabb;
@@ -24,5 +33,66 @@ int main() {
     float d = distance_to_volume(c.p, c.aabb);
     assert_close(d, c.expected_result, 1e-6f);
   }
+
+  Triangle t(Vec3(0, 0, 0), Vec3(2, 0, 0), Vec3(0, 2, 0));
+  std::vector<Triangle_Test_Case> triangle_cases = {
+      // Face
+      {Vec3(0.5f, 0.5f, 3.0f), Vec3(0.5f, 0.5f, 0.0f)},
+      {Vec3(0.5f, 0.5f, -3.0f), Vec3(0.5f, 0.5f, 0.0f)},
+      // Vertices
+      {Vec3(-1, -1, 1), Vec3(0, 0, 0)},
+      {Vec3(3, -1, 0), Vec3(2, 0, 0)},
+      {Vec3(-1, 3, 0), Vec3(0, 2, 0)},
+      // Edges
+      {Vec3(1, -1, 0), Vec3(1, 0, 0)},
+      {Vec3(-1, 1, 2), Vec3(0, 1, 0)},
+      {Vec3(2, 2, 0), Vec3(1, 1, 0)},
+  };
+  for (const auto &c : triangle_cases) {
+    Closest_Point_On_Triangle cp = closest_point_on_triangle(c.p, t);
+    assert_close(cp.point.dist(c.expected_point), 0.0f, 1e-6f);
+    Vec3 from_barycentric = t.a * cp.barycentric.x + t.b * cp.barycentric.y +
+                            t.c * cp.barycentric.z;
+    assert_close(from_barycentric.dist(cp.point), 0.0f, 1e-6f);
+  }
+
+  // Octahedron whose zero coordinates are stored as -0 in some triangles, they
+  // are still welded so that vertex and edge pseudonormals point outwards
+  Vec3 vertices[6] = {Vec3(1, 0, 0),  Vec3(-1, 0, 0), Vec3(0, 1, 0),
+                      Vec3(0, -1, 0), Vec3(0, 0, 1),  Vec3(0, 0, -1)};
+  auto with_negative_zeros = [](Vec3 v) {
+    for (int i = 0; i < 3; i++)
+      if (v[i] == 0.0f) v[i] = -0.0f;
+    return v;
+  };
+  std::vector<Triangle> octahedron;
+  for (int sx = 0; sx < 2; sx++)
+    for (int sy = 0; sy < 2; sy++)
+      for (int sz = 0; sz < 2; sz++) {
+        Triangle t(vertices[sx], vertices[2 + sy], vertices[4 + sz]);
+        // Facing outwards
+        if ((t.b - t.a).cross(t.c - t.a).dot(t.a) < 0.0f) std::swap(t.b, t.c);
+        if (sy == 1)
+          for (int i = 0; i < 3; i++) t[i] = with_negative_zeros(t[i]);
+        octahedron.push_back(t);
+      }
+  Pseudonormals pseudonormals(octahedron);
+  assert_equals(pseudonormals.get_num_vertices(), 6u);
+  assert_equals(pseudonormals.get_num_edges(), 12u);
+  for (uint32_t ti = 0; ti < octahedron.size(); ti++) {
+    const Triangle &t = octahedron[ti];
+    for (int i = 0; i < 3; i++) {
+      Vec3 barycentric(0.0f);
+      barycentric[i] = 1.0f;
+      Vec3 n = pseudonormals.get(ti, barycentric).normalized();
+      assert_close(n.dist(t[i]), 0.0f, 1e-6f);
+      // Edge from vertex i to the next one
+      Vec3 edge_barycentric(0.5f);
+      edge_barycentric[(i + 2) % 3] = 0.0f;
+      Vec3 edge_n = pseudonormals.get(ti, edge_barycentric).normalized();
+      Vec3 expected = (t[i] + t[(i + 1) % 3]).normalized();
+      assert_close(edge_n.dist(expected), 0.0f, 1e-6f);
+    }
+  }
   return 0;
 }
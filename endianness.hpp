@@ -1,5 +1,9 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
 // https://en.cppreference.com/mwiki/index.php?title=cpp/types/endian&oldid=154532#Possible_implementation
 enum class endian {
 #if defined(_MSC_VER) && !defined(__clang__)
@@ -12,3 +16,20 @@ enum class endian {
   native = __BYTE_ORDER__
 #endif
 };
+
+// Value with the order of its bytes reversed
+inline uint32_t byte_swap(uint32_t value) {
+  return (value >> 24) | ((value >> 8) & 0xff00u) | ((value << 8) & 0xff0000u) |
+         (value << 24);
+}
+
+// Loads a 4 byte value stored in little endian order from unaligned memory
+template <typename T> T load_little_endian(const std::byte *p) {
+  static_assert(sizeof(T) == sizeof(uint32_t));
+  uint32_t bits;
+  std::memcpy(&bits, p, sizeof(bits));
+  if constexpr (endian::native == endian::big) bits = byte_swap(bits);
+  T value;
+  std::memcpy(&value, &bits, sizeof(value));
+  return value;
+}
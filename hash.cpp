@@ -0,0 +1,46 @@
+#include <cstring>
+#include <vector>
+
+#include "hash.hpp"
+
+namespace {
+// Blocks are split into this many chunks that are hashed independently
+constexpr size_t NUM_CHUNKS = 64;
+constexpr size_t PARALLEL_THRESHOLD = 1 << 20;
+
+// https://prng.di.unimi.it/splitmix64.c
+uint64_t mix(uint64_t h) {
+  h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+  h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+  return h ^ (h >> 31);
+}
+
+uint64_t hash_chunk(const unsigned char *data, size_t size, uint64_t seed) {
+  uint64_t h = mix(seed + size);
+  size_t i = 0;
+  for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+    uint64_t word;
+    std::memcpy(&word, data + i, sizeof(uint64_t));
+    h = (h ^ (word * 0x9e3779b97f4a7c15ull)) * 0xff51afd7ed558ccdull;
+    h ^= h >> 32;
+  }
+  uint64_t tail = 0;
+  if (i < size) std::memcpy(&tail, data + i, size - i);
+  return mix(h ^ tail);
+}
+} // namespace
+
+uint64_t calc_hash(const void *data, size_t size) {
+  const unsigned char *bytes = static_cast<const unsigned char *>(data);
+  if (size < PARALLEL_THRESHOLD) return hash_chunk(bytes, size, 0);
+  std::vector<uint64_t> chunk_hashes(NUM_CHUNKS);
+#pragma omp parallel for
+  for (size_t c = 0; c < NUM_CHUNKS; c++) {
+    size_t start = size * c / NUM_CHUNKS;
+    size_t end = size * (c + 1) / NUM_CHUNKS;
+    chunk_hashes[c] = hash_chunk(bytes + start, end - start, c);
+  }
+  const unsigned char *chunk_bytes =
+      reinterpret_cast<const unsigned char *>(chunk_hashes.data());
+  return hash_chunk(chunk_bytes, chunk_hashes.size() * sizeof(uint64_t), size);
+}
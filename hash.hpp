@@ -0,0 +1,9 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Fast non cryptographic 64 bit hash of a block of memory, used to detect
+// when cached data no longer matches its source. Large blocks are hashed in
+// parallel, the result does not depend on the number of threads.
+uint64_t calc_hash(const void *data, size_t size);
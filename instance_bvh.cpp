@@ -0,0 +1,129 @@
+#include <cassert>
+#include <cstdint>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "instance_bvh.hpp"
+
+BVH_Geometry::BVH_Geometry(std::vector<Triangle> tris,
+                           const BVH_Build_Options &options)
+    : tris(std::move(tris)), bvh([&] {
+        std::vector<AABB> aabbs;
+        aabbs.reserve(this->tris.size());
+        for (const Triangle &t : this->tris) aabbs.push_back(t.calc_aabb());
+        return BVH_Tree(aabbs, options);
+      }()) {}
+
+AABB Instance_BVH::calc_instance_aabb(const BVH_Instance &instance) {
+  return instance.transform.apply_to_aabb(instance.geometry->bvh.get_aabb());
+}
+
+std::vector<AABB>
+Instance_BVH::calc_instance_aabbs(const std::vector<BVH_Instance> &instances) {
+  std::vector<AABB> aabbs;
+  aabbs.reserve(instances.size());
+  for (const BVH_Instance &instance : instances)
+    aabbs.push_back(calc_instance_aabb(instance));
+  return aabbs;
+}
+
+Instance_BVH::Instance_BVH(std::vector<BVH_Instance> instances,
+                           const BVH_Build_Options &options)
+    : instances(std::move(instances)),
+      instance_aabbs(calc_instance_aabbs(this->instances)),
+      tree(instance_aabbs, options) {
+  inverse_transforms.reserve(this->instances.size());
+  for (const BVH_Instance &instance : this->instances) {
+    std::optional<Affine_Transform> inverse = instance.transform.inverted();
+    assert(inverse.has_value());
+    inverse_transforms.push_back(*inverse);
+  }
+}
+
+void Instance_BVH::set_transform(uint32_t i,
+                                 const Affine_Transform &transform) {
+  assert(i < instances.size());
+  std::optional<Affine_Transform> inverse = transform.inverted();
+  assert(inverse.has_value());
+  instances[i].transform = transform;
+  inverse_transforms[i] = *inverse;
+  instance_aabbs[i] = calc_instance_aabb(instances[i]);
+}
+
+void Instance_BVH::update() {
+  // The top level tree has one leaf per instance, so rebuilding its degraded
+  // subtrees early stays cheap
+  constexpr float MAX_COST_GROWTH = 1.5f;
+  tree.refit(instance_aabbs, MAX_COST_GROWTH);
+}
+
+namespace {
+struct Instance_Closest_Hit_Visitor {
+  const Ray &r;
+  const Slab_Ray slab_r;
+  const Instance_BVH &bvh;
+  float t_max;
+  std::optional<Instance_Hit> result;
+
+  std::optional<float> intersect(const AABB &aabb) const {
+    return ::intersect(slab_r, aabb, t_max);
+  }
+  float get_max_distance() const { return t_max; }
+  bool visit_leaf(const BVH_Node &leaf) {
+    const BVH_Tree &tree = bvh.get_tree();
+    for (uint32_t i = leaf.start(); i < leaf.end(); i++) {
+      uint32_t ii = tree.remap_index(i);
+      const BVH_Geometry &geometry = *bvh.get_instance(ii).geometry;
+      Ray local_ray = bvh.get_inverse_transform(ii).apply_to_ray(r);
+      auto hit = closest_hit(local_ray, geometry.tris, geometry.bvh, t_max);
+      // Ties keep the instance found first
+      if (!hit.has_value() || (result.has_value() && hit->t == t_max))
+        continue;
+      t_max = hit->t;
+      result = {hit->t, ii, hit->triangle_index};
+    }
+    return false;
+  }
+};
+
+struct Instance_Any_Hit_Visitor {
+  const Ray &r;
+  const Slab_Ray slab_r;
+  const Instance_BVH &bvh;
+  float t_max;
+  bool found = false;
+
+  std::optional<float> intersect(const AABB &aabb) const {
+    return ::intersect(slab_r, aabb, t_max);
+  }
+  float get_max_distance() const { return t_max; }
+  bool visit_leaf(const BVH_Node &leaf) {
+    const BVH_Tree &tree = bvh.get_tree();
+    for (uint32_t i = leaf.start(); i < leaf.end(); i++) {
+      uint32_t ii = tree.remap_index(i);
+      const BVH_Geometry &geometry = *bvh.get_instance(ii).geometry;
+      Ray local_ray = bvh.get_inverse_transform(ii).apply_to_ray(r);
+      if (any_hit(local_ray, geometry.tris, geometry.bvh, t_max)) {
+        found = true;
+        return true;
+      }
+    }
+    return false;
+  }
+};
+} // namespace
+
+std::optional<Instance_Hit> closest_hit(const Ray &r, const Instance_BVH &bvh,
+                                        float t_max) {
+  Instance_Closest_Hit_Visitor visitor{r, Slab_Ray(r), bvh, t_max,
+                                       std::nullopt};
+  traverse(bvh.get_tree(), visitor);
+  return visitor.result;
+}
+
+bool any_hit(const Ray &r, const Instance_BVH &bvh, float t_max) {
+  Instance_Any_Hit_Visitor visitor{r, Slab_Ray(r), bvh, t_max};
+  traverse(bvh.get_tree(), visitor);
+  return visitor.found;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <vector>
+
+#include "aabb.hpp"
+#include "bvh.hpp"
+#include "intersect.hpp"
+#include "ray.hpp"
+#include "transform.hpp"
+#include "triangle.hpp"
+
+// Triangles with their BVH, shared by all instances of a mesh
+struct BVH_Geometry {
+  std::vector<Triangle> tris;
+  BVH_Tree bvh;
+
+  BVH_Geometry(std::vector<Triangle> tris, const BVH_Build_Options &options);
+};
+
+struct BVH_Instance {
+  std::shared_ptr<const BVH_Geometry> geometry;
+  // From the space of the geometry to world space
+  Affine_Transform transform;
+};
+
+struct Instance_Hit {
+  float t;
+  uint32_t instance_index;
+  uint32_t triangle_index;
+};
+
+// Two level BVH, a top level tree over the world space bounds of instances
+// whose leaves point to the bottom level trees of their geometries. Rays are
+// transformed into the space of each instance they reach, so memory and build
+// time grow with the unique geometry and moving instances only updates the
+// top level tree.
+class Instance_BVH {
+  std::vector<BVH_Instance> instances;
+  // From world space to the space of each instance
+  std::vector<Affine_Transform> inverse_transforms;
+  std::vector<AABB> instance_aabbs;
+  BVH_Tree tree;
+
+  static AABB calc_instance_aabb(const BVH_Instance &instance);
+  static std::vector<AABB>
+  calc_instance_aabbs(const std::vector<BVH_Instance> &instances);
+
+public:
+  // Needs at least one instance, singular transforms are not allowed
+  explicit Instance_BVH(std::vector<BVH_Instance> instances,
+                        const BVH_Build_Options &options = {});
+  const BVH_Instance &get_instance(uint32_t i) const {
+    assert(i < instances.size());
+    return instances[i];
+  }
+  const Affine_Transform &get_inverse_transform(uint32_t i) const {
+    assert(i < inverse_transforms.size());
+    return inverse_transforms[i];
+  }
+  uint32_t get_num_instances() const { return instances.size(); }
+  const BVH_Tree &get_tree() const { return tree; }
+  // Move instance i, the top level tree is only updated by update()
+  void set_transform(uint32_t i, const Affine_Transform &transform);
+  // Refit the top level tree to the moved instances, rebuilding subtrees that
+  // degraded too much
+  void update();
+};
+
+// Closest hit of r against all instances within t_max, t is measured along
+// the world space ray
+std::optional<Instance_Hit> closest_hit(const Ray &r, const Instance_BVH &bvh,
+                                        float t_max = RAY_MAX);
+// Whether r hits any instance within t_max
+bool any_hit(const Ray &r, const Instance_BVH &bvh, float t_max = RAY_MAX);
@@ -1,164 +1,476 @@
+#include <algorithm>
 #include <array>
+#include <cmath>
 #include <cstdint>
 #include <optional>
 #include <utility>
+#include <vector>
 
 #include "intersect.hpp"
-#include "math.hpp"
+#include "predicates.hpp"
 #include "segment.hpp"
 #include "vec.hpp"
 
-constexpr float SIGN_TABLE[3][3] = {
-    {1, -1, 1},
-    {-1, 1, -1},
-    {1, -1, 1},
-};
+Slab_Ray::Slab_Ray(const Ray &ray)
+    : origin(ray.origin),
+      inv_dir(1.0f / ray.direction.x, 1.0f / ray.direction.y,
+              1.0f / ray.direction.z) {
+  // Signs of the reciprocals, so -0 directions count as negative like -inf
+  for (int i = 0; i < 3; i++) sign[i] = std::signbit(inv_dir[i]);
+}
 
 std::optional<float> intersect(const Ray &ray, const AABB &aabb,
                                float running_t_max) {
-  float running_t_min = 0.0f;
-  for (int i = 0; i < 3; i++) {
-    if (is_zero(ray.direction[i]) &&
-        (ray.origin[i] < aabb.min[i] || ray.origin[i] > aabb.max[i]))
-      return std::nullopt;
+  return intersect(Slab_Ray(ray), aabb, running_t_max);
+}
 
-    float rdi = ray.direction[i];
-    float t_min = (aabb.min[i] - ray.origin[i]) / rdi;
-    float t_max = (aabb.max[i] - ray.origin[i]) / rdi;
+bool does_intersect(const Segment &s, const AABB &aabb) {
+  return intersect(Ray{s.a, s.b - s.a}, aabb, 1.0f).has_value();
+}
 
-    // "If you multiply or divide each side by a negative quantity, the
-    // inequality symbol must be reversed."
-    // https://web.archive.org/web/20240603190734/https://mathcentre.ac.uk/resources/uploaded/mc-ty-inequalities-2009-1.pdf
-    if (rdi < 0.0f) std::swap(t_min, t_max);
+namespace {
+// Separating axis test of a triangle against boxes, based on "Fast 3D
+// Triangle-Box Overlap Testing" by Tomas Akenine-Möller. The projections of
+// the triangle on all 13 candidate axes are computed once, so each box only
+// costs the projection of its center and its radius on each axis.
+class Triangle_AABB_Test {
+  // Projections on the face normals of the box
+  AABB triangle_aabb;
+  Vec3 normal;
+  float normal_offset;
+  // Cross products of the triangle edges with the face normals of the box
+  std::array<Vec3, 9> edge_axes;
+  float edge_min[9], edge_max[9];
 
-    if (t_min > running_t_max) return std::nullopt;
-    if (t_max < running_t_min) return std::nullopt;
-    running_t_min = std::max(t_min, running_t_min);
-    running_t_max = std::min(t_max, running_t_max);
-    assert(running_t_max > running_t_min);
+  static std::array<Vec3, 9> calc_edge_axes(const Triangle &t) {
+    Vec3 ab = t.b - t.a;
+    Vec3 bc = t.c - t.b;
+    Vec3 ca = t.a - t.c;
+    return {
+        Vec3(0.0f, ab.z, -ab.y), Vec3(-ab.z, 0.0f, ab.x),
+        Vec3(ab.y, -ab.x, 0.0f), Vec3(0.0f, bc.z, -bc.y),
+        Vec3(-bc.z, 0.0f, bc.x), Vec3(bc.y, -bc.x, 0.0f),
+        Vec3(0.0f, ca.z, -ca.y), Vec3(-ca.z, 0.0f, ca.x),
+        Vec3(ca.y, -ca.x, 0.0f),
+    };
+  }
+
+public:
+  explicit Triangle_AABB_Test(const Triangle &t)
+      : triangle_aabb(t.calc_aabb()), normal((t.b - t.a).cross(t.c - t.a)),
+        normal_offset(normal.dot(t.a)), edge_axes(calc_edge_axes(t)) {
+    for (int i = 0; i < 9; i++) {
+      float pa = edge_axes[i].dot(t.a);
+      float pb = edge_axes[i].dot(t.b);
+      float pc = edge_axes[i].dot(t.c);
+      edge_min[i] = std::min(pa, std::min(pb, pc));
+      edge_max[i] = std::max(pa, std::max(pb, pc));
+    }
   }
-  return running_t_min;
+
+  // Touching counts as overlapping
+  bool overlaps(const AABB &aabb) const {
+    // Cheapest axes first, most boxes of a query are rejected by them
+    if (!triangle_aabb.overlaps(aabb)) return false;
+    Vec3 center = aabb.calc_center();
+    Vec3 half_extent = aabb.calc_extent() * 0.5f;
+    auto radius = [&](const Vec3 &axis) {
+      return std::fabs(axis.x) * half_extent.x +
+             std::fabs(axis.y) * half_extent.y +
+             std::fabs(axis.z) * half_extent.z;
+    };
+    if (std::fabs(normal.dot(center) - normal_offset) > radius(normal))
+      return false;
+    for (int i = 0; i < 9; i++) {
+      float c = edge_axes[i].dot(center);
+      float r = radius(edge_axes[i]);
+      if (edge_min[i] > c + r || edge_max[i] < c - r) return false;
+    }
+    return true;
+  }
+};
+} // namespace
+
+bool does_intersect(const Triangle &t, const AABB &aabb) {
+  return Triangle_AABB_Test(t).overlaps(aabb);
 }
 
-bool does_intersect(const Segment &s, const AABB &aabb) {
-  return intersect(Ray{s.a, s.b - s.a}, aabb, 1.0f).has_value();
+void find_overlapping_aabbs(const Triangle &t, const std::vector<AABB> &aabbs,
+                            std::vector<uint32_t> &result) {
+  Triangle_AABB_Test test(t);
+  for (uint32_t i = 0; i < aabbs.size(); i++)
+    if (test.overlaps(aabbs[i])) result.push_back(i);
 }
 
-static bool is_projected_inside(const Vec3 &p, const Triangle &t) {
-  Vec3 ap = p - t.a;
-  float u = ap.dot(t.b - t.a);
-  float v = ap.dot(t.c - t.a);
-  if (u < 0.0f) return false;
-  if (u > 1.0f) return false;
-  if (v < 0.0f) return false;
-  if (v > 1.0f) return false;
-  if ((u + v) > 1.0f) return false;
-  return true;
+Watertight_Ray::Watertight_Ray(const Ray &ray) : origin(ray.origin) {
+  const Vec3 &d = ray.direction;
+  float ax = std::fabs(d.x);
+  float ay = std::fabs(d.y);
+  float az = std::fabs(d.z);
+  kz = ax > ay ? (ax > az ? 0 : 2) : (ay > az ? 1 : 2);
+  kx = (kz + 1) % 3;
+  ky = (kx + 1) % 3;
+  // Keep the winding of triangles when looking down -z
+  if (d[kz] < 0.0f) std::swap(kx, ky);
+  sx = d[kx] / d[kz];
+  sy = d[ky] / d[kz];
+  sz = 1.0f / d[kz];
 }
 
-static bool is_inside(const Vec3 &p, const AABB &aabb) {
-  if (p.x < aabb.min.x) return false;
-  if (p.y < aabb.min.y) return false;
-  if (p.z < aabb.min.z) return false;
-  if (p.x > aabb.max.x) return false;
-  if (p.y > aabb.max.y) return false;
-  if (p.z > aabb.max.z) return false;
-  return true;
+namespace {
+// Whether a point on the edge from p to q lies inside a triangle whose edge
+// functions are positive inside. Ties are broken as if the ray was moved by a
+// fixed infinitesimal offset, the triangle across the edge always decides the
+// other way, and exactly one triangle around a shared vertex keeps it.
+bool is_edge_inside(float px, float py, float qx, float qy) {
+  float ex = qx - px;
+  float ey = qy - py;
+  return ey < 0.0f || (ey == 0.0f && ex > 0.0f);
 }
+} // namespace
 
-bool does_intersect(const Triangle &t, const AABB &aabb) {
-  // Check if any of the triangle's vertices are inside the AABB
-  if (is_inside(t.a, aabb)) return true;
-  if (is_inside(t.b, aabb)) return true;
-  if (is_inside(t.c, aabb)) return true;
-
-  // Check if any of the AABB's vertices, when projected, are inside the
-  // triangle
-  for (const Vec3 &vertex : aabb.vertices())
-    if (is_projected_inside(vertex, t)) return true;
-
-  // Check if any of the triangle's edges intersect the AABB
-  if (does_intersect(Segment{t.a, t.b}, aabb)) return true;
-  if (does_intersect(Segment{t.b, t.c}, aabb)) return true;
-  if (does_intersect(Segment{t.c, t.a}, aabb)) return true;
-
-  return false;
-}
-
-static float calculate_cofactor(const std::array<Vec3, 3> &columns,
-                                uint8_t cofactor_row, uint8_t cofactor_column) {
-  float minor_rows[2][2];
-  uint8_t minor_row = 0;
-  uint8_t minor_column = 0;
-  for (uint8_t row = 0; row < 3; row++) {
-    if (row == cofactor_row) continue;
-    for (uint8_t column = 0; column < 3; column++) {
-      if (column == cofactor_column) continue;
-      minor_rows[minor_row][minor_column] = columns[column][row];
-      minor_column++;
+std::optional<float> intersect(const Watertight_Ray &ray,
+                               const Triangle &triangle,
+                               float running_t_max) {
+  Vec3 a = triangle.a - ray.origin;
+  Vec3 b = triangle.b - ray.origin;
+  Vec3 c = triangle.c - ray.origin;
+  float ax = a[ray.kx] - ray.sx * a[ray.kz];
+  float ay = a[ray.ky] - ray.sy * a[ray.kz];
+  float bx = b[ray.kx] - ray.sx * b[ray.kz];
+  float by = b[ray.ky] - ray.sy * b[ray.kz];
+  float cx = c[ray.kx] - ray.sx * c[ray.kz];
+  float cy = c[ray.ky] - ray.sy * c[ray.kz];
+  // Products of floats are exact in double, so the signs of the edge functions
+  // are exact and the two triangles of an edge get opposite values
+  double u = double(cx) * by - double(cy) * bx;
+  double v = double(ax) * cy - double(ay) * cx;
+  double w = double(bx) * ay - double(by) * ax;
+  if ((u < 0.0 || v < 0.0 || w < 0.0) && (u > 0.0 || v > 0.0 || w > 0.0))
+    return std::nullopt;
+  double det = u + v + w;
+  if (det == 0.0) return std::nullopt;
+  // Hits exactly on edges go to one side only, flip for clockwise triangles
+  bool positive = det > 0.0;
+  if (u == 0.0 && is_edge_inside(bx, by, cx, cy) != positive)
+    return std::nullopt;
+  if (v == 0.0 && is_edge_inside(cx, cy, ax, ay) != positive)
+    return std::nullopt;
+  if (w == 0.0 && is_edge_inside(ax, ay, bx, by) != positive)
+    return std::nullopt;
+  double t = (u * (ray.sz * a[ray.kz]) + v * (ray.sz * b[ray.kz]) +
+              w * (ray.sz * c[ray.kz])) /
+             det;
+  // Also rejects NaN from zero directions
+  if (!(t >= 0.0 && t <= running_t_max)) return std::nullopt;
+  return float(t);
+}
+
+std::optional<float> intersect(const Ray &ray, const Triangle &triangle,
+                               float running_t_max) {
+  return intersect(Watertight_Ray(ray), triangle, running_t_max);
+}
+
+namespace {
+// Largest component of v, by magnitude
+int calc_dominant_axis(const Vec3 &v) {
+  float x = std::fabs(v.x);
+  float y = std::fabs(v.y);
+  float z = std::fabs(v.z);
+  return x > y ? (x > z ? 0 : 2) : (y > z ? 1 : 2);
+}
+
+// Signed distances of the vertices of t to the plane of other, scaled by the
+// length of its normal. Signs are exact.
+void calc_plane_distances(const Triangle &t, const Triangle &other,
+                          double (&d)[3]) {
+  Plane_Orientation orientation(other.a, other.b, other.c);
+  for (int i = 0; i < 3; i++) d[i] = -orientation(t[i]);
+}
+
+bool is_on_one_side(const double (&d)[3]) {
+  return (d[0] > 0.0 && d[1] > 0.0 && d[2] > 0.0) ||
+         (d[0] < 0.0 && d[1] < 0.0 && d[2] < 0.0);
+}
+
+bool is_in_plane(const double (&d)[3]) {
+  return d[0] == 0.0 && d[1] == 0.0 && d[2] == 0.0;
+}
+
+// Points where t meets a plane it crosses or touches, given the signed
+// distances d of its vertices, returns their number, 1 or 2
+uint32_t calc_plane_crossings(const Triangle &t, const double (&d)[3],
+                              Vec3 (&points)[2]) {
+  uint32_t n = 0;
+  for (int i = 0; i < 3 && n < 2; i++) {
+    int j = (i + 1) % 3;
+    if (d[i] == 0.0) points[n++] = t[i];
+    if (n < 2 && ((d[i] < 0.0 && d[j] > 0.0) || (d[i] > 0.0 && d[j] < 0.0)))
+      points[n++] = t[i] + (t[j] - t[i]) * float(d[i] / (d[i] - d[j]));
+  }
+  return n;
+}
+
+// Normal of t in double. Differences of float coordinates are exact in double
+// unless their magnitudes are far apart, and so are products of two of them,
+// so thin triangles keep the direction of their normal.
+void calc_normal(const Triangle &t, double (&n)[3]) {
+  double e1[3], e2[3];
+  for (int i = 0; i < 3; i++) {
+    e1[i] = double(t.b[i]) - double(t.a[i]);
+    e2[i] = double(t.c[i]) - double(t.a[i]);
+  }
+  for (int i = 0; i < 3; i++) {
+    int j = (i + 1) % 3;
+    int k = (i + 2) % 3;
+    n[i] = e1[j] * e2[k] - e1[k] * e2[j];
+  }
+}
+
+// Part of the line where the planes meet covered by a triangle, points are
+// ordered by their projection on the direction of the line
+struct Line_Interval {
+  double t_min, t_max;
+  Vec3 p_min, p_max;
+};
+
+Line_Interval calc_line_interval(const Vec3 (&points)[2], uint32_t n,
+                                 const double (&direction)[3]) {
+  const Vec3 &p0 = points[0];
+  const Vec3 &p1 = n > 1 ? points[1] : points[0];
+  double t0 = 0.0;
+  double t1 = 0.0;
+  for (int i = 0; i < 3; i++) {
+    t0 += double(p0[i]) * direction[i];
+    t1 += double(p1[i]) * direction[i];
+  }
+  if (t0 <= t1) return {t0, t1, p0, p1};
+  return {t1, t0, p1, p0};
+}
+
+// Coordinates of p without the drop axis
+Vec2 project(const Vec3 &p, int drop) {
+  return Vec2(p[(drop + 1) % 3], p[(drop + 2) % 3]);
+}
+
+// Orientations of t projected along each axis, the components of its normal
+// with exact signs
+void calc_projected_orientations(const Triangle &t, double (&o)[3]) {
+  for (int drop = 0; drop < 3; drop++)
+    o[drop] = orient_2d(project(t.a, drop), project(t.b, drop),
+                        project(t.c, drop));
+}
+
+// Whether the vertices of t are collinear, decided exactly
+bool is_degenerate(const Triangle &t) {
+  double o[3];
+  calc_projected_orientations(t, o);
+  return o[0] == 0.0 && o[1] == 0.0 && o[2] == 0.0;
+}
+
+// Segment spanned by the collinear vertices of a degenerate triangle
+Segment calc_extent(const Triangle &t) {
+  Vec3 ab = t.b - t.a;
+  Vec3 bc = t.c - t.b;
+  Vec3 ca = t.a - t.c;
+  float lab = ab.dot(ab);
+  float lbc = bc.dot(bc);
+  float lca = ca.dot(ca);
+  if (lab >= lbc && lab >= lca) return {t.a, t.b};
+  if (lbc >= lca) return {t.b, t.c};
+  return {t.c, t.a};
+}
+
+bool have_opposite_signs(double a, double b) {
+  return (a <= 0.0 && b >= 0.0) || (a >= 0.0 && b <= 0.0);
+}
+
+// Closed segments, collinear segments intersect when their extents overlap
+bool do_segments_intersect(const Vec2 &p, const Vec2 &q, const Vec2 &r,
+                           const Vec2 &s) {
+  double o1 = orient_2d(p, q, r);
+  double o2 = orient_2d(p, q, s);
+  if (o1 == 0.0 && o2 == 0.0)
+    return std::min(p.x, q.x) <= std::max(r.x, s.x) &&
+           std::min(r.x, s.x) <= std::max(p.x, q.x) &&
+           std::min(p.y, q.y) <= std::max(r.y, s.y) &&
+           std::min(r.y, s.y) <= std::max(p.y, q.y);
+  return have_opposite_signs(o1, o2) &&
+         have_opposite_signs(orient_2d(r, s, p), orient_2d(r, s, q));
+}
+
+bool is_inside(const Vec2 &p, const Vec2 (&t)[3]) {
+  double o0 = orient_2d(t[0], t[1], p);
+  double o1 = orient_2d(t[1], t[2], p);
+  double o2 = orient_2d(t[2], t[0], p);
+  return (o0 >= 0.0 && o1 >= 0.0 && o2 >= 0.0) ||
+         (o0 <= 0.0 && o1 <= 0.0 && o2 <= 0.0);
+}
+
+// Triangles in the same plane are projected along the dominant axis of its
+// normal, they overlap when edges cross or one contains the other
+bool do_coplanar_triangles_overlap(const Triangle &a, const Triangle &b,
+                                   const Vec3 &normal) {
+  int drop = calc_dominant_axis(normal);
+  Vec2 pa[3] = {project(a.a, drop), project(a.b, drop), project(a.c, drop)};
+  Vec2 pb[3] = {project(b.a, drop), project(b.b, drop), project(b.c, drop)};
+  for (int i = 0; i < 3; i++)
+    for (int j = 0; j < 3; j++)
+      if (do_segments_intersect(pa[i], pa[(i + 1) % 3], pb[j],
+                                pb[(j + 1) % 3]))
+        return true;
+  return is_inside(pa[0], pb) || is_inside(pb[0], pa);
+}
+
+// Point where two segments cross, or the part they share when they are
+// collinear. Whether they meet is decided exactly.
+std::optional<Segment> intersect_segments(const Segment &a, const Segment &b) {
+  if (orient_3d(a.a, a.b, b.a, b.b) != 0.0) return std::nullopt;
+  // Coplanar segments meet when their projections along every axis do, one of
+  // the projections is one to one on their plane
+  for (int drop = 0; drop < 3; drop++)
+    if (!do_segments_intersect(project(a.a, drop), project(a.b, drop),
+                               project(b.a, drop), project(b.b, drop)))
+      return std::nullopt;
+  Vec3 da = a.b - a.a;
+  Vec3 db = b.b - b.a;
+  Vec3 n = da.cross(db);
+  if (n.dot(n) > 0.0f) {
+    int drop = calc_dominant_axis(n);
+    double o1 = orient_2d(project(a.a, drop), project(a.b, drop),
+                          project(b.a, drop));
+    double o2 = orient_2d(project(a.a, drop), project(a.b, drop),
+                          project(b.b, drop));
+    if (o1 != o2) {
+      Vec3 p = b.a + db * float(o1 / (o1 - o2));
+      return Segment{p, p};
+    }
+  }
+  // Collinear, the shared part lies between the inner endpoints
+  int axis = calc_dominant_axis(da.dot(da) >= db.dot(db) ? da : db);
+  bool a_flipped = a.b[axis] < a.a[axis];
+  bool b_flipped = b.b[axis] < b.a[axis];
+  const Vec3 &a_min = a_flipped ? a.b : a.a;
+  const Vec3 &a_max = a_flipped ? a.a : a.b;
+  const Vec3 &b_min = b_flipped ? b.b : b.a;
+  const Vec3 &b_max = b_flipped ? b.a : b.b;
+  return Segment{a_min[axis] >= b_min[axis] ? a_min : b_min,
+                 a_max[axis] <= b_max[axis] ? a_max : b_max};
+}
+
+// Part of segment s on triangle t, which must not be degenerate
+std::optional<Segment> intersect_segment_triangle(const Segment &s,
+                                                  const Triangle &t) {
+  Plane_Orientation orientation(t.a, t.b, t.c);
+  double da = orientation(s.a);
+  double db = orientation(s.b);
+  if ((da > 0.0 && db > 0.0) || (da < 0.0 && db < 0.0)) return std::nullopt;
+  if (da != 0.0 || db != 0.0) {
+    // The line through s crosses the plane of t within s, inside t when it
+    // passes all edges of t on the same side
+    double o[3];
+    for (int i = 0; i < 3; i++)
+      o[i] = orient_3d(s.a, s.b, t[i], t[(i + 1) % 3]);
+    if (!(o[0] >= 0.0 && o[1] >= 0.0 && o[2] >= 0.0) &&
+        !(o[0] <= 0.0 && o[1] <= 0.0 && o[2] <= 0.0))
+      return std::nullopt;
+    Vec3 p = s.a + (s.b - s.a) * float(da / (da - db));
+    return Segment{p, p};
+  }
+
+  // In the plane of t, the part of s on t is spanned by the endpoints of s
+  // inside t and the points where s meets the edges of t
+  double o[3];
+  calc_projected_orientations(t, o);
+  int drop = std::fabs(o[0]) >= std::fabs(o[1])
+                 ? (std::fabs(o[0]) >= std::fabs(o[2]) ? 0 : 2)
+                 : (std::fabs(o[1]) >= std::fabs(o[2]) ? 1 : 2);
+  Vec2 pt[3] = {project(t.a, drop), project(t.b, drop), project(t.c, drop)};
+  Vec3 points[8] = {Vec3(0.0f), Vec3(0.0f), Vec3(0.0f), Vec3(0.0f),
+                    Vec3(0.0f), Vec3(0.0f), Vec3(0.0f), Vec3(0.0f)};
+  uint32_t n = 0;
+  if (is_inside(project(s.a, drop), pt)) points[n++] = s.a;
+  if (is_inside(project(s.b, drop), pt)) points[n++] = s.b;
+  for (int i = 0; i < 3; i++) {
+    std::optional<Segment> on_edge =
+        intersect_segments(s, Segment{t[i], t[(i + 1) % 3]});
+    if (!on_edge.has_value()) continue;
+    points[n++] = on_edge->a;
+    points[n++] = on_edge->b;
+  }
+  if (n == 0) return std::nullopt;
+  int axis = calc_dominant_axis(s.b - s.a);
+  auto [lowest, highest] = std::minmax_element(
+      points, points + n,
+      [axis](const Vec3 &p, const Vec3 &q) { return p[axis] < q[axis]; });
+  return Segment{*lowest, *highest};
+}
+} // namespace
+
+std::optional<Triangle_Intersection> intersect(const Triangle &a,
+                                               const Triangle &b) {
+  // Exact signs make the classification consistent for pairs sharing vertices
+  // or edges, and coplanar pairs are detected exactly
+  double da[3];
+  calc_plane_distances(a, b, da);
+  if (is_on_one_side(da)) return std::nullopt;
+  double db[3];
+  calc_plane_distances(b, a, db);
+  if (is_on_one_side(db)) return std::nullopt;
+
+  Vec3 na = (a.b - a.a).cross(a.c - a.a);
+  Vec3 nb = (b.b - b.a).cross(b.c - b.a);
+  if (is_in_plane(da) || is_in_plane(db)) {
+    // Every point is in the plane of a degenerate triangle, which is really a
+    // segment that may cross the other triangle
+    bool is_a_degenerate = is_in_plane(db) && is_degenerate(a);
+    bool is_b_degenerate = is_in_plane(da) && is_degenerate(b);
+    if (is_a_degenerate || is_b_degenerate) {
+      std::optional<Segment> segment;
+      if (is_a_degenerate && is_b_degenerate)
+        segment = intersect_segments(calc_extent(a), calc_extent(b));
+      else if (is_a_degenerate)
+        segment = intersect_segment_triangle(calc_extent(a), b);
+      else
+        segment = intersect_segment_triangle(calc_extent(b), a);
+      if (!segment.has_value()) return std::nullopt;
+      return Triangle_Intersection{false, *segment};
     }
-    minor_column = 0;
-    minor_row++;
+    // Project along the normal of the triangle that is not degenerate
+    const Vec3 &normal = na.dot(na) >= nb.dot(nb) ? na : nb;
+    if (!do_coplanar_triangles_overlap(a, b, normal)) return std::nullopt;
+    return Triangle_Intersection{true, Segment{Vec3(0.0f), Vec3(0.0f)}};
   }
-  return SIGN_TABLE[cofactor_row][cofactor_column] *
-         (minor_rows[0][0] * minor_rows[1][1] -
-          minor_rows[0][1] * minor_rows[1][0]);
-}
-
-static Vec3 calculate_cofactor_column(const std::array<Vec3, 3> &columns,
-                                      uint8_t column) {
-  return Vec3{
-      calculate_cofactor(columns, 0, column),
-      calculate_cofactor(columns, 1, column),
-      calculate_cofactor(columns, 2, column),
-  };
-}
-
-// Returns rows of inverse of input columns
-static std::optional<std::array<Vec3, 3>>
-invert(const std::array<Vec3, 3> &columns) {
-  Vec3 cofactor_column_0 = calculate_cofactor_column(columns, 0);
-  float det = cofactor_column_0.dot(columns[0]);
-  if (is_zero(det)) return std::nullopt;
-  std::array<Vec3, 3> cofactor_columns = {
-      cofactor_column_0,
-      calculate_cofactor_column(columns, 1),
-      calculate_cofactor_column(columns, 2),
-  };
-  const auto &adjoint_rows = cofactor_columns;
-  return std::array<Vec3, 3>{
-      adjoint_rows[0] / det,
-      adjoint_rows[1] / det,
-      adjoint_rows[2] / det,
-  };
-}
-
-static Vec3 transform(const std::array<Vec3, 3> &rows, const Vec3 &v) {
-  return Vec3{
-      rows[0].dot(v),
-      rows[1].dot(v),
-      rows[2].dot(v),
-  };
-}
-
-std::optional<float> intersect(const Ray &ray, const Triangle &triangle) {
-  std::array<Vec3, 3> coefficients_matrix_columns = {
-      triangle.b - triangle.a,
-      triangle.c - triangle.a,
-      -ray.direction,
-  };
-  auto inverse_rows = invert(coefficients_matrix_columns);
-  if (!inverse_rows.has_value()) return std::nullopt;
-  Vec3 constant_column = ray.origin - triangle.a;
-  Vec3 result = transform(*inverse_rows, constant_column);
-  float u = result.x;
-  float v = result.y;
-  float t = result.z;
-  if (u > 1.0f) return std::nullopt;
-  if (u < 0.0f) return std::nullopt;
-  if (v > 1.0f) return std::nullopt;
-  if (v < 0.0f) return std::nullopt;
-  if (t < 0.0f) return std::nullopt;
-  if ((u + v) > 1.0f) return std::nullopt;
-  return t;
+
+  // Both triangles cross the line where the planes meet, they intersect where
+  // their intervals on it overlap
+  Vec3 pa[2] = {Vec3(0.0f), Vec3(0.0f)};
+  Vec3 pb[2] = {Vec3(0.0f), Vec3(0.0f)};
+  uint32_t num_pa = calc_plane_crossings(a, da, pa);
+  uint32_t num_pb = calc_plane_crossings(b, db, pb);
+  // In double, the float normal of a thin triangle can point anywhere
+  double normal_a[3], normal_b[3], direction[3];
+  calc_normal(a, normal_a);
+  calc_normal(b, normal_b);
+  for (int i = 0; i < 3; i++) {
+    int j = (i + 1) % 3;
+    int k = (i + 2) % 3;
+    direction[i] = normal_a[j] * normal_b[k] - normal_a[k] * normal_b[j];
+  }
+  Line_Interval ia = calc_line_interval(pa, num_pa, direction);
+  Line_Interval ib = calc_line_interval(pb, num_pb, direction);
+  if (ia.t_max < ib.t_min || ib.t_max < ia.t_min) return std::nullopt;
+  Segment segment{ia.t_min >= ib.t_min ? ia.p_min : ib.p_min,
+                  ia.t_max <= ib.t_max ? ia.p_max : ib.p_max};
+  return Triangle_Intersection{false, segment};
+}
+
+std::vector<std::optional<Triangle_Intersection>>
+intersect(const std::vector<Triangle> &a, const std::vector<Triangle> &b,
+          const std::vector<std::pair<uint32_t, uint32_t>> &pairs) {
+  std::vector<std::optional<Triangle_Intersection>> results(pairs.size());
+#pragma omp parallel for
+  for (size_t i = 0; i < pairs.size(); i++)
+    results[i] = intersect(a[pairs[i].first], b[pairs[i].second]);
+  return results;
 }
@@ -1,6 +1,9 @@
 #pragma once
 
+#include <cstdint>
 #include <optional>
+#include <utility>
+#include <vector>
 
 #include "aabb.hpp"
 #include "ray.hpp"
@@ -10,9 +13,70 @@
 
 constexpr float RAY_MAX = 1682001.0f;
 
+// Ray set up once for watertight triangle tests. Axes are permuted so that z
+// is the largest direction component, and the shear maps the direction onto
+// the z axis, which reduces each test to 2D edge functions of the vertices.
+// https://jcgt.org/published/0002/01/05/
+struct Watertight_Ray {
+  Vec3 origin;
+  uint8_t kx, ky, kz;
+  float sx, sy, sz;
+
+  // Ray along +z through the origin, for arrays filled later
+  Watertight_Ray()
+      : origin(0.0f), kx(0), ky(1), kz(2), sx(0.0f), sy(0.0f), sz(1.0f) {}
+  explicit Watertight_Ray(const Ray &ray);
+};
+
+// Ray set up once for slab tests against many boxes, after "An Efficient and
+// Robust Ray-Box Intersection Algorithm" by Amy Williams et al. The reciprocal
+// direction replaces the divisions and the signs of the direction pick the
+// near and far plane of each slab, so no swaps are needed. Zero direction
+// components give infinite reciprocals, which reject slabs the origin is
+// outside of.
+struct Slab_Ray {
+  Vec3 origin, inv_dir;
+  // 1 where the direction is negative, the max plane of the slab is near
+  uint8_t sign[3];
+
+  explicit Slab_Ray(const Ray &ray);
+};
+
+// Distance where ray enters aabb within [0, running_t_max], touching counts.
+// Inlined into traversal loops.
+inline std::optional<float> intersect(const Slab_Ray &ray, const AABB &aabb,
+                                      float running_t_max = RAY_MAX) {
+  const Vec3 *planes[2] = {&aabb.min, &aabb.max};
+  float tx_near = (planes[ray.sign[0]]->x - ray.origin.x) * ray.inv_dir.x;
+  float tx_far = (planes[1 - ray.sign[0]]->x - ray.origin.x) * ray.inv_dir.x;
+  float ty_near = (planes[ray.sign[1]]->y - ray.origin.y) * ray.inv_dir.y;
+  float ty_far = (planes[1 - ray.sign[1]]->y - ray.origin.y) * ray.inv_dir.y;
+  float tz_near = (planes[ray.sign[2]]->z - ray.origin.z) * ray.inv_dir.z;
+  float tz_far = (planes[1 - ray.sign[2]]->z - ray.origin.z) * ray.inv_dir.z;
+  // A ray parallel to a slab with its origin on one of the planes gives NaN,
+  // comparisons with NaN are false so that slab does not shrink the interval
+  float t_enter = tx_near > 0.0f ? tx_near : 0.0f;
+  t_enter = ty_near > t_enter ? ty_near : t_enter;
+  t_enter = tz_near > t_enter ? tz_near : t_enter;
+  float t_exit = tx_far < running_t_max ? tx_far : running_t_max;
+  t_exit = ty_far < t_exit ? ty_far : t_exit;
+  t_exit = tz_far < t_exit ? tz_far : t_exit;
+  if (t_enter > t_exit) return std::nullopt;
+  return t_enter;
+}
+
 std::optional<float> intersect(const Ray &ray, const AABB &aabb,
                                float running_t_max = RAY_MAX);
-std::optional<float> intersect(const Ray &ray, const Triangle &triangle);
+// Hits further than running_t_max are rejected, pass the closest hit found so
+// far to skip triangles behind it
+std::optional<float> intersect(const Ray &ray, const Triangle &triangle,
+                               float running_t_max = RAY_MAX);
+// Watertight, rays never pass between triangles sharing an edge or a vertex.
+// A ray through a shared edge or vertex hits exactly one of the triangles of a
+// consistently oriented mesh around it, so hit counts keep their parity.
+std::optional<float> intersect(const Watertight_Ray &ray,
+                               const Triangle &triangle,
+                               float running_t_max = RAY_MAX);
 
 inline bool does_intersect(const Ray &ray, const AABB &aabb) {
   return intersect(ray, aabb).has_value();
@@ -23,4 +87,32 @@ inline bool does_intersect(const Ray &ray, const Triangle &triangle) {
 }
 
 bool does_intersect(const Segment &s, const AABB &aabb);
+struct Triangle_Intersection {
+  // The triangles lie in the same plane and overlap, the overlap is a polygon
+  // and segment is not set
+  bool is_coplanar;
+  // Where the triangles cross, both ends are the same point when they only
+  // touch at a point
+  Segment segment;
+};
+
+// Interval overlap test by Tomas Möller, "A Fast Triangle-Triangle
+// Intersection Test", triangles entirely on one side of the plane of the other
+// are rejected first. Nothing when the triangles do not touch. Degenerate
+// triangles with collinear vertices are treated as the segment they span, they
+// are never coplanar.
+std::optional<Triangle_Intersection> intersect(const Triangle &a,
+                                               const Triangle &b);
+// Intersections of a[i] and b[j] for each pair (i, j), for example the
+// candidate pairs found by BVH traversal, computed in parallel
+std::vector<std::optional<Triangle_Intersection>>
+intersect(const std::vector<Triangle> &a, const std::vector<Triangle> &b,
+          const std::vector<std::pair<uint32_t, uint32_t>> &pairs);
+
+// Exact separating axis test apart from rounding, touching counts as
+// overlapping
 bool does_intersect(const Triangle &t, const AABB &aabb);
+// Appends the indices of the boxes t overlaps to result, the triangle is set
+// up once for all boxes
+void find_overlapping_aabbs(const Triangle &t, const std::vector<AABB> &aabbs,
+                            std::vector<uint32_t> &result);
@@ -1,10 +1,37 @@
+#include <cstdint>
+#include <random>
+#include <utility>
 #include <vector>
 
 #include "aabb.hpp"
+#include "distance.hpp"
 #include "intersect.hpp"
 #include "test.hpp"
 #include "vec.hpp"
 
+// Whether anything is left of t after clipping it by the planes of the box
+static bool is_clipped_non_empty(const Triangle &t, const AABB &aabb) {
+  std::vector<Vec3> polygon = {t.a, t.b, t.c};
+  for (int axis = 0; axis < 3; axis++)
+    for (float sign : {1.0f, -1.0f}) {
+      // Keep the points with sign * (p[axis] - bound) <= 0
+      float bound = sign > 0.0f ? aabb.max[axis] : aabb.min[axis];
+      std::vector<Vec3> clipped;
+      for (size_t i = 0; i < polygon.size(); i++) {
+        const Vec3 &p = polygon[i];
+        const Vec3 &q = polygon[(i + 1) % polygon.size()];
+        float dp = sign * (p[axis] - bound);
+        float dq = sign * (q[axis] - bound);
+        if (dp <= 0.0f) clipped.push_back(p);
+        if ((dp < 0.0f && dq > 0.0f) || (dp > 0.0f && dq < 0.0f))
+          clipped.push_back(p + (q - p) * (dp / (dp - dq)));
+      }
+      polygon = clipped;
+      if (polygon.empty()) return false;
+    }
+  return true;
+}
+
 struct Test_Case {
   AABB aabb;
   Ray ray;
@@ -26,6 +53,233 @@ int main() {
   for (const auto &c : cases) {
     assert_equals(does_intersect(c.ray, c.aabb), c.expected_result);
   }
+  // Rays parallel to slabs, with negative zero components and with the origin
+  // on a plane of the parallel slab
+  AABB cube(Vec3(0.0f), Vec3(1.0f));
+  Slab_Ray backwards(Ray{Vec3(2.0f, 0.5f, 0.5f), Vec3(-1.0f, -0.0f, 0.0f)});
+  assert_equals(intersect(backwards, cube).value(), 1.0f);
+  Slab_Ray above(Ray{Vec3(2.0f, 1.5f, 0.5f), Vec3(-1.0f, -0.0f, 0.0f)});
+  assert_equals(intersect(above, cube).has_value(), false);
+  Slab_Ray on_face(Ray{Vec3(-1.0f, 1.0f, 0.5f), Vec3(1.0f, 0.0f, 0.0f)});
+  assert_equals(intersect(on_face, cube).value(), 1.0f);
+  Slab_Ray on_edge(Ray{Vec3(0.5f, 0.0f, 1.0f), Vec3(0.0f, 0.0f, -1.0f)});
+  assert_equals(intersect(on_edge, cube).value(), 0.0f);
+  Slab_Ray axis_aligned(Ray{Vec3(0.5f, 0.5f, -1.0f), Vec3(0.0f, 0.0f, 2.0f)});
+  assert_equals(intersect(axis_aligned, cube).value(), 0.5f);
+  assert_equals(intersect(axis_aligned, cube, 0.25f).has_value(), false);
+  // Hits behind running_t_max are culled, touching it is not
+  AABB box(Vec3(0.0f), Vec3(1.0f));
+  Ray r{Vec3(-1.0f, 0.5f, 0.5f), Vec3(1.0f, 0.0f, 0.0f)};
+  assert_equals(intersect(r, box, 0.5f).has_value(), false);
+  assert_close(intersect(r, box, 1.0f).value(), 1.0f, 1e-6f);
+  Triangle t(Vec3(2.0f, 0.0f, 0.0f), Vec3(2.0f, 1.0f, 0.0f),
+             Vec3(2.0f, 0.0f, 1.0f));
+  assert_close(intersect(r, t).value(), 3.0f, 1e-6f);
+  assert_equals(intersect(r, t, 2.5f).has_value(), false);
+  assert_close(intersect(r, t, 3.0f).value(), 3.0f, 1e-6f);
+  // Rays from inside a closed octahedron hit it exactly once, also through
+  // shared edges and vertices
+  Vec3 vertices[6] = {Vec3(1, 0, 0),  Vec3(-1, 0, 0), Vec3(0, 1, 0),
+                      Vec3(0, -1, 0), Vec3(0, 0, 1),  Vec3(0, 0, -1)};
+  std::vector<Triangle> octahedron;
+  for (int sx = 0; sx < 2; sx++)
+    for (int sy = 0; sy < 2; sy++)
+      for (int sz = 0; sz < 2; sz++) {
+        Triangle t(vertices[sx], vertices[2 + sy], vertices[4 + sz]);
+        // Facing outwards
+        if ((t.b - t.a).cross(t.c - t.a).dot(t.a) < 0.0f) std::swap(t.b, t.c);
+        octahedron.push_back(t);
+      }
+  std::vector<Vec3> directions;
+  for (const Vec3 &v : vertices) directions.push_back(v);
+  for (int i = 0; i < 6; i++)
+    for (int j = 0; j < 6; j++)
+      if (i / 2 != j / 2) directions.push_back(vertices[i] + vertices[j]);
+  directions.push_back(Vec3(0.3f, -0.7f, 0.2f));
+  for (const Vec3 &origin : {Vec3(0.0f), Vec3(0.1f, -0.2f, 0.05f)})
+    for (const Vec3 &d : directions) {
+      Ray ray{origin, d};
+      int num_hits = 0;
+      for (const Triangle &t : octahedron)
+        if (does_intersect(ray, t)) num_hits++;
+      assert_equals(num_hits, 1);
+    }
+  // A ray along the diagonal shared by two triangles of a square hits one
+  Triangle lower(Vec3(0, 0, 0), Vec3(1, 0, 0), Vec3(1, 1, 0));
+  Triangle upper(Vec3(0, 0, 0), Vec3(1, 1, 0), Vec3(0, 1, 0));
+  Ray diagonal{Vec3(0.5f, 0.5f, 1.0f), Vec3(0.0f, 0.0f, -1.0f)};
+  assert_equals(
+      does_intersect(diagonal, lower) + does_intersect(diagonal, upper), 1);
+  // Zero directions never hit
+  assert_equals(does_intersect(Ray{Vec3(0.5f, 0.5f, 0.0f), Vec3(0.0f)}, lower),
+                false);
+  // A triangle cutting through a box with all vertices and edges outside
+  AABB unit(Vec3(0.0f), Vec3(1.0f));
+  assert_equals(does_intersect(Triangle(Vec3(-10, -10, 0.5f),
+                                        Vec3(30, -10, 0.5f),
+                                        Vec3(-10, 30, 0.5f)),
+                               unit),
+                true);
+  // Separated by the plane of the triangle only
+  assert_equals(does_intersect(Triangle(Vec3(10, -3.25f, -3.25f),
+                                        Vec3(-3.25f, 10, -3.25f),
+                                        Vec3(-3.25f, -3.25f, 10)),
+                               unit),
+                false);
+  // Touching a face
+  assert_equals(does_intersect(Triangle(Vec3(1, 0, 0), Vec3(2, 1, 0),
+                                        Vec3(2, 0, 1)),
+                               unit),
+                true);
+  std::mt19937 e(42);
+  std::uniform_real_distribution<float> pos_dist(-2.0f, 2.0f);
+  auto random_point = [&] {
+    return Vec3(pos_dist(e), pos_dist(e), pos_dist(e));
+  };
+  std::vector<AABB> boxes;
+  for (int i = 0; i < 100; i++) {
+    Vec3 a = random_point();
+    Vec3 b = random_point();
+    boxes.emplace_back(Vec3::min(a, b), Vec3::max(a, b));
+  }
+  std::vector<uint32_t> overlapping;
+  for (int i = 0; i < 200; i++) {
+    Triangle t(random_point(), random_point(), random_point());
+    overlapping.clear();
+    find_overlapping_aabbs(t, boxes, overlapping);
+    size_t next = 0;
+    for (uint32_t j = 0; j < boxes.size(); j++) {
+      bool expected = is_clipped_non_empty(t, boxes[j]);
+      assert_equals(does_intersect(t, boxes[j]), expected);
+      bool found = next < overlapping.size() && overlapping[next] == j;
+      assert_equals(found, expected);
+      if (found) next++;
+    }
+  }
+  // Triangles crossing each other
+  Triangle flat(Vec3(0, 0, 0), Vec3(4, 0, 0), Vec3(0, 4, 0));
+  Triangle upright(Vec3(1, 1, -1), Vec3(1, 1, 1), Vec3(3, -1, 0));
+  auto crossing = intersect(flat, upright);
+  assert_equals(crossing.has_value(), true);
+  assert_equals(crossing->is_coplanar, false);
+  Vec3 ends[2] = {crossing->segment.a, crossing->segment.b};
+  if (ends[0].x > ends[1].x) std::swap(ends[0], ends[1]);
+  assert_close(ends[0].dist(Vec3(1, 1, 0)), 0.0f, 1e-6f);
+  assert_close(ends[1].dist(Vec3(2, 0, 0)), 0.0f, 1e-6f);
+  // Separated by the plane of the other triangle, and crossing its plane
+  // outside of it
+  assert_equals(
+      intersect(flat, Triangle(Vec3(0, 0, 1), Vec3(1, 0, 2), Vec3(0, 1, 3)))
+          .has_value(),
+      false);
+  assert_equals(intersect(flat, Triangle(Vec3(5, 5, -1), Vec3(5, 5, 1),
+                                         Vec3(6, 4, 0)))
+                    .has_value(),
+                false);
+  // Touching at a vertex
+  auto touching =
+      intersect(flat, Triangle(Vec3(1, 1, 0), Vec3(1, 2, 1), Vec3(2, 1, 1)));
+  assert_equals(touching.has_value(), true);
+  assert_equals(touching->segment.a.dist(Vec3(1, 1, 0)), 0.0f);
+  assert_equals(touching->segment.b.dist(Vec3(1, 1, 0)), 0.0f);
+  // Coplanar, overlapping without any vertex inside the other triangle, and
+  // apart
+  auto coplanar = intersect(
+      flat, Triangle(Vec3(-1, 1, 0), Vec3(3.5f, 1, 0), Vec3(1, -1, 0)));
+  assert_equals(coplanar.has_value(), true);
+  assert_equals(coplanar->is_coplanar, true);
+  assert_equals(
+      intersect(flat, Triangle(Vec3(3, 3, 0), Vec3(5, 3, 0), Vec3(3, 5, 0)))
+          .has_value(),
+      false);
+  // Exactly coplanar in a tilted plane, distances to it do not round to zero
+  // in float
+  auto on_plane = [](float s, float t) {
+    return Vec3(1000.125f, -3700.25f, 1200.375f) + Vec3(3, 1, -2) * s +
+           Vec3(-1, 2, 5) * t;
+  };
+  float s = 9.625f;
+  auto tilted =
+      intersect(Triangle(on_plane(0, 0), on_plane(s, 0), on_plane(0, s)),
+                Triangle(on_plane(s / 4, s / 4), on_plane(s, s),
+                         on_plane(-s / 2, s / 4)));
+  assert_equals(tilted.has_value(), true);
+  assert_equals(tilted->is_coplanar, true);
+  // Sliver whose float normal is mostly rounding, it meets the plane of the
+  // other triangle only outside of it
+  Triangle corner(Vec3(0, 0, 0), Vec3(1, 0, 0), Vec3(0, 1, 0));
+  Triangle sliver(Vec3(-1, 0.2f, -1), Vec3(0.2f, 0.2f, 1),
+                  Vec3(-0.4f, 0.2f, 0));
+  assert_equals(intersect(corner, sliver).has_value(), false);
+  assert_equals(intersect(sliver, corner).has_value(), false);
+  // Degenerate triangles are segments, crossing the other triangle or lying
+  // in its plane
+  Triangle piercing(Vec3(0.2f, 0.2f, -1), Vec3(0.2f, 0.2f, 1),
+                    Vec3(0.2f, 0.2f, 0.5f));
+  for (auto pierced :
+       {intersect(corner, piercing), intersect(piercing, corner)}) {
+    assert_equals(pierced.has_value(), true);
+    assert_equals(pierced->is_coplanar, false);
+    assert_close(pierced->segment.a.dist(Vec3(0.2f, 0.2f, 0)), 0.0f, 1e-6f);
+    assert_close(pierced->segment.b.dist(Vec3(0.2f, 0.2f, 0)), 0.0f, 1e-6f);
+  }
+  assert_equals(intersect(corner, Triangle(Vec3(2, 2, -1), Vec3(2, 2, 1),
+                                         Vec3(2, 2, 0.5f)))
+                    .has_value(),
+                false);
+  auto in_plane = intersect(
+      corner, Triangle(Vec3(-1, 0.5f, 0), Vec3(2, 0.5f, 0), Vec3(1, 0.5f, 0)));
+  assert_equals(in_plane.has_value(), true);
+  assert_equals(in_plane->is_coplanar, false);
+  Vec3 in_plane_ends[2] = {in_plane->segment.a, in_plane->segment.b};
+  if (in_plane_ends[0].x > in_plane_ends[1].x)
+    std::swap(in_plane_ends[0], in_plane_ends[1]);
+  assert_close(in_plane_ends[0].dist(Vec3(0, 0.5f, 0)), 0.0f, 1e-6f);
+  assert_close(in_plane_ends[1].dist(Vec3(0.5f, 0.5f, 0)), 0.0f, 1e-6f);
+  auto crossed = intersect(
+      Triangle(Vec3(0, 0, 0), Vec3(2, 2, 0), Vec3(1, 1, 0)),
+      Triangle(Vec3(0, 2, 0), Vec3(2, 0, 0), Vec3(0.5f, 1.5f, 0)));
+  assert_equals(crossed.has_value(), true);
+  assert_close(crossed->segment.a.dist(Vec3(1, 1, 0)), 0.0f, 1e-6f);
+  assert_close(crossed->segment.b.dist(Vec3(1, 1, 0)), 0.0f, 1e-6f);
+  auto collinear = intersect(
+      Triangle(Vec3(0, 0, 0), Vec3(2, 2, 2), Vec3(1, 1, 1)),
+      Triangle(Vec3(3, 3, 3), Vec3(1, 1, 1), Vec3(1.5f, 1.5f, 1.5f)));
+  assert_equals(collinear.has_value(), true);
+  assert_close(collinear->segment.a.dist(collinear->segment.b),
+               std::sqrt(3.0f), 1e-6f);
+  assert_equals(intersect(Triangle(Vec3(0, 0, 0), Vec3(2, 2, 0),
+                                   Vec3(1, 1, 0)),
+                          Triangle(Vec3(0, 2, 1), Vec3(2, 0, 1),
+                                   Vec3(1, 1, 1)))
+                    .has_value(),
+                false);
+  // Random pairs, segments lie on both triangles
+  std::vector<Triangle> tris_a, tris_b;
+  std::vector<std::pair<uint32_t, uint32_t>> pairs;
+  for (uint32_t i = 0; i < 2000; i++) {
+    tris_a.emplace_back(random_point(), random_point(), random_point());
+    tris_b.emplace_back(random_point(), random_point(), random_point());
+    pairs.push_back({i, 1999 - i});
+  }
+  auto results = intersect(tris_a, tris_b, pairs);
+  size_t num_crossing = 0;
+  for (size_t i = 0; i < pairs.size(); i++) {
+    const Triangle &ta = tris_a[pairs[i].first];
+    const Triangle &tb = tris_b[pairs[i].second];
+    auto expected = intersect(ta, tb);
+    assert_equals(results[i].has_value(), expected.has_value());
+    assert_equals(intersect(tb, ta).has_value(), expected.has_value());
+    if (!expected.has_value()) continue;
+    num_crossing++;
+    for (const Vec3 &p : {expected->segment.a, expected->segment.b}) {
+      assert_close(closest_point_on_triangle(p, ta).point.dist(p), 0.0f,
+                   1e-4f);
+      assert_close(closest_point_on_triangle(p, tb).point.dist(p), 0.0f,
+                   1e-4f);
+    }
+  }
+  assert_equals(num_crossing > 0, true);
   // TODO: test more functions
   return 0;
 }
@@ -0,0 +1,94 @@
+#include <string>
+#include <utility>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "mapped_file.hpp"
+
+#ifdef _WIN32
+std::optional<Mapped_File> Mapped_File::open(std::string_view filepath) {
+  Mapped_File file;
+  HANDLE file_handle =
+      CreateFileA(std::string(filepath).c_str(), GENERIC_READ, FILE_SHARE_READ,
+                  nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (file_handle == INVALID_HANDLE_VALUE) return std::nullopt;
+  file.file_handle = file_handle;
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(file_handle, &size)) return std::nullopt;
+  file.size = size_t(size.QuadPart);
+  // Empty files can not be mapped
+  if (file.size == 0) return file;
+  HANDLE mapping_handle =
+      CreateFileMappingA(file_handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if (mapping_handle == nullptr) return std::nullopt;
+  file.mapping_handle = mapping_handle;
+  void *data = MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0);
+  if (data == nullptr) return std::nullopt;
+  file.data = static_cast<const std::byte *>(data);
+  return file;
+}
+
+void Mapped_File::unmap() {
+  if (data != nullptr) UnmapViewOfFile(data);
+  if (mapping_handle != nullptr) CloseHandle(mapping_handle);
+  if (file_handle != nullptr) CloseHandle(file_handle);
+  data = nullptr;
+  mapping_handle = nullptr;
+  file_handle = nullptr;
+  size = 0;
+}
+#else
+std::optional<Mapped_File> Mapped_File::open(std::string_view filepath) {
+  Mapped_File file;
+  int fd = ::open(std::string(filepath).c_str(), O_RDONLY);
+  if (fd < 0) return std::nullopt;
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return std::nullopt;
+  }
+  file.size = size_t(st.st_size);
+  // Empty files can not be mapped
+  if (file.size == 0) {
+    close(fd);
+    return file;
+  }
+  void *data = mmap(nullptr, file.size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // The mapping stays valid after closing the file
+  close(fd);
+  if (data == MAP_FAILED) return std::nullopt;
+  file.data = static_cast<const std::byte *>(data);
+  return file;
+}
+
+void Mapped_File::unmap() {
+  if (data != nullptr) munmap(const_cast<std::byte *>(data), size);
+  data = nullptr;
+  size = 0;
+}
+#endif
+
+Mapped_File::Mapped_File(Mapped_File &&other) noexcept {
+  *this = std::move(other);
+}
+
+Mapped_File &Mapped_File::operator=(Mapped_File &&other) noexcept {
+  if (this == &other) return *this;
+  unmap();
+  std::swap(data, other.data);
+  std::swap(size, other.size);
+#ifdef _WIN32
+  std::swap(file_handle, other.file_handle);
+  std::swap(mapping_handle, other.mapping_handle);
+#endif
+  return *this;
+}
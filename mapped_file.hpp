@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstddef>
+#include <optional>
+#include <string_view>
+
+// Read only memory mapping of a whole file
+class Mapped_File {
+  const std::byte *data = nullptr;
+  size_t size = 0;
+#ifdef _WIN32
+  void *file_handle = nullptr;
+  void *mapping_handle = nullptr;
+#endif
+
+  Mapped_File() = default;
+  void unmap();
+
+public:
+  // Nothing if the file can not be opened or mapped
+  static std::optional<Mapped_File> open(std::string_view filepath);
+  Mapped_File(const Mapped_File &) = delete;
+  Mapped_File &operator=(const Mapped_File &) = delete;
+  Mapped_File(Mapped_File &&other) noexcept;
+  Mapped_File &operator=(Mapped_File &&other) noexcept;
+  ~Mapped_File() { unmap(); }
+  const std::byte *get_data() const { return data; }
+  size_t get_size() const { return size; }
+};
@@ -8,9 +8,9 @@
 #include <iostream>
 #include <optional>
 #include <random>
-#include <stack>
 #include <string>
 #include <string_view>
+#include <utility>
 #include <vector>
 
 #include "mesh_io.hpp"
@@ -64,24 +64,66 @@ int main(int argc, char **argv) {
   Mesh a = read_mesh_non_optional(a_filepath);
   Mesh b = read_mesh_non_optional(b_filepath);
 
-  std::vector<AABB> aabs;
-  aabs.reserve(b.tris.size());
-  for (const Triangle &t : b.tris) aabs.push_back(t.calc_aabb());
-  BVH_Tree bvh(aabs);
+  BVH_Build_Options bvh_options;
+  bvh_options.split_method = BVH_Split_Method::SAH;
+  bvh_options.max_leaf_size = 4;
+  BVH_Tree a_bvh = load_or_build_bvh(get_bvh_cache_filepath(a_filepath), a.tris,
+                                     bvh_options);
+  BVH_Tree b_bvh = load_or_build_bvh(get_bvh_cache_filepath(b_filepath), b.tris,
+                                     bvh_options);
 
-  for (const auto &a_t : a.tris) {
-    std::stack<const BVH_Node *> stack;
-    stack.push(bvh.get_root());
-    while (!stack.empty()) {
-      const BVH_Node *node = stack.top();
-      stack.pop();
-      if (!does_intersect(a_t, node->aabb)) continue;
-      if (!node->is_leaf()) {
-        stack.push(node->left);
-        stack.push(node->right);
-        continue;
-      }
-      // TODO: do triangle/triangle intersection
+  // Pairs of triangles of a and b with overlapping bounds, found by
+  // descending both trees together
+  std::vector<AABB> a_aabbs, b_aabbs;
+  a_aabbs.reserve(a.tris.size());
+  b_aabbs.reserve(b.tris.size());
+  for (const Triangle &t : a.tris) a_aabbs.push_back(t.calc_aabb());
+  for (const Triangle &t : b.tris) b_aabbs.push_back(t.calc_aabb());
+  std::vector<std::pair<uint32_t, uint32_t>> candidates =
+      find_overlapping_pairs(a_bvh, a_aabbs, b_bvh, b_aabbs);
+  std::cout << "Number of candidate triangle pairs: " << candidates.size()
+            << std::endl;
+  // Keep the pairs where each triangle overlaps the bounds of the other.
+  // Pairs are sorted by triangle of a, which is tested against the bounds of
+  // all its candidates at once.
+  std::vector<std::pair<uint32_t, uint32_t>> overlapping_pairs;
+  std::vector<AABB> candidate_aabbs;
+  std::vector<uint32_t> overlapping;
+  for (size_t start = 0; start < candidates.size();) {
+    uint32_t ai = candidates[start].first;
+    size_t end = start;
+    candidate_aabbs.clear();
+    while (end < candidates.size() && candidates[end].first == ai)
+      candidate_aabbs.push_back(b_aabbs[candidates[end++].second]);
+    overlapping.clear();
+    find_overlapping_aabbs(a.tris[ai], candidate_aabbs, overlapping);
+    for (uint32_t i : overlapping) {
+      uint32_t bi = candidates[start + i].second;
+      if (does_intersect(b.tris[bi], a_aabbs[ai]))
+        overlapping_pairs.push_back({ai, bi});
     }
+    start = end;
   }
+  std::cout << "Number of overlapping triangle pairs: "
+            << overlapping_pairs.size() << std::endl;
+  std::vector<std::optional<Triangle_Intersection>> intersections =
+      intersect(a.tris, b.tris, overlapping_pairs);
+  size_t num_crossing = 0;
+  size_t num_coplanar = 0;
+  double curve_length = 0.0;
+  for (const auto &intersection : intersections) {
+    if (!intersection.has_value()) continue;
+    if (intersection->is_coplanar) {
+      num_coplanar++;
+      continue;
+    }
+    num_crossing++;
+    curve_length += intersection->segment.a.dist(intersection->segment.b);
+  }
+  std::cout << "Number of crossing triangle pairs: " << num_crossing
+            << std::endl;
+  std::cout << "Number of coplanar triangle pairs: " << num_coplanar
+            << std::endl;
+  std::cout << "Length of intersection curve: " << curve_length << std::endl;
+  // TODO: split triangles along the intersection segments and classify them
 }
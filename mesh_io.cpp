@@ -6,8 +6,11 @@
 #include <optional>
 #include <string>
 #include <string_view>
+#include <utility>
 #include <vector>
 
+#include "endianness.hpp"
+#include "mapped_file.hpp"
 #include "mesh_io.hpp"
 
 static bool ends_with(std::string_view str, std::string_view suffix) {
@@ -21,49 +24,38 @@ static bool ends_with(std::string_view str, std::string_view suffix) {
   return true;
 }
 
-static Mesh read_stl_binary(std::ifstream &ifs, uint32_t num_tris) {
-  Mesh mesh;
-  mesh.tris.reserve(num_tris);
-  for (uint32_t i = 0; i < num_tris; i++) {
-    // Skip normal
-    ifs.seekg(sizeof(float[3]), std::ios_base::cur);
-    Triangle t(Vec3(0.0f), Vec3(0.0f), Vec3(0.0f));
-    static_assert(sizeof(Triangle) == sizeof(float[3][3]));
-    // TODO: handle endianness
-    ifs.read((char *)&t, sizeof(float[3][3]));
-    // Skip "attribute byte count"
-    ifs.seekg(sizeof(uint16_t), std::ios_base::cur);
-
-    mesh.tris.push_back(t);
+std::optional<STL_View> STL_View::open(std::string_view filepath) {
+  std::optional<Mapped_File> file = Mapped_File::open(filepath);
+  if (!file.has_value()) {
+    std::cerr << "ERROR: Failed to map " << filepath << std::endl;
+    return std::nullopt;
   }
-  return mesh;
+  if (file->get_size() < HEADER_SIZE) {
+    std::cerr << "ERROR: STL file too small" << std::endl;
+    return std::nullopt;
+  }
+  uint32_t num_tris =
+      load_little_endian<uint32_t>(file->get_data() + HEADER_SIZE - 4);
+  // Assume binary .stl file, ASCII files do not match its size
+  if (file->get_size() != HEADER_SIZE + num_tris * RECORD_SIZE) {
+    std::cerr << "Unsupported file format: ASCII STL" << std::endl;
+    return std::nullopt;
+  }
+  return STL_View(std::move(*file), num_tris);
 }
 
+// Records are independent, so they are parsed in parallel straight into the
+// triangle array
 static std::optional<Mesh> read_stl(std::string_view filepath) {
+  std::optional<STL_View> view = STL_View::open(filepath);
+  if (!view.has_value()) return std::nullopt;
   Mesh mesh;
-  std::ifstream ifs;
-  ifs.exceptions(std::ios_base::badbit);
-  ifs.open(std::string(filepath), std::ios_base::binary);
-  // Assume binary .stl file
-  ifs.seekg(80, std::ios_base::beg); // Skip binary header
-
-  uint32_t num_tris = 0;
-  ifs.read((char *)&num_tris, sizeof(uint32_t));
-
-  size_t expected_tris_size = num_tris * 50;
-
-  auto tris_begin = ifs.tellg();
-  ifs.seekg(0, std::ios_base::end);
-  size_t actual_tris_size = (ifs.tellg() - tris_begin);
-
-  if (actual_tris_size == expected_tris_size) {
-    ifs.seekg(tris_begin);
-    return read_stl_binary(ifs, num_tris);
-  } else {
-    ifs.seekg(0, std::ios_base::beg);
-    std::cerr << "Unsupported file format: ASCII STL" << std::endl;
-    return std::nullopt;
-  }
+  mesh.tris.resize(view->size(),
+                   Triangle(Vec3(0.0f), Vec3(0.0f), Vec3(0.0f)));
+#pragma omp parallel for
+  for (long long i = 0; i < (long long)view->size(); i++)
+    mesh.tris[i] = view->get_triangle(i);
+  return mesh;
 }
 
 enum class PLY_Type {
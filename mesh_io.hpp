@@ -1,14 +1,52 @@
 #pragma once
 
 #include <cassert>
+#include <cstddef>
+#include <cstdint>
 #include <optional>
 #include <string_view>
+#include <utility>
 #include <vector>
 
+#include "endianness.hpp"
+#include "mapped_file.hpp"
 #include "triangle.hpp"
 
 struct Mesh {
   std::vector<Triangle> tris;
 };
 
+// Triangles of a binary STL file read in place from a memory mapping. Records
+// are 50 bytes apart, so vertices are unaligned and each triangle is copied
+// out on access, converted from little endian on big endian hosts.
+class STL_View {
+  // 80 byte header followed by the number of triangles
+  static constexpr size_t HEADER_SIZE = 84;
+  // Normal, vertices and attribute byte count
+  static constexpr size_t RECORD_SIZE = 50;
+
+  Mapped_File file;
+  uint32_t num_tris;
+
+  STL_View(Mapped_File file, uint32_t num_tris)
+      : file(std::move(file)), num_tris(num_tris) {}
+
+public:
+  // Nothing if the file can not be mapped or is not a binary STL file
+  static std::optional<STL_View> open(std::string_view filepath);
+  uint32_t size() const { return num_tris; }
+  Triangle get_triangle(uint32_t i) const {
+    assert(i < num_tris);
+    // Skip the normal
+    const std::byte *p = file.get_data() + HEADER_SIZE + i * RECORD_SIZE +
+                         sizeof(float[3]);
+    auto vertex = [&](int v) {
+      return Vec3(load_little_endian<float>(p + (v * 3 + 0) * sizeof(float)),
+                  load_little_endian<float>(p + (v * 3 + 1) * sizeof(float)),
+                  load_little_endian<float>(p + (v * 3 + 2) * sizeof(float)));
+    };
+    return Triangle(vertex(0), vertex(1), vertex(2));
+  }
+};
+
 std::optional<Mesh> read_mesh(std::string_view filepath);
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+
+#include "aabb.hpp"
+#include "vec.hpp"
+
+// https://developer.nvidia.com/blog/thinking-parallel-part-iii-tree-construction-gpu/
+
+// Insert two zero bits after each of the lower 10 bits of v
+inline uint32_t expand_bits_10(uint32_t v) {
+  v &= 0x3ff;
+  v = (v | (v << 16)) & 0x030000ff;
+  v = (v | (v << 8)) & 0x0300f00f;
+  v = (v | (v << 4)) & 0x030c30c3;
+  v = (v | (v << 2)) & 0x09249249;
+  return v;
+}
+
+// Insert two zero bits after each of the lower 21 bits of v
+inline uint64_t expand_bits_21(uint64_t v) {
+  v &= 0x1fffff;
+  v = (v | (v << 32)) & 0x001f00000000ffffull;
+  v = (v | (v << 16)) & 0x001f0000ff0000ffull;
+  v = (v | (v << 8)) & 0x100f00f00f00f00full;
+  v = (v | (v << 4)) & 0x10c30c30c30c30c3ull;
+  v = (v | (v << 2)) & 0x1249249249249249ull;
+  return v;
+}
+
+// Morton code with num_bits / 3 bits per axis of p quantized relative to
+// bounds, num_bits is either 30 or 63
+inline uint64_t calc_morton_code(const Vec3 &p, const AABB &bounds,
+                                 uint32_t num_bits) {
+  assert(num_bits == 30 || num_bits == 63);
+  uint32_t bits_per_axis = num_bits / 3;
+  float num_cells = float(1u << bits_per_axis);
+  Vec3 extent = bounds.calc_extent();
+  uint64_t cells[3];
+  for (int i = 0; i < 3; i++) {
+    float t = extent[i] > 0.0f ? (p[i] - bounds.min[i]) / extent[i] : 0.0f;
+    t = std::min(std::max(t * num_cells, 0.0f), num_cells - 1.0f);
+    cells[i] = uint64_t(t);
+  }
+  if (num_bits == 30)
+    return (expand_bits_10(cells[0]) << 2) | (expand_bits_10(cells[1]) << 1) |
+           expand_bits_10(cells[2]);
+  return (expand_bits_21(cells[0]) << 2) | (expand_bits_21(cells[1]) << 1) |
+         expand_bits_21(cells[2]);
+}
@@ -0,0 +1,315 @@
+#include <cmath>
+#include <vector>
+
+#include "predicates.hpp"
+#include "vec.hpp"
+
+namespace {
+
+// Inputs are floats, so their differences and products up to the fifth degree
+// neither overflow nor underflow in double and the error bounds of the paper
+// hold for every finite input
+constexpr double EPSILON = 0x1p-53;
+constexpr double ORIENT_2D_BOUND = (3.0 + 16.0 * EPSILON) * EPSILON;
+constexpr double ORIENT_3D_BOUND = (7.0 + 56.0 * EPSILON) * EPSILON;
+constexpr double IN_CIRCLE_BOUND = (10.0 + 96.0 * EPSILON) * EPSILON;
+constexpr double IN_SPHERE_BOUND = (16.0 + 224.0 * EPSILON) * EPSILON;
+
+// x + y = a + b exactly, x is the rounded sum
+void two_sum(double a, double b, double &x, double &y) {
+  x = a + b;
+  double b_virtual = x - a;
+  double a_virtual = x - b_virtual;
+  y = (a - a_virtual) + (b - b_virtual);
+}
+
+// Same as two_sum when |a| >= |b|
+void fast_two_sum(double a, double b, double &x, double &y) {
+  x = a + b;
+  y = b - (x - a);
+}
+
+// x + y = a * b exactly, x is the rounded product
+void two_product(double a, double b, double &x, double &y) {
+  x = a * b;
+  y = std::fma(a, b, -x);
+}
+
+// Exact sum of doubles that do not overlap, sorted by increasing magnitude and
+// without zeros, so the sign of the sum is the sign of the last component
+class Expansion {
+  std::vector<double> components;
+
+  Expansion grow(double b) const {
+    Expansion result;
+    double q = b;
+    for (double e : components) {
+      double h;
+      two_sum(q, e, q, h);
+      if (h != 0.0) result.components.push_back(h);
+    }
+    if (q != 0.0) result.components.push_back(q);
+    return result;
+  }
+
+  Expansion scale(double b) const {
+    Expansion result;
+    if (components.empty()) return result;
+    double q, h;
+    two_product(components[0], b, q, h);
+    if (h != 0.0) result.components.push_back(h);
+    for (size_t i = 1; i < components.size(); i++) {
+      double product_high, product_low, sum;
+      two_product(components[i], b, product_high, product_low);
+      two_sum(q, product_low, sum, h);
+      if (h != 0.0) result.components.push_back(h);
+      fast_two_sum(product_high, sum, q, h);
+      if (h != 0.0) result.components.push_back(h);
+    }
+    if (q != 0.0) result.components.push_back(q);
+    return result;
+  }
+
+public:
+  Expansion() = default;
+  Expansion(double a) {
+    if (a != 0.0) components.push_back(a);
+  }
+  // Exact a - b
+  static Expansion difference(double a, double b) {
+    double x, y;
+    two_sum(a, -b, x, y);
+    Expansion result;
+    if (y != 0.0) result.components.push_back(y);
+    if (x != 0.0) result.components.push_back(x);
+    return result;
+  }
+
+  Expansion operator-() const {
+    Expansion result = *this;
+    for (double &c : result.components) c = -c;
+    return result;
+  }
+  Expansion operator+(const Expansion &other) const {
+    Expansion result = *this;
+    for (double c : other.components) result = result.grow(c);
+    return result;
+  }
+  Expansion operator-(const Expansion &other) const { return *this + -other; }
+  Expansion operator*(const Expansion &other) const {
+    Expansion result;
+    for (double c : other.components) result = result + scale(c);
+    return result;
+  }
+
+  // Rounded sum, with the sign of the exact sum
+  double approximate() const {
+    double sum = 0.0;
+    for (double c : components) sum += c;
+    return sum;
+  }
+};
+
+double orient_2d_exact(const Vec2 &a, const Vec2 &b, const Vec2 &c) {
+  Expansion acx = Expansion::difference(a.x, c.x);
+  Expansion acy = Expansion::difference(a.y, c.y);
+  Expansion bcx = Expansion::difference(b.x, c.x);
+  Expansion bcy = Expansion::difference(b.y, c.y);
+  return (acx * bcy - acy * bcx).approximate();
+}
+
+double orient_3d_exact(const Vec3 &a, const Vec3 &b, const Vec3 &c,
+                       const Vec3 &d) {
+  Expansion ad[3], bd[3], cd[3];
+  for (int i = 0; i < 3; i++) {
+    ad[i] = Expansion::difference(a[i], d[i]);
+    bd[i] = Expansion::difference(b[i], d[i]);
+    cd[i] = Expansion::difference(c[i], d[i]);
+  }
+  Expansion det = ad[2] * (bd[0] * cd[1] - cd[0] * bd[1]) +
+                  bd[2] * (cd[0] * ad[1] - ad[0] * cd[1]) +
+                  cd[2] * (ad[0] * bd[1] - bd[0] * ad[1]);
+  return det.approximate();
+}
+
+double in_circle_exact(const Vec2 &a, const Vec2 &b, const Vec2 &c,
+                       const Vec2 &d) {
+  Expansion adx = Expansion::difference(a.x, d.x);
+  Expansion ady = Expansion::difference(a.y, d.y);
+  Expansion bdx = Expansion::difference(b.x, d.x);
+  Expansion bdy = Expansion::difference(b.y, d.y);
+  Expansion cdx = Expansion::difference(c.x, d.x);
+  Expansion cdy = Expansion::difference(c.y, d.y);
+  Expansion a_lift = adx * adx + ady * ady;
+  Expansion b_lift = bdx * bdx + bdy * bdy;
+  Expansion c_lift = cdx * cdx + cdy * cdy;
+  Expansion det = a_lift * (bdx * cdy - cdx * bdy) +
+                  b_lift * (cdx * ady - adx * cdy) +
+                  c_lift * (adx * bdy - bdx * ady);
+  return det.approximate();
+}
+
+double in_sphere_exact(const Vec3 &a, const Vec3 &b, const Vec3 &c,
+                       const Vec3 &d, const Vec3 &e) {
+  Expansion ae[3], be[3], ce[3], de[3];
+  for (int i = 0; i < 3; i++) {
+    ae[i] = Expansion::difference(a[i], e[i]);
+    be[i] = Expansion::difference(b[i], e[i]);
+    ce[i] = Expansion::difference(c[i], e[i]);
+    de[i] = Expansion::difference(d[i], e[i]);
+  }
+  Expansion ab = ae[0] * be[1] - be[0] * ae[1];
+  Expansion bc = be[0] * ce[1] - ce[0] * be[1];
+  Expansion cd = ce[0] * de[1] - de[0] * ce[1];
+  Expansion da = de[0] * ae[1] - ae[0] * de[1];
+  Expansion ac = ae[0] * ce[1] - ce[0] * ae[1];
+  Expansion bd = be[0] * de[1] - de[0] * be[1];
+  Expansion abc = ae[2] * bc - be[2] * ac + ce[2] * ab;
+  Expansion bcd = be[2] * cd - ce[2] * bd + de[2] * bc;
+  Expansion cda = ce[2] * da + de[2] * ac + ae[2] * cd;
+  Expansion dab = de[2] * ab + ae[2] * bd + be[2] * da;
+  auto lift = [](const Expansion(&v)[3]) {
+    return v[0] * v[0] + v[1] * v[1] + v[2] * v[2];
+  };
+  Expansion det = (lift(de) * abc - lift(ce) * dab) +
+                  (lift(be) * cda - lift(ae) * bcd);
+  return det.approximate();
+}
+
+} // namespace
+
+double orient_2d(const Vec2 &a, const Vec2 &b, const Vec2 &c) {
+  double det_left = (double(a.x) - c.x) * (double(b.y) - c.y);
+  double det_right = (double(a.y) - c.y) * (double(b.x) - c.x);
+  double det = det_left - det_right;
+  double error_bound =
+      ORIENT_2D_BOUND * (std::fabs(det_left) + std::fabs(det_right));
+  if (std::fabs(det) >= error_bound) return det;
+  return orient_2d_exact(a, b, c);
+}
+
+double orient_3d(const Vec3 &a, const Vec3 &b, const Vec3 &c, const Vec3 &d) {
+  double adx = double(a.x) - d.x, ady = double(a.y) - d.y;
+  double adz = double(a.z) - d.z;
+  double bdx = double(b.x) - d.x, bdy = double(b.y) - d.y;
+  double bdz = double(b.z) - d.z;
+  double cdx = double(c.x) - d.x, cdy = double(c.y) - d.y;
+  double cdz = double(c.z) - d.z;
+  double bdx_cdy = bdx * cdy, cdx_bdy = cdx * bdy;
+  double cdx_ady = cdx * ady, adx_cdy = adx * cdy;
+  double adx_bdy = adx * bdy, bdx_ady = bdx * ady;
+  double det = adz * (bdx_cdy - cdx_bdy) + bdz * (cdx_ady - adx_cdy) +
+               cdz * (adx_bdy - bdx_ady);
+  double permanent =
+      (std::fabs(bdx_cdy) + std::fabs(cdx_bdy)) * std::fabs(adz) +
+      (std::fabs(cdx_ady) + std::fabs(adx_cdy)) * std::fabs(bdz) +
+      (std::fabs(adx_bdy) + std::fabs(bdx_ady)) * std::fabs(cdz);
+  double error_bound = ORIENT_3D_BOUND * permanent;
+  if (std::fabs(det) >= error_bound) return det;
+  return orient_3d_exact(a, b, c, d);
+}
+
+Plane_Orientation::Plane_Orientation(const Vec3 &a, const Vec3 &b,
+                                     const Vec3 &c)
+    : a(a), b(b), c(c) {
+  double ab[3], ac[3];
+  for (int i = 0; i < 3; i++) {
+    ab[i] = double(b[i]) - a[i];
+    ac[i] = double(c[i]) - a[i];
+  }
+  for (int i = 0; i < 3; i++) {
+    int j = (i + 1) % 3;
+    int k = (i + 2) % 3;
+    double p = ab[j] * ac[k];
+    double q = ab[k] * ac[j];
+    normal[i] = p - q;
+    normal_permanent[i] = std::fabs(p) + std::fabs(q);
+  }
+}
+
+// The determinant expanded along the row of d instead of a column, which is
+// the same evaluation as orient_3d() of the transposed matrix, so the same
+// error bound holds
+double Plane_Orientation::operator()(const Vec3 &d) const {
+  double ad[3] = {double(d.x) - a.x, double(d.y) - a.y, double(d.z) - a.z};
+  double det = normal[0] * ad[0] + normal[1] * ad[1] + normal[2] * ad[2];
+  double permanent = normal_permanent[0] * std::fabs(ad[0]) +
+                     normal_permanent[1] * std::fabs(ad[1]) +
+                     normal_permanent[2] * std::fabs(ad[2]);
+  double error_bound = ORIENT_3D_BOUND * permanent;
+  // orient_3d(a, b, c, d) = -normal.dot(d - a)
+  if (std::fabs(det) >= error_bound) return -det;
+  return orient_3d_exact(a, b, c, d);
+}
+
+double in_circle(const Vec2 &a, const Vec2 &b, const Vec2 &c, const Vec2 &d) {
+  double adx = double(a.x) - d.x, ady = double(a.y) - d.y;
+  double bdx = double(b.x) - d.x, bdy = double(b.y) - d.y;
+  double cdx = double(c.x) - d.x, cdy = double(c.y) - d.y;
+  double bdx_cdy = bdx * cdy, cdx_bdy = cdx * bdy;
+  double cdx_ady = cdx * ady, adx_cdy = adx * cdy;
+  double adx_bdy = adx * bdy, bdx_ady = bdx * ady;
+  double a_lift = adx * adx + ady * ady;
+  double b_lift = bdx * bdx + bdy * bdy;
+  double c_lift = cdx * cdx + cdy * cdy;
+  double det = a_lift * (bdx_cdy - cdx_bdy) + b_lift * (cdx_ady - adx_cdy) +
+               c_lift * (adx_bdy - bdx_ady);
+  double permanent = (std::fabs(bdx_cdy) + std::fabs(cdx_bdy)) * a_lift +
+                     (std::fabs(cdx_ady) + std::fabs(adx_cdy)) * b_lift +
+                     (std::fabs(adx_bdy) + std::fabs(bdx_ady)) * c_lift;
+  double error_bound = IN_CIRCLE_BOUND * permanent;
+  if (std::fabs(det) >= error_bound) return det;
+  return in_circle_exact(a, b, c, d);
+}
+
+double in_sphere(const Vec3 &a, const Vec3 &b, const Vec3 &c, const Vec3 &d,
+                 const Vec3 &e) {
+  double aex = double(a.x) - e.x, aey = double(a.y) - e.y;
+  double aez = double(a.z) - e.z;
+  double bex = double(b.x) - e.x, bey = double(b.y) - e.y;
+  double bez = double(b.z) - e.z;
+  double cex = double(c.x) - e.x, cey = double(c.y) - e.y;
+  double cez = double(c.z) - e.z;
+  double dex = double(d.x) - e.x, dey = double(d.y) - e.y;
+  double dez = double(d.z) - e.z;
+
+  double aex_bey = aex * bey, bex_aey = bex * aey;
+  double bex_cey = bex * cey, cex_bey = cex * bey;
+  double cex_dey = cex * dey, dex_cey = dex * cey;
+  double dex_aey = dex * aey, aex_dey = aex * dey;
+  double aex_cey = aex * cey, cex_aey = cex * aey;
+  double bex_dey = bex * dey, dex_bey = dex * bey;
+  double ab = aex_bey - bex_aey;
+  double bc = bex_cey - cex_bey;
+  double cd = cex_dey - dex_cey;
+  double da = dex_aey - aex_dey;
+  double ac = aex_cey - cex_aey;
+  double bd = bex_dey - dex_bey;
+
+  double abc = aez * bc - bez * ac + cez * ab;
+  double bcd = bez * cd - cez * bd + dez * bc;
+  double cda = cez * da + dez * ac + aez * cd;
+  double dab = dez * ab + aez * bd + bez * da;
+  double a_lift = aex * aex + aey * aey + aez * aez;
+  double b_lift = bex * bex + bey * bey + bez * bez;
+  double c_lift = cex * cex + cey * cey + cez * cez;
+  double d_lift = dex * dex + dey * dey + dez * dez;
+  double det = (d_lift * abc - c_lift * dab) + (b_lift * cda - a_lift * bcd);
+
+  double aez_abs = std::fabs(aez), bez_abs = std::fabs(bez);
+  double cez_abs = std::fabs(cez), dez_abs = std::fabs(dez);
+  double ab_abs = std::fabs(aex_bey) + std::fabs(bex_aey);
+  double bc_abs = std::fabs(bex_cey) + std::fabs(cex_bey);
+  double cd_abs = std::fabs(cex_dey) + std::fabs(dex_cey);
+  double da_abs = std::fabs(dex_aey) + std::fabs(aex_dey);
+  double ac_abs = std::fabs(aex_cey) + std::fabs(cex_aey);
+  double bd_abs = std::fabs(bex_dey) + std::fabs(dex_bey);
+  double permanent =
+      (cd_abs * bez_abs + bd_abs * cez_abs + bc_abs * dez_abs) * a_lift +
+      (da_abs * cez_abs + ac_abs * dez_abs + cd_abs * aez_abs) * b_lift +
+      (ab_abs * dez_abs + bd_abs * aez_abs + da_abs * bez_abs) * c_lift +
+      (bc_abs * aez_abs + ac_abs * bez_abs + ab_abs * cez_abs) * d_lift;
+  double error_bound = IN_SPHERE_BOUND * permanent;
+  if (std::fabs(det) >= error_bound) return det;
+  return in_sphere_exact(a, b, c, d, e);
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "vec.hpp"
+
+// Geometric predicates with exact signs, after "Adaptive Precision
+// Floating-Point Arithmetic and Fast Robust Geometric Predicates" by Jonathan
+// Richard Shewchuk. Each predicate is first evaluated in double with an error
+// bound, which decides almost all non-degenerate inputs at the cost of naive
+// evaluation. Inputs the bound can not decide are evaluated exactly with
+// expansion arithmetic. Results are approximations of the determinants whose
+// signs are always correct.
+
+// Positive when a, b and c are in counterclockwise order, negative when they
+// are in clockwise order and zero when they are collinear
+double orient_2d(const Vec2 &a, const Vec2 &b, const Vec2 &c);
+// Positive when d is below the plane through a, b and c, which appear in
+// counterclockwise order seen from above, negative when d is above it and zero
+// when the points are coplanar
+double orient_3d(const Vec3 &a, const Vec3 &b, const Vec3 &c, const Vec3 &d);
+// orient_3d() of many points against the plane through a, b and c, the edges
+// and the normal are computed once
+class Plane_Orientation {
+  Vec3 a, b, c;
+  double normal[3];
+  // Normal with the absolute values of its products, for the error bound
+  double normal_permanent[3];
+
+public:
+  Plane_Orientation(const Vec3 &a, const Vec3 &b, const Vec3 &c);
+  // Same sign as orient_3d(a, b, c, d)
+  double operator()(const Vec3 &d) const;
+};
+// Positive when d is inside the circle through a, b and c, which must be in
+// counterclockwise order, negative when outside and zero when on it
+double in_circle(const Vec2 &a, const Vec2 &b, const Vec2 &c, const Vec2 &d);
+// Positive when e is inside the sphere through a, b, c and d, which must be
+// oriented so that orient_3d(a, b, c, d) is positive, negative when outside
+// and zero when on it
+double in_sphere(const Vec3 &a, const Vec3 &b, const Vec3 &c, const Vec3 &d,
+                 const Vec3 &e);
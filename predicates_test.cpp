@@ -0,0 +1,184 @@
+#include <cstdint>
+#include <random>
+
+#include "predicates.hpp"
+#include "test.hpp"
+#include "vec.hpp"
+
+// Points on an integer lattice scaled by SCALE, so the reference determinants
+// below are exact in 128 bit integers
+constexpr float SCALE = 1.0f / 256.0f;
+
+using Int = __int128;
+
+struct Lattice_Point {
+  Int x, y, z;
+  Vec2 to_vec2() const { return Vec2(float(x) * SCALE, float(y) * SCALE); }
+  Vec3 to_vec3() const {
+    return Vec3(float(x) * SCALE, float(y) * SCALE, float(z) * SCALE);
+  }
+  Lattice_Point operator-(const Lattice_Point &p) const {
+    return {x - p.x, y - p.y, z - p.z};
+  }
+};
+
+int sign(Int v) { return (v > 0) - (v < 0); }
+int sign(double v) { return (v > 0) - (v < 0); }
+
+Int det_2(Int a, Int b, Int c, Int d) { return a * d - b * c; }
+
+Int det_3(const Lattice_Point &a, const Lattice_Point &b,
+          const Lattice_Point &c) {
+  return a.z * det_2(b.x, b.y, c.x, c.y) - b.z * det_2(a.x, a.y, c.x, c.y) +
+         c.z * det_2(a.x, a.y, b.x, b.y);
+}
+
+int orient_3d_reference(Lattice_Point a, Lattice_Point b, Lattice_Point c,
+                        Lattice_Point d) {
+  return sign(det_3(a - d, b - d, c - d));
+}
+
+int in_circle_reference(Lattice_Point a, Lattice_Point b, Lattice_Point c,
+                        Lattice_Point d) {
+  auto lift = [&](Lattice_Point p) {
+    p = p - d;
+    p.z = p.x * p.x + p.y * p.y;
+    return p;
+  };
+  return sign(det_3(lift(a), lift(b), lift(c)));
+}
+
+int in_sphere_reference(Lattice_Point a, Lattice_Point b, Lattice_Point c,
+                        Lattice_Point d, Lattice_Point e) {
+  Lattice_Point p[4] = {a - e, b - e, c - e, d - e};
+  Int lift[4];
+  for (int i = 0; i < 4; i++)
+    lift[i] = p[i].x * p[i].x + p[i].y * p[i].y + p[i].z * p[i].z;
+  // Expansion along the lifted column, minors skip one row each
+  Int det = 0;
+  for (int i = 0; i < 4; i++) {
+    Lattice_Point minor[3];
+    for (int j = 0, k = 0; j < 4; j++)
+      if (j != i) minor[k++] = p[j];
+    Int term = lift[i] * det_3(minor[0], minor[1], minor[2]);
+    det += i % 2 == 0 ? -term : term;
+  }
+  return sign(det);
+}
+
+int main() {
+  // Naive float evaluation rounds most of these to zero
+  Vec2 a(0.5f, 0.5f);
+  Vec2 c(24.0f, 24.0f);
+  for (int i = -128; i < 128; i++) {
+    // Steps of one ulp away from the line through a and c
+    Vec2 b(12.0f + i * 0x1p-20f, 12.0f);
+    assert_equals(sign(orient_2d(a, b, c)), sign(double(i)));
+    assert_equals(sign(orient_2d(b, a, c)), -sign(double(i)));
+  }
+
+  // Points around a line through coordinates of very different magnitude, the
+  // products of their differences are not exact in double. All coordinates are
+  // multiples of 2^-24.
+  auto fixed = [](float v) { return Int(double(v) * 0x1p24); };
+  Vec2 far(1536.0f, 1536.0f);
+  for (int i = 0; i < 16; i++)
+    for (int j = 0; j < 16; j++)
+      for (int k = -2; k <= 2; k++)
+        for (int l = -2; l <= 2; l++) {
+          Vec2 near(0.5f + i * 0x1p-24f, 0.5f + j * 0x1p-24f);
+          Vec2 middle(768.0f + k * 0x1p-14f, 768.0f + l * 0x1p-14f);
+          int expected = sign(det_2(
+              fixed(near.x) - fixed(far.x), fixed(near.y) - fixed(far.y),
+              fixed(middle.x) - fixed(far.x), fixed(middle.y) - fixed(far.y)));
+          assert_equals(sign(orient_2d(near, middle, far)), expected);
+        }
+
+  Vec2 unit_square[4] = {Vec2(0, 0), Vec2(1, 0), Vec2(1, 1), Vec2(0, 1)};
+  assert_equals(sign(orient_2d(unit_square[0], unit_square[1],
+                               unit_square[2])),
+                1);
+  assert_equals(sign(in_circle(unit_square[0], unit_square[1],
+                               unit_square[2], unit_square[3])),
+                0);
+  assert_equals(sign(in_circle(unit_square[0], unit_square[1],
+                               unit_square[2], Vec2(0.5f, 0.5f))),
+                1);
+  assert_equals(sign(in_circle(unit_square[0], unit_square[1],
+                               unit_square[2], Vec2(2, 2))),
+                -1);
+
+  Vec3 o(0.0f), x(1, 0, 0), y(0, 1, 0), z(0, 0, 1);
+  assert_equals(sign(orient_3d(o, x, y, z)), -1);
+  assert_equals(sign(orient_3d(o, x, y, Vec3(0, 0, -1))), 1);
+  assert_equals(sign(orient_3d(o, x, y, Vec3(5, 7, 0))), 0);
+  assert_equals(sign(in_sphere(o, x, y, Vec3(0, 0, -1), Vec3(1, 1, 0))), 0);
+  assert_equals(sign(in_sphere(o, x, y, Vec3(0, 0, -1), Vec3(0.1f))), 1);
+
+  // Nearly degenerate lattice points, compared against exact integer
+  // determinants. Points lie on a plane, a circle or a sphere, the last one is
+  // moved by at most one lattice step.
+  std::mt19937 gen(42);
+  std::uniform_int_distribution<int> coordinate(-4096, 4096);
+  std::uniform_int_distribution<int> nudge(-1, 1);
+  std::uniform_int_distribution<int> step(-64, 64);
+  auto random_point = [&]() -> Lattice_Point {
+    return {coordinate(gen), coordinate(gen), coordinate(gen)};
+  };
+  auto nudged = [&](Lattice_Point p) -> Lattice_Point {
+    return {p.x + nudge(gen), p.y + nudge(gen), p.z + nudge(gen)};
+  };
+  // Lattice points of the circle and sphere of radius 65 about the origin
+  Lattice_Point on_circle[] = {{65, 0, 0},   {63, 16, 0}, {60, 25, 0},
+                               {56, 33, 0},  {52, 39, 0}, {39, -52, 0},
+                               {-33, 56, 0}, {-25, -60, 0}};
+  Lattice_Point on_sphere[] = {{65, 0, 0},   {0, 65, 0},   {0, 0, 65},
+                               {60, 25, 0},  {0, -60, 25}, {-25, 0, -60},
+                               {48, 36, 25}, {-36, 25, 48}, {25, -48, -36}};
+  int num_degenerate = 0;
+  for (int i = 0; i < 20000; i++) {
+    Lattice_Point p = random_point();
+    Lattice_Point d1 = {step(gen), step(gen), step(gen)};
+    Lattice_Point d2 = {step(gen), step(gen), step(gen)};
+    auto on_plane = [&]() -> Lattice_Point {
+      int s = step(gen), t = step(gen);
+      return {p.x + s * d1.x + t * d2.x, p.y + s * d1.y + t * d2.y,
+              p.z + s * d1.z + t * d2.z};
+    };
+    Lattice_Point q[4] = {on_plane(), on_plane(), on_plane(),
+                          nudged(on_plane())};
+    int expected = orient_3d_reference(q[0], q[1], q[2], q[3]);
+    assert_equals(sign(orient_3d(q[0].to_vec3(), q[1].to_vec3(),
+                                 q[2].to_vec3(), q[3].to_vec3())),
+                  expected);
+    num_degenerate += expected == 0;
+
+    auto pick_circle = [&]() {
+      Lattice_Point r = on_circle[gen() % 8];
+      return Lattice_Point{p.x + r.x, p.y + r.y, 0};
+    };
+    Lattice_Point r[4] = {pick_circle(), pick_circle(), pick_circle(),
+                          nudged(pick_circle())};
+    expected = in_circle_reference(r[0], r[1], r[2], r[3]);
+    assert_equals(sign(in_circle(r[0].to_vec2(), r[1].to_vec2(),
+                                 r[2].to_vec2(), r[3].to_vec2())),
+                  expected);
+    num_degenerate += expected == 0;
+
+    auto pick_sphere = [&]() {
+      Lattice_Point s = on_sphere[gen() % 9];
+      return Lattice_Point{p.x + s.x, p.y + s.y, p.z + s.z};
+    };
+    Lattice_Point s[5] = {pick_sphere(), pick_sphere(), pick_sphere(),
+                          pick_sphere(), nudged(pick_sphere())};
+    expected = in_sphere_reference(s[0], s[1], s[2], s[3], s[4]);
+    assert_equals(sign(in_sphere(s[0].to_vec3(), s[1].to_vec3(),
+                                 s[2].to_vec3(), s[3].to_vec3(),
+                                 s[4].to_vec3())),
+                  expected);
+    num_degenerate += expected == 0;
+  }
+  // Make sure the exact paths were taken
+  if (num_degenerate < 1000) assert_equals(num_degenerate, 1000);
+  return 0;
+}
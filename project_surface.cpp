@@ -8,6 +8,7 @@
 #include <string_view>
 #include <vector>
 
+#include "bvh.hpp"
 #include "mesh_io.hpp"
 #include "vec.hpp"
 #include "write_ply.hpp"
@@ -23,7 +24,8 @@ static Mesh read_mesh_non_optional(std::string_view filepath) {
 
 int main(int argc, char **argv) {
   if (argc != 4) {
-    std::cerr << "Expected arguments: source.stl target.stl output.stl" << std::endl;
+    std::cerr << "Expected arguments: source.stl target.stl output.ply"
+              << std::endl;
     return 1;
   }
   const char *source_filepath = argv[1];
@@ -32,4 +34,26 @@ int main(int argc, char **argv) {
 
   Mesh source = read_mesh_non_optional(source_filepath);
   Mesh target = read_mesh_non_optional(target_filepath);
+  if (target.tris.empty()) {
+    std::cerr << "Empty target mesh" << std::endl;
+    return 1;
+  }
+
+  BVH_Build_Options bvh_options;
+  bvh_options.split_method = BVH_Split_Method::SAH;
+  bvh_options.max_leaf_size = 4;
+  BVH_Tree target_bvh = load_or_build_bvh(
+      get_bvh_cache_filepath(target_filepath), target.tris, bvh_options);
+
+  // Project vertices of source onto the closest points of the target surface
+  std::vector<Vec3> projected(source.tris.size() * 3, Vec3(0.0f));
+#pragma omp parallel for
+  for (size_t i = 0; i < source.tris.size(); i++) {
+    for (int j = 0; j < 3; j++) {
+      auto closest =
+          closest_triangle(source.tris[i][j], target.tris, target_bvh);
+      projected[i * 3 + j] = closest->point;
+    }
+  }
+  write_ply(projected, output_filepath);
 }
@@ -0,0 +1,77 @@
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+#include "pseudonormals.hpp"
+#include "triangle.hpp"
+#include "vec.hpp"
+
+namespace {
+// Adding +0 turns -0 into +0, so positions that compare equal hash equally
+struct Vec3_Hash {
+  size_t operator()(const Vec3 &v) const {
+    float canonical[3] = {v.x + 0.0f, v.y + 0.0f, v.z + 0.0f};
+    uint32_t bits[3];
+    std::memcpy(bits, canonical, sizeof(bits));
+    return (size_t(bits[0]) * 73856093) ^ (size_t(bits[1]) * 19349663) ^
+           (size_t(bits[2]) * 83492791);
+  }
+};
+struct Vec3_Equal {
+  bool operator()(const Vec3 &a, const Vec3 &b) const {
+    return a.x == b.x && a.y == b.y && a.z == b.z;
+  }
+};
+} // namespace
+
+Pseudonormals::Pseudonormals(const std::vector<Triangle> &tris) {
+  // Weld vertices with equal positions, STL files store every triangle
+  // separately
+  std::unordered_map<Vec3, uint32_t, Vec3_Hash, Vec3_Equal> vertex_ids;
+  std::unordered_map<uint64_t, uint32_t> edge_ids;
+  tri_vertices.reserve(tris.size());
+  tri_edges.reserve(tris.size());
+  face_normals.reserve(tris.size());
+  for (const Triangle &t : tris) {
+    Vec3 n = (t.b - t.a).cross(t.c - t.a);
+    float mag = n.mag();
+    // Degenerate triangles do not contribute to pseudonormals
+    face_normals.push_back(mag > 0.0f ? n / mag : Vec3(0.0f));
+    std::array<uint32_t, 3> v;
+    for (int i = 0; i < 3; i++) {
+      auto [it, inserted] = vertex_ids.try_emplace(
+          t[i], uint32_t(vertex_normals.size()));
+      if (inserted) vertex_normals.push_back(Vec3(0.0f));
+      v[i] = it->second;
+    }
+    std::array<uint32_t, 3> e;
+    for (int i = 0; i < 3; i++) {
+      uint32_t v0 = std::min(v[i], v[(i + 1) % 3]);
+      uint32_t v1 = std::max(v[i], v[(i + 1) % 3]);
+      auto [it, inserted] = edge_ids.try_emplace(
+          (uint64_t(v0) << 32) | v1, uint32_t(edge_normals.size()));
+      if (inserted) edge_normals.push_back(Vec3(0.0f));
+      e[i] = it->second;
+    }
+    tri_vertices.push_back(v);
+    tri_edges.push_back(e);
+  }
+  for (size_t ti = 0; ti < tris.size(); ti++) {
+    const Triangle &t = tris[ti];
+    const Vec3 &n = face_normals[ti];
+    for (int i = 0; i < 3; i++) {
+      Vec3 e0 = t[(i + 1) % 3] - t[i];
+      Vec3 e1 = t[(i + 2) % 3] - t[i];
+      float cos_angle = e0.dot(e1) / (e0.mag() * e1.mag());
+      float angle = std::acos(std::clamp(cos_angle, -1.0f, 1.0f));
+      if (std::isfinite(angle))
+        vertex_normals[tri_vertices[ti][i]] =
+            vertex_normals[tri_vertices[ti][i]] + n * angle;
+      edge_normals[tri_edges[ti][i]] = edge_normals[tri_edges[ti][i]] + n;
+    }
+  }
+}
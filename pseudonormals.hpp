@@ -0,0 +1,41 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include "triangle.hpp"
+#include "vec.hpp"
+
+// Angle weighted pseudonormals of vertices and edges, the sign of the distance
+// to the closest point is the side of its pseudonormal the query point is on
+// https://doi.org/10.1109/TVCG.2005.49
+class Pseudonormals {
+  std::vector<std::array<uint32_t, 3>> tri_vertices;
+  // Edge i of a triangle goes from vertex i to vertex (i + 1) % 3
+  std::vector<std::array<uint32_t, 3>> tri_edges;
+  std::vector<Vec3> vertex_normals;
+  std::vector<Vec3> edge_normals;
+  std::vector<Vec3> face_normals;
+
+public:
+  explicit Pseudonormals(const std::vector<Triangle> &tris);
+
+  uint32_t get_num_vertices() const { return vertex_normals.size(); }
+  uint32_t get_num_edges() const { return edge_normals.size(); }
+  // Pseudonormal at a point given by its barycentric coordinates on a triangle,
+  // exact zeros mean the point is on an edge or a vertex
+  const Vec3 &get(uint32_t ti, const Vec3 &barycentric) const {
+    int num_zeros = (barycentric.x == 0.0f) + (barycentric.y == 0.0f) +
+                    (barycentric.z == 0.0f);
+    if (num_zeros == 0) return face_normals[ti];
+    if (num_zeros == 2) {
+      int i = barycentric.x != 0.0f ? 0 : (barycentric.y != 0.0f ? 1 : 2);
+      return vertex_normals[tri_vertices[ti][i]];
+    }
+    // Edge opposite to the vertex with zero weight
+    if (barycentric.x == 0.0f) return edge_normals[tri_edges[ti][1]];
+    if (barycentric.y == 0.0f) return edge_normals[tri_edges[ti][2]];
+    return edge_normals[tri_edges[ti][0]];
+  }
+};
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Stable LSD radix sort of values by keys, 8 bits per pass, only the lowest
+// num_bits of the keys are considered. Each pass histograms and scatters a
+// fixed number of chunks in parallel, so the result does not depend on the
+// number of threads.
+template <typename Value>
+void radix_sort(std::vector<uint64_t> &keys, std::vector<Value> &values,
+                uint32_t num_bits) {
+  assert(keys.size() == values.size());
+  constexpr uint32_t RADIX_BITS = 8;
+  constexpr uint32_t RADIX = 1 << RADIX_BITS;
+  constexpr uint32_t MAX_CHUNKS = 64;
+  constexpr size_t MIN_CHUNK_SIZE = 1 << 14;
+  const size_t n = keys.size();
+  const uint32_t num_chunks =
+      uint32_t(std::min<size_t>(MAX_CHUNKS, n / MIN_CHUNK_SIZE + 1));
+  auto chunk_start = [&](uint32_t c) { return n * c / num_chunks; };
+
+  std::vector<uint64_t> sorted_keys(n);
+  std::vector<Value> sorted_values(n);
+  std::vector<std::array<size_t, RADIX>> offsets(num_chunks);
+  for (uint32_t shift = 0; shift < num_bits; shift += RADIX_BITS) {
+#pragma omp parallel for
+    for (uint32_t c = 0; c < num_chunks; c++) {
+      offsets[c].fill(0);
+      for (size_t i = chunk_start(c); i < chunk_start(c + 1); i++)
+        offsets[c][(keys[i] >> shift) & (RADIX - 1)]++;
+    }
+    // Each chunk scatters a digit after all smaller digits and after the same
+    // digit of all previous chunks
+    size_t sum = 0;
+    for (uint32_t digit = 0; digit < RADIX; digit++) {
+      for (uint32_t c = 0; c < num_chunks; c++) {
+        size_t count = offsets[c][digit];
+        offsets[c][digit] = sum;
+        sum += count;
+      }
+    }
+#pragma omp parallel for
+    for (uint32_t c = 0; c < num_chunks; c++) {
+      for (size_t i = chunk_start(c); i < chunk_start(c + 1); i++) {
+        size_t j = offsets[c][(keys[i] >> shift) & (RADIX - 1)]++;
+        sorted_keys[j] = keys[i];
+        sorted_values[j] = values[i];
+      }
+    }
+    std::swap(keys, sorted_keys);
+    std::swap(values, sorted_values);
+  }
+}
@@ -0,0 +1,317 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#define GEOPROC_X86_64
+#endif
+
+#include "intersect.hpp"
+#include "morton.hpp"
+#include "radix_sort.hpp"
+#include "ray_packet.hpp"
+
+namespace {
+// Same semantics as minps and maxps, if either operand is NaN the second one
+// is returned
+float lane_min(float a, float b) { return a < b ? a : b; }
+float lane_max(float a, float b) { return a > b ? a : b; }
+
+// Kernels return a bit mask of the rays that hit aabb within [0, t_max]. Like
+// Slab_Ray, the near and far plane of each slab are picked by the sign bit of
+// the reciprocal direction of each ray. A ray parallel to a slab with its
+// origin on one of the planes gives NaN for that plane only, the running
+// interval is passed second so that NaN is ignored.
+template <uint32_t N>
+using Packet_Kernel = uint32_t (*)(const AABB &, const Ray_Packet<N> &,
+                                   const float *);
+
+template <uint32_t N>
+uint32_t intersect_packet_scalar(const AABB &aabb, const Ray_Packet<N> &packet,
+                                 const float *t_max) {
+  uint32_t mask = 0;
+  for (uint32_t i = 0; i < N; i++) {
+    float t_enter = 0.0f;
+    float t_exit = t_max[i];
+    for (int axis = 0; axis < 3; axis++) {
+      float t1 = (aabb.min[axis] - packet.origin[axis][i]) *
+                 packet.inv_dir[axis][i];
+      float t2 = (aabb.max[axis] - packet.origin[axis][i]) *
+                 packet.inv_dir[axis][i];
+      bool negative = std::signbit(packet.inv_dir[axis][i]);
+      t_enter = lane_max(negative ? t2 : t1, t_enter);
+      t_exit = lane_min(negative ? t1 : t2, t_exit);
+    }
+    if (t_enter <= t_exit) mask |= 1u << i;
+  }
+  return mask;
+}
+
+#ifdef GEOPROC_X86_64
+template <uint32_t N>
+uint32_t intersect_packet_sse(const AABB &aabb, const Ray_Packet<N> &packet,
+                              const float *t_max) {
+  uint32_t mask = 0;
+  for (uint32_t i = 0; i < N; i += 4) {
+    __m128 t_enter = _mm_setzero_ps();
+    __m128 t_exit = _mm_load_ps(t_max + i);
+    for (int axis = 0; axis < 3; axis++) {
+      __m128 origin = _mm_load_ps(packet.origin[axis] + i);
+      __m128 inv_dir = _mm_load_ps(packet.inv_dir[axis] + i);
+      __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(aabb.min[axis]), origin),
+                             inv_dir);
+      __m128 t2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(aabb.max[axis]), origin),
+                             inv_dir);
+      // All ones where the sign bit is set, SSE2 has no blendv
+      __m128 negative =
+          _mm_castsi128_ps(_mm_srai_epi32(_mm_castps_si128(inv_dir), 31));
+      __m128 t_near = _mm_or_ps(_mm_and_ps(negative, t2),
+                                _mm_andnot_ps(negative, t1));
+      __m128 t_far = _mm_or_ps(_mm_and_ps(negative, t1),
+                               _mm_andnot_ps(negative, t2));
+      t_enter = _mm_max_ps(t_near, t_enter);
+      t_exit = _mm_min_ps(t_far, t_exit);
+    }
+    mask |= uint32_t(_mm_movemask_ps(_mm_cmple_ps(t_enter, t_exit))) << i;
+  }
+  return mask;
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+// Compiled for AVX2 regardless of compiler flags, only called after
+// detect_simd_level() confirmed CPU support
+template <uint32_t N>
+__attribute__((target("avx2"))) uint32_t
+intersect_packet_avx2(const AABB &aabb, const Ray_Packet<N> &packet,
+                      const float *t_max) {
+  static_assert(N % 8 == 0, "AVX2 kernel tests 8 rays at a time");
+  uint32_t mask = 0;
+  for (uint32_t i = 0; i < N; i += 8) {
+    __m256 t_enter = _mm256_setzero_ps();
+    __m256 t_exit = _mm256_load_ps(t_max + i);
+    for (int axis = 0; axis < 3; axis++) {
+      __m256 origin = _mm256_load_ps(packet.origin[axis] + i);
+      __m256 inv_dir = _mm256_load_ps(packet.inv_dir[axis] + i);
+      __m256 t1 = _mm256_mul_ps(
+          _mm256_sub_ps(_mm256_set1_ps(aabb.min[axis]), origin), inv_dir);
+      __m256 t2 = _mm256_mul_ps(
+          _mm256_sub_ps(_mm256_set1_ps(aabb.max[axis]), origin), inv_dir);
+      // blendv picks the second operand where the sign bit is set
+      t_enter = _mm256_max_ps(_mm256_blendv_ps(t1, t2, inv_dir), t_enter);
+      t_exit = _mm256_min_ps(_mm256_blendv_ps(t2, t1, inv_dir), t_exit);
+    }
+    mask |= uint32_t(_mm256_movemask_ps(
+                _mm256_cmp_ps(t_enter, t_exit, _CMP_LE_OQ)))
+            << i;
+  }
+  return mask;
+}
+#endif
+#endif
+
+// intersect_leaf(ray, start, end, t_max) returns the closest hit among the
+// primitives [start, end) of the tree
+template <uint32_t N, Packet_Kernel<N> intersect_packet,
+          typename Leaf_Intersector>
+void closest_hits_impl(const Ray_Packet<N> &packet, const BVH_Tree &bvh,
+                       const Leaf_Intersector &intersect_leaf,
+                       std::optional<Ray_Hit> (&hits)[N]) {
+  alignas(32) float t_max[N];
+  for (uint32_t i = 0; i < N; i++) {
+    t_max[i] = RAY_MAX;
+    hits[i] = std::nullopt;
+  }
+  const uint32_t active = (1u << packet.num_rays) - 1;
+  if (active == 0) return;
+  Watertight_Ray rays[N];
+  for (uint32_t i = 0; i < packet.num_rays; i++)
+    rays[i] = Watertight_Ray(packet.get_ray(i));
+  // Each popped node pushes at most two children, one of them is popped next
+  uint32_t stack[BVH_MAX_DEPTH];
+  uint32_t stack_size = 0;
+  stack[stack_size++] = BVH_Tree::ROOT;
+  while (stack_size > 0) {
+    uint32_t node_index = stack[--stack_size];
+    const BVH_Node &node = bvh.get_node(node_index);
+    // Rays that already hit something closer than the node drop out
+    uint32_t mask = intersect_packet(node.aabb, packet, t_max) & active;
+    if (mask == 0) continue;
+    if (node.is_leaf()) {
+      for (uint32_t i = 0; i < N; i++) {
+        if (!((mask >> i) & 1)) continue;
+        auto hit = intersect_leaf(rays[i], node.start(), node.end(), t_max[i]);
+        // Ties keep the triangle found first
+        if (!hit.has_value() || (hits[i].has_value() && hit->t == t_max[i]))
+          continue;
+        t_max[i] = hit->t;
+        hits[i] = hit;
+      }
+      continue;
+    }
+    // Visit the child that is closer along the first active ray first, rays of
+    // a packet are assumed to point the same way
+    uint32_t left = BVH_Node::left_child(node_index);
+    uint32_t right = node.right_child();
+    uint32_t first = 0;
+    while (!((mask >> first) & 1)) first++;
+    Vec3 direction(packet.direction[0][first], packet.direction[1][first],
+                   packet.direction[2][first]);
+    Vec3 separation = bvh.get_node(right).aabb.calc_center() -
+                      bvh.get_node(left).aabb.calc_center();
+    assert(stack_size + 2 <= BVH_MAX_DEPTH);
+    if (separation.dot(direction) > 0.0f) {
+      stack[stack_size++] = right;
+      stack[stack_size++] = left;
+    } else {
+      stack[stack_size++] = left;
+      stack[stack_size++] = right;
+    }
+  }
+}
+
+// Packets of the batched query, one AVX2 kernel call per node
+constexpr uint32_t BATCH_PACKET_SIZE = 8;
+// Packets handed to each thread at a time
+constexpr size_t BATCH_CHUNK_SIZE = 64;
+
+// Direction octant above a Morton code of the origin, so that rays of a packet
+// have close origins and directions that point the same way
+std::vector<uint32_t> sort_by_octant_and_origin(const std::vector<Ray> &rays) {
+  AABB bounds(Vec3(std::numeric_limits<float>::infinity()),
+              Vec3(-std::numeric_limits<float>::infinity()));
+  for (const Ray &r : rays) bounds.grow(AABB(r.origin, r.origin));
+  constexpr uint32_t MORTON_CODE_BITS = 30;
+  std::vector<uint64_t> keys(rays.size());
+  std::vector<uint32_t> order(rays.size());
+#pragma omp parallel for
+  for (size_t i = 0; i < rays.size(); i++) {
+    const Vec3 &d = rays[i].direction;
+    uint64_t octant = (d.x < 0.0f) | ((d.y < 0.0f) << 1) | ((d.z < 0.0f) << 2);
+    keys[i] = (octant << MORTON_CODE_BITS) |
+              calc_morton_code(rays[i].origin, bounds, MORTON_CODE_BITS);
+    order[i] = i;
+  }
+  radix_sort(keys, order, MORTON_CODE_BITS + 3);
+  return order;
+}
+
+template <uint32_t N, typename Leaf_Intersector>
+void closest_hits_dispatch(const Ray_Packet<N> &packet, const BVH_Tree &bvh,
+                           const Leaf_Intersector &intersect_leaf,
+                           std::optional<Ray_Hit> (&hits)[N]) {
+#ifdef GEOPROC_X86_64
+  static const SIMD_Level level = detect_simd_level();
+#if defined(__GNUC__) || defined(__clang__)
+  if constexpr (N % 8 == 0)
+    if (level == SIMD_Level::AVX2)
+      return closest_hits_impl<N, intersect_packet_avx2<N>>(
+          packet, bvh, intersect_leaf, hits);
+#endif
+  if (level >= SIMD_Level::SSE)
+    return closest_hits_impl<N, intersect_packet_sse<N>>(packet, bvh,
+                                                         intersect_leaf, hits);
+#endif
+  closest_hits_impl<N, intersect_packet_scalar<N>>(packet, bvh, intersect_leaf,
+                                                   hits);
+}
+} // namespace
+
+template <uint32_t N>
+uint32_t intersect_packet(const AABB &aabb, const Ray_Packet<N> &packet,
+                          const float *t_max, SIMD_Level simd_level) {
+  const uint32_t active = (1u << packet.num_rays) - 1;
+#ifdef GEOPROC_X86_64
+#if defined(__GNUC__) || defined(__clang__)
+  if constexpr (N % 8 == 0)
+    if (simd_level == SIMD_Level::AVX2)
+      return intersect_packet_avx2<N>(aabb, packet, t_max) & active;
+#endif
+  if (simd_level >= SIMD_Level::SSE)
+    return intersect_packet_sse<N>(aabb, packet, t_max) & active;
+#endif
+  return intersect_packet_scalar<N>(aabb, packet, t_max) & active;
+}
+
+template uint32_t intersect_packet(const AABB &, const Ray_Packet<4> &,
+                                   const float *, SIMD_Level);
+template uint32_t intersect_packet(const AABB &, const Ray_Packet<8> &,
+                                   const float *, SIMD_Level);
+template uint32_t intersect_packet(const AABB &, const Ray_Packet<16> &,
+                                   const float *, SIMD_Level);
+
+template <uint32_t N>
+void closest_hits(const Ray_Packet<N> &packet,
+                  const std::vector<Triangle> &tris, const BVH_Tree &bvh,
+                  std::optional<Ray_Hit> (&hits)[N]) {
+  auto intersect_leaf = [&](const Watertight_Ray &ray, uint32_t start,
+                            uint32_t end, float t_max) {
+    std::optional<Ray_Hit> result;
+    for (uint32_t j = start; j < end; j++) {
+      uint32_t ti = bvh.remap_index(j);
+      auto hit = intersect(ray, tris[ti], t_max);
+      if (!hit.has_value() || (result.has_value() && *hit == t_max)) continue;
+      t_max = *hit;
+      result = {*hit, ti};
+    }
+    return result;
+  };
+  closest_hits_dispatch(packet, bvh, intersect_leaf, hits);
+}
+
+template <uint32_t N>
+void closest_hits(const Ray_Packet<N> &packet, const Triangle_Blocks &blocks,
+                  const BVH_Tree &bvh, std::optional<Ray_Hit> (&hits)[N]) {
+  auto intersect_leaf = [&](const Watertight_Ray &ray, uint32_t start,
+                            uint32_t end, float t_max) {
+    return closest_hit(ray, blocks, start, end, t_max);
+  };
+  closest_hits_dispatch(packet, bvh, intersect_leaf, hits);
+}
+
+template void closest_hits<4>(const Ray_Packet<4> &,
+                              const std::vector<Triangle> &, const BVH_Tree &,
+                              std::optional<Ray_Hit> (&)[4]);
+template void closest_hits<8>(const Ray_Packet<8> &,
+                              const std::vector<Triangle> &, const BVH_Tree &,
+                              std::optional<Ray_Hit> (&)[8]);
+template void closest_hits<16>(const Ray_Packet<16> &,
+                               const std::vector<Triangle> &, const BVH_Tree &,
+                               std::optional<Ray_Hit> (&)[16]);
+template void closest_hits<4>(const Ray_Packet<4> &, const Triangle_Blocks &,
+                              const BVH_Tree &, std::optional<Ray_Hit> (&)[4]);
+template void closest_hits<8>(const Ray_Packet<8> &, const Triangle_Blocks &,
+                              const BVH_Tree &, std::optional<Ray_Hit> (&)[8]);
+template void closest_hits<16>(const Ray_Packet<16> &, const Triangle_Blocks &,
+                               const BVH_Tree &,
+                               std::optional<Ray_Hit> (&)[16]);
+
+std::vector<std::optional<Ray_Hit>>
+closest_hits(const std::vector<Ray> &rays, const std::vector<Triangle> &tris,
+             const BVH_Tree &bvh) {
+  return closest_hits(rays, Triangle_Blocks(tris, bvh), bvh);
+}
+
+std::vector<std::optional<Ray_Hit>>
+closest_hits(const std::vector<Ray> &rays, const Triangle_Blocks &blocks,
+             const BVH_Tree &bvh) {
+  std::vector<uint32_t> order = sort_by_octant_and_origin(rays);
+  std::vector<std::optional<Ray_Hit>> results(rays.size());
+  size_t num_packets =
+      (order.size() + BATCH_PACKET_SIZE - 1) / BATCH_PACKET_SIZE;
+  // Rays of each packet are consecutive in the sorted order
+#pragma omp parallel for schedule(dynamic, BATCH_CHUNK_SIZE)
+  for (size_t p = 0; p < num_packets; p++) {
+    size_t start = p * BATCH_PACKET_SIZE;
+    size_t end = std::min(start + BATCH_PACKET_SIZE, order.size());
+    Ray_Packet<BATCH_PACKET_SIZE> packet;
+    for (size_t i = start; i < end; i++) packet.push(rays[order[i]]);
+    std::optional<Ray_Hit> hits[BATCH_PACKET_SIZE];
+    closest_hits(packet, blocks, bvh, hits);
+    for (size_t i = start; i < end; i++) results[order[i]] = hits[i - start];
+  }
+  return results;
+}
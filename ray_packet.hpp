@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+#include "aabb.hpp"
+#include "bvh.hpp"
+#include "ray.hpp"
+#include "triangle.hpp"
+#include "triangle_block.hpp"
+#include "wide_bvh.hpp"
+
+// Up to N coherent rays traced together, every node is tested once against all
+// active rays of the packet. Slab test inputs are stored component wise (SoA)
+// so that SIMD kernels test 4 or 8 rays at a time.
+template <uint32_t N> struct Ray_Packet {
+  static_assert(N == 4 || N == 8 || N == 16, "Unsupported packet size");
+  alignas(32) float origin[3][N] = {};
+  alignas(32) float direction[3][N] = {};
+  alignas(32) float inv_dir[3][N] = {};
+  uint32_t num_rays = 0;
+
+  void push(const Ray &r) {
+    assert(num_rays < N);
+    for (int axis = 0; axis < 3; axis++) {
+      origin[axis][num_rays] = r.origin[axis];
+      direction[axis][num_rays] = r.direction[axis];
+      inv_dir[axis][num_rays] = 1.0f / r.direction[axis];
+    }
+    num_rays++;
+  }
+  Ray get_ray(uint32_t i) const {
+    assert(i < num_rays);
+    return {Vec3(origin[0][i], origin[1][i], origin[2][i]),
+            Vec3(direction[0][i], direction[1][i], direction[2][i])};
+  }
+};
+
+// Bit mask of the rays of the packet that enter aabb within their t_max, tested
+// with the same kernel as closest_hits() on a CPU with simd_level. Each ray
+// gets the same result as intersect() with a Slab_Ray.
+template <uint32_t N>
+uint32_t intersect_packet(const AABB &aabb, const Ray_Packet<N> &packet,
+                          const float *t_max, SIMD_Level simd_level);
+
+// Closest hit of each ray of the packet, same results as closest_hit()
+template <uint32_t N>
+void closest_hits(const Ray_Packet<N> &packet,
+                  const std::vector<Triangle> &tris, const BVH_Tree &bvh,
+                  std::optional<Ray_Hit> (&hits)[N]);
+// Same with the triangles of each leaf tested a block at a time, blocks must
+// be built from the same tree
+template <uint32_t N>
+void closest_hits(const Ray_Packet<N> &packet, const Triangle_Blocks &blocks,
+                  const BVH_Tree &bvh, std::optional<Ray_Hit> (&hits)[N]);
+
+// Closest hit of each ray, rays are sorted by direction octant and origin
+// along a Morton curve, traced in packets in parallel. Results are in the
+// order of the rays.
+std::vector<std::optional<Ray_Hit>>
+closest_hits(const std::vector<Ray> &rays, const std::vector<Triangle> &tris,
+             const BVH_Tree &bvh);
+// Same with prebuilt triangle blocks, for many batches against the same mesh
+std::vector<std::optional<Ray_Hit>>
+closest_hits(const std::vector<Ray> &rays, const Triangle_Blocks &blocks,
+             const BVH_Tree &bvh);
@@ -6,105 +6,64 @@
 #include <iostream>
 #include <optional>
 #include <random>
-#include <stack>
 #include <string>
 #include <utility>
 #include <vector>
 
 #include "aabb.hpp"
 #include "bvh.hpp"
-#include "intersect.hpp"
 #include "mesh_io.hpp"
+#include "ray_packet.hpp"
 #include "triangle.hpp"
+#include "triangle_block.hpp"
 #include "vec.hpp"
 #include "write_ply.hpp"
 
 constexpr float PI = 3.1415927f;
 
-static size_t count_intersections(const Ray &r, const BVH_Tree &tree,
-                                  const std::vector<Triangle> &tris) {
-  std::stack<const BVH_Node *> stack;
-  stack.push(tree.get_root());
-  size_t num_hits = 0;
-  while (!stack.empty()) {
-    const BVH_Node *node = stack.top();
-    stack.pop();
-    if (!does_intersect(r, node->aabb)) continue;
-    if (node->is_leaf()) {
-      for (uint32_t i = node->start; i < node->end; i++) {
-        const Triangle &t = tris[tree.remap_index(i)];
-        if (does_intersect(r, t)) num_hits++;
-      }
-    } else {
-      stack.push(node->left);
-      stack.push(node->right);
-    }
-  }
-  return num_hits;
-}
-
-struct Closest_Hit_Result {
-  float t;
-  uint32_t triangle_index;
-};
-
-static std::optional<Closest_Hit_Result>
-closest_hit(const Ray &r, const BVH_Tree &tree,
-            const std::vector<Triangle> &tris) {
-  std::optional<Closest_Hit_Result> result;
-  std::stack<const BVH_Node *> stack;
-  stack.push(tree.get_root());
-  while (!stack.empty()) {
-    const BVH_Node *node = stack.top();
-    stack.pop();
-    if (!does_intersect(r, node->aabb)) continue;
-    if (!node->is_leaf()) {
-      stack.push(node->left);
-      stack.push(node->right);
-      continue;
-    }
-    for (uint32_t i = node->start; i < node->end; i++) {
-      uint32_t ti = tree.remap_index(i);
-      const Triangle &t = tris[ti];
-      auto hit = intersect(r, t);
-      if (!hit.has_value()) continue;
-      if (!result.has_value() || hit.value() < result->t)
-        result = {hit.value(), ti};
-    }
-  }
-  return result;
-}
-
 static bool is_point_in_volume(const Vec3 &p, const BVH_Tree &tree,
                                const std::vector<Triangle> &tris) {
   Ray r{p, Vec3(0, 0, 1)};
-  size_t num_hits = count_intersections(r, tree, tris);
+  size_t num_hits = count_intersections(r, tris, tree);
   return num_hits % 2 != 0;
 }
 
 static bool is_point_in_volume_2(const Vec3 &p, const BVH_Tree &tree,
                                  const std::vector<Triangle> &tris) {
   Ray r{p, Vec3(0, 0, 1)};
-  auto hit = closest_hit(r, tree, tris);
+  auto hit = closest_hit(r, tris, tree);
   if (!hit.has_value()) return false;
   const Triangle &t = tris[hit->triangle_index];
   Vec3 n = t.calc_normal();
   return n.dot(r.direction) > 0.0f;
 }
 
-static bool is_point_in_volume_3(const Vec3 &p, const BVH_Tree &tree,
+// Majority vote of the closest hits along all directions, rays of nearby points
+// with the same direction are traced together in packets
+static void are_points_in_volume(const std::vector<Vec3> &points,
+                                 const BVH_Tree &tree,
                                  const std::vector<Triangle> &tris,
-                                 const std::vector<Vec3> &directions) {
-  size_t num_inside = 0;
-  for (const auto &d : directions) {
-    Ray r{p, d};
-    auto hit = closest_hit(r, tree, tris);
-    if (!hit.has_value()) continue;
-    const Triangle &t = tris[hit->triangle_index];
-    Vec3 n = t.calc_normal();
-    if (n.dot(r.direction) > 0.0f) num_inside++;
+                                 const std::vector<Vec3> &directions,
+                                 bool *is_in_volume) {
+  // Leaf triangles are tested a block at a time
+  Triangle_Blocks blocks(tris, tree);
+  std::vector<uint32_t> num_inside(points.size(), 0);
+  std::vector<Ray> rays;
+  rays.reserve(points.size());
+  for (const Vec3 &d : directions) {
+    rays.clear();
+    for (const Vec3 &p : points) rays.push_back({p, d});
+    std::vector<std::optional<Ray_Hit>> hits = closest_hits(rays, blocks, tree);
+#pragma omp parallel for
+    for (long long i = 0; i < (long long)points.size(); i++) {
+      if (!hits[i].has_value()) continue;
+      const Triangle &t = tris[hits[i]->triangle_index];
+      Vec3 n = t.calc_normal();
+      if (n.dot(d) > 0.0f) num_inside[i]++;
+    }
   }
-  return num_inside >= (directions.size() / 2);
+  for (size_t i = 0; i < points.size(); i++)
+    is_in_volume[i] = num_inside[i] >= (directions.size() / 2);
 }
 
 int main(int argc, char **argv) {
@@ -130,12 +89,23 @@ int main(int argc, char **argv) {
     return 1;
   }
 
-  std::vector<AABB> aabbs;
-  aabbs.reserve(tris.size());
-  for (const Triangle &t : tris) aabbs.push_back(t.calc_aabb());
-
-  // Build BVH tree
-  BVH_Tree tree(aabbs);
+  // Build BVH tree, or load it from the cache next to the mesh
+  BVH_Build_Options bvh_options;
+  bvh_options.split_method = BVH_Split_Method::SAH;
+  // Leaves are tested a block of triangles at a time, for about the cost of
+  // two single triangle tests
+  bvh_options.max_leaf_size = TRIANGLE_BLOCK_SIZE;
+  bvh_options.intersection_cost = 0.25f;
+  auto build_start = std::chrono::high_resolution_clock::now();
+  BVH_Tree tree = load_or_build_bvh(get_bvh_cache_filepath(mesh_filepath), tris,
+                                    bvh_options);
+  auto build_end = std::chrono::high_resolution_clock::now();
+  std::cout << "BVH load or build took "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(
+                   build_end - build_start)
+                   .count()
+            << "ms" << std::endl;
+  std::cout << tree.calc_stats() << std::endl;
 
   // Sample random points in AABB
   const AABB &aabb = tree.get_aabb();
@@ -178,10 +148,7 @@ int main(int argc, char **argv) {
   std::cout << "Filtering points..." << std::endl;
   auto t1 = std::chrono::high_resolution_clock::now();
   bool *is_in_volume = (bool *)malloc(num_points);
-#pragma omp parallel for
-  for (long long i = 0; i < num_points; i++) {
-    is_in_volume[i] = is_point_in_volume_3(points[i], tree, tris, directions);
-  }
+  are_points_in_volume(points, tree, tris, directions, is_in_volume);
   auto t2 = std::chrono::high_resolution_clock::now();
   std::cout
       << "Took "
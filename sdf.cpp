@@ -0,0 +1,226 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "aabb.hpp"
+#include "bvh.hpp"
+#include "mesh_io.hpp"
+#include "pseudonormals.hpp"
+#include "triangle.hpp"
+#include "vec.hpp"
+
+// Signed distance grid, negative inside the mesh. The grid is made of cubic
+// bricks of BRICK_SIZE^3 cells, in the file a header is followed by the state
+// of each brick (x fastest), then by the values of every stored brick in brick
+// order (x fastest inside a brick). Bricks that are further than the band from
+// the surface are not stored, all their cells are +band or -band.
+constexpr uint32_t BRICK_SIZE = 8;
+constexpr uint32_t CELLS_PER_BRICK = BRICK_SIZE * BRICK_SIZE * BRICK_SIZE;
+constexpr char SDF_MAGIC[8] = "GPSDF";
+constexpr uint32_t SDF_VERSION = 1;
+
+enum class Brick_State : uint8_t {
+  Outside = 0,
+  Inside = 1,
+  Stored = 2,
+};
+
+struct SDF_Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t brick_size;
+  uint32_t num_bricks[3];
+  // Center of the first cell
+  float origin[3];
+  float cell_size;
+  // Infinity for dense grids
+  float band;
+};
+
+static Mesh read_mesh_non_optional(std::string_view filepath) {
+  std::optional<Mesh> mesh = read_mesh(filepath);
+  if (!mesh.has_value()) {
+    std::cerr << "Failed to load mesh from " << filepath << std::endl;
+    std::exit(1);
+  }
+  return *mesh;
+}
+
+int main(int argc, char **argv) {
+  if (argc != 4 && argc != 5) {
+    std::cerr << "Expected arguments: mesh.stl resolution output.sdf "
+                 "[band_cells]"
+              << std::endl;
+    return 1;
+  }
+  const char *mesh_filepath = argv[1];
+  uint32_t resolution = std::stoul(argv[2]);
+  const char *output_filepath = argv[3];
+  // Without a band every cell gets its exact distance
+  float band_cells = argc == 5 ? std::stof(argv[4])
+                               : std::numeric_limits<float>::infinity();
+  if (resolution == 0 || !(band_cells > 0.0f)) {
+    std::cerr << "Resolution and band must be positive" << std::endl;
+    return 1;
+  }
+
+  Mesh mesh = read_mesh_non_optional(mesh_filepath);
+  const std::vector<Triangle> &tris = mesh.tris;
+  if (tris.empty()) {
+    std::cerr << "Empty mesh" << std::endl;
+    return 1;
+  }
+  std::cout << "Number of triangles: " << tris.size() << std::endl;
+
+  auto start = std::chrono::high_resolution_clock::now();
+  BVH_Build_Options bvh_options;
+  bvh_options.split_method = BVH_Split_Method::SAH;
+  bvh_options.max_leaf_size = 4;
+  BVH_Tree bvh = load_or_build_bvh(get_bvh_cache_filepath(mesh_filepath), tris,
+                                   bvh_options);
+  Pseudonormals pseudonormals(tris);
+  auto setup_end = std::chrono::high_resolution_clock::now();
+  std::cout << "BVH and pseudonormals took "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(
+                   setup_end - start)
+                   .count()
+            << "ms" << std::endl;
+
+  // Cubic cells, resolution cells along the longest axis of the mesh, padded so
+  // that the boundary cells are outside the mesh and the band fits, rounded up
+  // to whole bricks
+  const AABB &aabb = bvh.get_aabb();
+  Vec3 extent = aabb.calc_extent();
+  float cell_size =
+      std::max(extent.x, std::max(extent.y, extent.z)) / float(resolution);
+  if (!(cell_size > 0.0f)) cell_size = 1.0f;
+  float band = band_cells * cell_size;
+  uint32_t padding =
+      1 + (std::isfinite(band_cells) ? uint32_t(std::ceil(band_cells)) : 0);
+  uint32_t num_bricks[3];
+  float origin[3];
+  for (int axis = 0; axis < 3; axis++) {
+    uint32_t num_cells = uint32_t(std::ceil(extent[axis] / cell_size)) + 1 +
+                         2 * padding;
+    num_bricks[axis] = (num_cells + BRICK_SIZE - 1) / BRICK_SIZE;
+    origin[axis] = aabb.min[axis] - float(padding) * cell_size;
+  }
+  size_t total_bricks = size_t(num_bricks[0]) * num_bricks[1] * num_bricks[2];
+  std::cout << "Grid: " << num_bricks[0] * BRICK_SIZE << "x"
+            << num_bricks[1] * BRICK_SIZE << "x" << num_bricks[2] * BRICK_SIZE
+            << " cells of size " << cell_size << std::endl;
+
+  auto cell_center = [&](uint32_t x, uint32_t y, uint32_t z) {
+    return Vec3(origin[0] + float(x) * cell_size,
+                origin[1] + float(y) * cell_size,
+                origin[2] + float(z) * cell_size);
+  };
+  // Distance from the center of a brick to its furthest cell
+  float brick_radius =
+      std::sqrt(3.0f) * 0.5f * float(BRICK_SIZE - 1) * cell_size;
+
+  // Fill bricks in parallel, cells of a brick are close in memory and in space
+  // so their queries touch the same BVH nodes
+  std::vector<Brick_State> states(total_bricks, Brick_State::Outside);
+  std::vector<std::vector<float>> bricks(total_bricks);
+#pragma omp parallel for schedule(dynamic, 1)
+  for (long long bi = 0; bi < (long long)total_bricks; bi++) {
+    uint32_t bx = uint32_t(bi % num_bricks[0]);
+    uint32_t by = uint32_t(bi / num_bricks[0] % num_bricks[1]);
+    uint32_t bz = uint32_t(bi / num_bricks[0] / num_bricks[1]);
+    float half = 0.5f * float(BRICK_SIZE - 1);
+    Vec3 center = cell_center(bx * BRICK_SIZE, by * BRICK_SIZE,
+                              bz * BRICK_SIZE) +
+                  Vec3(half * cell_size);
+    float center_distance = closest_triangle(center, tris, bvh)->distance;
+    // No surface within a cell of the brick, the sign of the whole brick is
+    // resolved from its neighbors afterwards
+    if (center_distance - brick_radius - cell_size > band) continue;
+
+    states[bi] = Brick_State::Stored;
+    std::vector<float> &values = bricks[bi];
+    values.resize(CELLS_PER_BRICK);
+    std::optional<Vec3> prev_point;
+    for (uint32_t z = 0; z < BRICK_SIZE; z++)
+      for (uint32_t y = 0; y < BRICK_SIZE; y++)
+        for (uint32_t x = 0; x < BRICK_SIZE; x++) {
+          Vec3 p = cell_center(bx * BRICK_SIZE + x, by * BRICK_SIZE + y,
+                               bz * BRICK_SIZE + z);
+          // The closest points of the brick center and of the previous cell
+          // bound the distance, which prunes most of the BVH
+          float max_distance = center_distance + p.dist(center);
+          if (prev_point.has_value())
+            max_distance = std::min(max_distance, p.dist(*prev_point));
+          max_distance = max_distance * 1.0001f + cell_size * 1e-4f;
+          auto closest = closest_triangle(p, tris, bvh, max_distance);
+          if (!closest.has_value()) closest = closest_triangle(p, tris, bvh);
+          prev_point = closest->point;
+          const Vec3 &n =
+              pseudonormals.get(closest->triangle_index, closest->barycentric);
+          float d = closest->distance;
+          if ((p - closest->point).dot(n) < 0.0f) d = -d;
+          values[(z * BRICK_SIZE + y) * BRICK_SIZE + x] =
+              std::clamp(d, -band, band);
+        }
+  }
+
+  // Skipped bricks are entirely on one side of the surface, sweep rows of
+  // bricks starting outside the mesh and take the sign of the previous brick
+  for (uint32_t bz = 0; bz < num_bricks[2]; bz++)
+    for (uint32_t by = 0; by < num_bricks[1]; by++) {
+      Brick_State prev = Brick_State::Outside;
+      for (uint32_t bx = 0; bx < num_bricks[0]; bx++) {
+        size_t bi = (size_t(bz) * num_bricks[1] + by) * num_bricks[0] + bx;
+        if (states[bi] != Brick_State::Stored) {
+          states[bi] = prev;
+          continue;
+        }
+        // Last cell of the first row touches the next brick
+        prev = bricks[bi][BRICK_SIZE - 1] < 0.0f ? Brick_State::Inside
+                                                 : Brick_State::Outside;
+      }
+    }
+  size_t num_stored = std::count(states.begin(), states.end(),
+                                 Brick_State::Stored);
+  auto fill_end = std::chrono::high_resolution_clock::now();
+  std::cout << "Filling " << num_stored << "/" << total_bricks
+            << " bricks took "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(
+                   fill_end - setup_end)
+                   .count()
+            << "ms" << std::endl;
+
+  SDF_Header header{};
+  std::memcpy(header.magic, SDF_MAGIC, sizeof(header.magic));
+  header.version = SDF_VERSION;
+  header.brick_size = BRICK_SIZE;
+  for (int axis = 0; axis < 3; axis++) {
+    header.num_bricks[axis] = num_bricks[axis];
+    header.origin[axis] = origin[axis];
+  }
+  header.cell_size = cell_size;
+  header.band = band;
+
+  std::ofstream ofs;
+  ofs.exceptions(std::ios_base::badbit);
+  ofs.open(output_filepath, std::ios::binary);
+  ofs.write((const char *)&header, sizeof(header));
+  ofs.write((const char *)states.data(), states.size());
+  for (size_t bi = 0; bi < total_bricks; bi++) {
+    if (states[bi] != Brick_State::Stored) continue;
+    ofs.write((const char *)bricks[bi].data(),
+              CELLS_PER_BRICK * sizeof(float));
+  }
+  std::cout << "Success" << std::endl;
+  return 0;
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <optional>
+
+#include "aabb.hpp"
+#include "ray.hpp"
+#include "vec.hpp"
+
+// p' = M p + translation, with M given by its rows
+struct Affine_Transform {
+  std::array<Vec3, 3> rows;
+  Vec3 translation;
+
+  static Affine_Transform identity() {
+    return {{Vec3(1, 0, 0), Vec3(0, 1, 0), Vec3(0, 0, 1)}, Vec3(0.0f)};
+  }
+  static Affine_Transform translate(const Vec3 &offset) {
+    Affine_Transform t = identity();
+    t.translation = offset;
+    return t;
+  }
+  static Affine_Transform scale(const Vec3 &factors) {
+    return {{Vec3(factors.x, 0, 0), Vec3(0, factors.y, 0),
+             Vec3(0, 0, factors.z)},
+            Vec3(0.0f)};
+  }
+  // Counter clockwise rotation about the z axis
+  static Affine_Transform rotate_z(float angle) {
+    float c = std::cos(angle);
+    float s = std::sin(angle);
+    return {{Vec3(c, -s, 0), Vec3(s, c, 0), Vec3(0, 0, 1)}, Vec3(0.0f)};
+  }
+
+  Vec3 apply_to_vector(const Vec3 &v) const {
+    return Vec3(rows[0].dot(v), rows[1].dot(v), rows[2].dot(v));
+  }
+  Vec3 apply_to_point(const Vec3 &p) const {
+    return apply_to_vector(p) + translation;
+  }
+  // The direction is not normalized, so distances along the ray are the same
+  // in both spaces
+  Ray apply_to_ray(const Ray &r) const {
+    return {apply_to_point(r.origin), apply_to_vector(r.direction)};
+  }
+  // Smallest box containing the transformed box
+  // https://www.realtimerendering.com/resources/GraphicsGems/gems/TransBox.c
+  AABB apply_to_aabb(const AABB &aabb) const {
+    AABB result(translation, translation);
+    for (int i = 0; i < 3; i++)
+      for (int j = 0; j < 3; j++) {
+        float a = rows[i][j] * aabb.min[j];
+        float b = rows[i][j] * aabb.max[j];
+        result.min[i] += a < b ? a : b;
+        result.max[i] += a < b ? b : a;
+      }
+    return result;
+  }
+  // this applied after other
+  Affine_Transform operator*(const Affine_Transform &other) const {
+    Affine_Transform result = *this;
+    for (int i = 0; i < 3; i++)
+      for (int j = 0; j < 3; j++)
+        result.rows[i][j] = rows[i].dot(Vec3(other.rows[0][j],
+                                             other.rows[1][j],
+                                             other.rows[2][j]));
+    result.translation = apply_to_point(other.translation);
+    return result;
+  }
+  // Nothing for singular transforms
+  std::optional<Affine_Transform> inverted() const {
+    // Columns of the adjugate are cross products of the rows
+    Vec3 c0 = rows[1].cross(rows[2]);
+    Vec3 c1 = rows[2].cross(rows[0]);
+    Vec3 c2 = rows[0].cross(rows[1]);
+    float det = rows[0].dot(c0);
+    if (det == 0.0f || !std::isfinite(det)) return std::nullopt;
+    float inv_det = 1.0f / det;
+    Affine_Transform result = {{Vec3(c0.x, c1.x, c2.x) * inv_det,
+                                Vec3(c0.y, c1.y, c2.y) * inv_det,
+                                Vec3(c0.z, c1.z, c2.z) * inv_det},
+                               Vec3(0.0f)};
+    result.translation = -result.apply_to_vector(translation);
+    return result;
+  }
+};
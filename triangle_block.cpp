@@ -0,0 +1,247 @@
+#include <algorithm>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#define GEOPROC_X86_64
+#endif
+
+#include "triangle_block.hpp"
+
+Triangle_Blocks::Triangle_Blocks(const std::vector<Triangle> &tris,
+                                 const BVH_Tree &bvh, SIMD_Level simd_level)
+    : simd_level(simd_level) {
+  uint32_t num_primitives = bvh.get_num_primitives();
+  map.reserve(num_primitives);
+  for (uint32_t i = 0; i < num_primitives; i++)
+    map.push_back(bvh.remap_index(i));
+  for (int vertex = 0; vertex < 3; vertex++)
+    for (int axis = 0; axis < 3; axis++) {
+      std::vector<float> &c = components[vertex][axis];
+      c.resize(num_primitives + TRIANGLE_BLOCK_SIZE, 0.0f);
+      for (uint32_t i = 0; i < num_primitives; i++)
+        c[i] = tris[map[i]][vertex][axis];
+    }
+}
+
+namespace {
+// Kernels return a bit mask of all lanes hit within [0, t_max] and a bit mask
+// of lanes whose hit depends on the tie rule for rays exactly on an edge, the
+// latter are resolved by the scalar kernel
+using Block_Kernel = uint32_t (*)(const Watertight_Ray &,
+                                  const Triangle_Blocks &, uint32_t, float,
+                                  float *, uint32_t &);
+
+uint32_t intersect_block_scalar(const Watertight_Ray &ray,
+                                const Triangle_Blocks &blocks, uint32_t start,
+                                float t_max, float *t, uint32_t &ties) {
+  uint32_t num_lanes = std::min(TRIANGLE_BLOCK_SIZE, blocks.size() - start);
+  uint32_t mask = 0;
+  for (uint32_t i = 0; i < num_lanes; i++) {
+    auto hit = intersect(ray, blocks.get_triangle(start + i), t_max);
+    if (!hit.has_value()) continue;
+    mask |= 1u << i;
+    t[i] = *hit;
+  }
+  ties = 0;
+  return mask;
+}
+
+#ifdef GEOPROC_X86_64
+// Same operations in the same order as intersect(), so results are identical.
+// Vertices are sheared in float, edge functions and distances are evaluated in
+// double, 2 lanes at a time.
+uint32_t intersect_block_sse(const Watertight_Ray &ray,
+                             const Triangle_Blocks &blocks, uint32_t start,
+                             float t_max, float *t, uint32_t &ties) {
+  const __m128 sx = _mm_set1_ps(ray.sx);
+  const __m128 sy = _mm_set1_ps(ray.sy);
+  const __m128 sz = _mm_set1_ps(ray.sz);
+  const __m128 ox = _mm_set1_ps(ray.origin[ray.kx]);
+  const __m128 oy = _mm_set1_ps(ray.origin[ray.ky]);
+  const __m128 oz = _mm_set1_ps(ray.origin[ray.kz]);
+  const __m128d zero = _mm_setzero_pd();
+  const __m128d t_max_d = _mm_set1_pd(t_max);
+  uint32_t mask = 0;
+  ties = 0;
+  for (uint32_t i = 0; i < TRIANGLE_BLOCK_SIZE; i += 4) {
+    __m128 x[3], y[3], z[3];
+    for (int v = 0; v < 3; v++) {
+      __m128 px = _mm_sub_ps(
+          _mm_loadu_ps(blocks.get_components(v, ray.kx) + start + i), ox);
+      __m128 py = _mm_sub_ps(
+          _mm_loadu_ps(blocks.get_components(v, ray.ky) + start + i), oy);
+      __m128 pz = _mm_sub_ps(
+          _mm_loadu_ps(blocks.get_components(v, ray.kz) + start + i), oz);
+      x[v] = _mm_sub_ps(px, _mm_mul_ps(sx, pz));
+      y[v] = _mm_sub_ps(py, _mm_mul_ps(sy, pz));
+      z[v] = _mm_mul_ps(sz, pz);
+    }
+    for (uint32_t h = 0; h < 4; h += 2) {
+      auto half = [h](__m128 v) {
+        return _mm_cvtps_pd(h == 0 ? v : _mm_movehl_ps(v, v));
+      };
+      __m128d ax = half(x[0]), ay = half(y[0]);
+      __m128d bx = half(x[1]), by = half(y[1]);
+      __m128d cx = half(x[2]), cy = half(y[2]);
+      __m128d u = _mm_sub_pd(_mm_mul_pd(cx, by), _mm_mul_pd(cy, bx));
+      __m128d v = _mm_sub_pd(_mm_mul_pd(ax, cy), _mm_mul_pd(ay, cx));
+      __m128d w = _mm_sub_pd(_mm_mul_pd(bx, ay), _mm_mul_pd(by, ax));
+      __m128d any_negative =
+          _mm_or_pd(_mm_or_pd(_mm_cmplt_pd(u, zero), _mm_cmplt_pd(v, zero)),
+                    _mm_cmplt_pd(w, zero));
+      __m128d any_positive =
+          _mm_or_pd(_mm_or_pd(_mm_cmpgt_pd(u, zero), _mm_cmpgt_pd(v, zero)),
+                    _mm_cmpgt_pd(w, zero));
+      __m128d det = _mm_add_pd(_mm_add_pd(u, v), w);
+      __m128d miss = _mm_or_pd(_mm_and_pd(any_negative, any_positive),
+                               _mm_cmpeq_pd(det, zero));
+      if (_mm_movemask_pd(miss) == 0x3) continue;
+      __m128d on_edge =
+          _mm_or_pd(_mm_or_pd(_mm_cmpeq_pd(u, zero), _mm_cmpeq_pd(v, zero)),
+                    _mm_cmpeq_pd(w, zero));
+      __m128d t_d = _mm_div_pd(
+          _mm_add_pd(_mm_add_pd(_mm_mul_pd(u, half(z[0])),
+                                _mm_mul_pd(v, half(z[1]))),
+                     _mm_mul_pd(w, half(z[2]))),
+          det);
+      __m128d in_range = _mm_and_pd(_mm_cmpge_pd(t_d, zero),
+                                    _mm_cmple_pd(t_d, t_max_d));
+      __m128d hit = _mm_andnot_pd(_mm_or_pd(miss, on_edge), in_range);
+      mask |= uint32_t(_mm_movemask_pd(hit)) << (i + h);
+      ties |= uint32_t(_mm_movemask_pd(_mm_andnot_pd(miss, on_edge)))
+              << (i + h);
+      __m128 t_f = _mm_cvtpd_ps(t_d);
+      _mm_storel_pi(reinterpret_cast<__m64 *>(t + i + h), t_f);
+    }
+  }
+  return mask;
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+// Compiled for AVX2 regardless of compiler flags, only called after
+// detect_simd_level() confirmed CPU support
+__attribute__((target("avx2"))) __m256d to_double(__m256 v, uint32_t half) {
+  return _mm256_cvtps_pd(half == 0 ? _mm256_castps256_ps128(v)
+                                   : _mm256_extractf128_ps(v, 1));
+}
+
+__attribute__((target("avx2"))) uint32_t
+intersect_block_avx2(const Watertight_Ray &ray, const Triangle_Blocks &blocks,
+                     uint32_t start, float t_max, float *t, uint32_t &ties) {
+  static_assert(TRIANGLE_BLOCK_SIZE == 8, "AVX2 kernel tests 8 lanes");
+  const __m256 sx = _mm256_set1_ps(ray.sx);
+  const __m256 sy = _mm256_set1_ps(ray.sy);
+  const __m256 sz = _mm256_set1_ps(ray.sz);
+  const __m256 ox = _mm256_set1_ps(ray.origin[ray.kx]);
+  const __m256 oy = _mm256_set1_ps(ray.origin[ray.ky]);
+  const __m256 oz = _mm256_set1_ps(ray.origin[ray.kz]);
+  const __m256d zero = _mm256_setzero_pd();
+  const __m256d t_max_d = _mm256_set1_pd(t_max);
+  __m256 x[3], y[3], z[3];
+  for (int v = 0; v < 3; v++) {
+    __m256 px = _mm256_sub_ps(
+        _mm256_loadu_ps(blocks.get_components(v, ray.kx) + start), ox);
+    __m256 py = _mm256_sub_ps(
+        _mm256_loadu_ps(blocks.get_components(v, ray.ky) + start), oy);
+    __m256 pz = _mm256_sub_ps(
+        _mm256_loadu_ps(blocks.get_components(v, ray.kz) + start), oz);
+    x[v] = _mm256_sub_ps(px, _mm256_mul_ps(sx, pz));
+    y[v] = _mm256_sub_ps(py, _mm256_mul_ps(sy, pz));
+    z[v] = _mm256_mul_ps(sz, pz);
+  }
+  uint32_t mask = 0;
+  ties = 0;
+  for (uint32_t h = 0; h < TRIANGLE_BLOCK_SIZE; h += 4) {
+    __m256d ax = to_double(x[0], h), ay = to_double(y[0], h);
+    __m256d bx = to_double(x[1], h), by = to_double(y[1], h);
+    __m256d cx = to_double(x[2], h), cy = to_double(y[2], h);
+    __m256d u = _mm256_sub_pd(_mm256_mul_pd(cx, by), _mm256_mul_pd(cy, bx));
+    __m256d v = _mm256_sub_pd(_mm256_mul_pd(ax, cy), _mm256_mul_pd(ay, cx));
+    __m256d w = _mm256_sub_pd(_mm256_mul_pd(bx, ay), _mm256_mul_pd(by, ax));
+    __m256d any_negative =
+        _mm256_or_pd(_mm256_or_pd(_mm256_cmp_pd(u, zero, _CMP_LT_OQ),
+                                  _mm256_cmp_pd(v, zero, _CMP_LT_OQ)),
+                     _mm256_cmp_pd(w, zero, _CMP_LT_OQ));
+    __m256d any_positive =
+        _mm256_or_pd(_mm256_or_pd(_mm256_cmp_pd(u, zero, _CMP_GT_OQ),
+                                  _mm256_cmp_pd(v, zero, _CMP_GT_OQ)),
+                     _mm256_cmp_pd(w, zero, _CMP_GT_OQ));
+    __m256d det = _mm256_add_pd(_mm256_add_pd(u, v), w);
+    __m256d miss = _mm256_or_pd(_mm256_and_pd(any_negative, any_positive),
+                                _mm256_cmp_pd(det, zero, _CMP_EQ_OQ));
+    // Most blocks are missed by the ray, skip the division
+    if (_mm256_movemask_pd(miss) == 0xf) continue;
+    __m256d on_edge =
+        _mm256_or_pd(_mm256_or_pd(_mm256_cmp_pd(u, zero, _CMP_EQ_OQ),
+                                  _mm256_cmp_pd(v, zero, _CMP_EQ_OQ)),
+                     _mm256_cmp_pd(w, zero, _CMP_EQ_OQ));
+    __m256d t_d = _mm256_div_pd(
+        _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(u, to_double(z[0], h)),
+                                    _mm256_mul_pd(v, to_double(z[1], h))),
+                      _mm256_mul_pd(w, to_double(z[2], h))),
+        det);
+    __m256d in_range = _mm256_and_pd(_mm256_cmp_pd(t_d, zero, _CMP_GE_OQ),
+                                     _mm256_cmp_pd(t_d, t_max_d, _CMP_LE_OQ));
+    __m256d hit = _mm256_andnot_pd(_mm256_or_pd(miss, on_edge), in_range);
+    mask |= uint32_t(_mm256_movemask_pd(hit)) << h;
+    ties |= uint32_t(_mm256_movemask_pd(_mm256_andnot_pd(miss, on_edge))) << h;
+    _mm_storeu_ps(t + h, _mm256_cvtpd_ps(t_d));
+  }
+  return mask;
+}
+#endif
+#endif
+} // namespace
+
+uint32_t intersect(const Watertight_Ray &ray, const Triangle_Blocks &blocks,
+                   uint32_t start, uint32_t count, float t_max,
+                   float (&t)[TRIANGLE_BLOCK_SIZE]) {
+  assert(count <= TRIANGLE_BLOCK_SIZE && start + count <= blocks.size());
+  Block_Kernel kernel = intersect_block_scalar;
+#ifdef GEOPROC_X86_64
+#if defined(__GNUC__) || defined(__clang__)
+  if (blocks.get_simd_level() == SIMD_Level::AVX2)
+    kernel = intersect_block_avx2;
+  else
+#endif
+      if (blocks.get_simd_level() == SIMD_Level::SSE)
+    kernel = intersect_block_sse;
+#endif
+  uint32_t ties;
+  uint32_t lanes = (1u << count) - 1;
+  uint32_t mask = kernel(ray, blocks, start, t_max, t, ties) & lanes;
+  ties &= lanes;
+  // Rays exactly on an edge or a vertex are rare
+  for (uint32_t i = 0; ties != 0; i++, ties >>= 1) {
+    if (!(ties & 1)) continue;
+    auto hit = intersect(ray, blocks.get_triangle(start + i), t_max);
+    if (!hit.has_value()) continue;
+    mask |= 1u << i;
+    t[i] = *hit;
+  }
+  return mask;
+}
+
+std::optional<Ray_Hit> closest_hit(const Watertight_Ray &ray,
+                                   const Triangle_Blocks &blocks,
+                                   uint32_t start, uint32_t end, float t_max) {
+  std::optional<Ray_Hit> result;
+  float t[TRIANGLE_BLOCK_SIZE];
+  for (uint32_t i = start; i < end; i += TRIANGLE_BLOCK_SIZE) {
+    uint32_t count = std::min(end - i, TRIANGLE_BLOCK_SIZE);
+    uint32_t mask = intersect(ray, blocks, i, count, t_max, t);
+    for (uint32_t j = 0; mask != 0; j++, mask >>= 1) {
+      // Lanes were tested against the distance before this block, ties keep
+      // the triangle found first
+      if (!(mask & 1) || t[j] > t_max ||
+          (result.has_value() && t[j] == t_max))
+        continue;
+      t_max = t[j];
+      result = {t[j], blocks.remap_index(i + j)};
+    }
+  }
+  return result;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+#include "bvh.hpp"
+#include "intersect.hpp"
+#include "triangle.hpp"
+#include "wide_bvh.hpp"
+
+// Triangles tested against a ray by one kernel call
+constexpr uint32_t TRIANGLE_BLOCK_SIZE = 8;
+
+// Triangles in the primitive order of a BVH_Tree, stored component wise (SoA)
+// so that the triangles of a leaf are loaded and tested against a ray in blocks
+// of 8 lanes. Blocks start at any primitive, so leaves of any size are packed
+// without padding between them. Built once after the tree.
+class Triangle_Blocks {
+  SIMD_Level simd_level;
+  // Vertex, axis, primitive, followed by a block of zeros so that full blocks
+  // can be loaded up to the last primitive
+  std::vector<float> components[3][3];
+  std::vector<uint32_t> map;
+
+public:
+  Triangle_Blocks(const std::vector<Triangle> &tris, const BVH_Tree &bvh,
+                  SIMD_Level simd_level = detect_simd_level());
+  SIMD_Level get_simd_level() const { return simd_level; }
+  uint32_t size() const { return map.size(); }
+  uint32_t remap_index(uint32_t i) const {
+    assert(i < map.size());
+    return map[i];
+  }
+  const float *get_components(int vertex, int axis) const {
+    return components[vertex][axis].data();
+  }
+  Triangle get_triangle(uint32_t i) const {
+    assert(i < map.size());
+    auto vertex = [&](int v) {
+      return Vec3(components[v][0][i], components[v][1][i],
+                  components[v][2][i]);
+    };
+    return Triangle(vertex(0), vertex(1), vertex(2));
+  }
+};
+
+// Bit mask of the triangles [start, start + count) hit within [0, t_max],
+// count is at most TRIANGLE_BLOCK_SIZE. Distances of hit triangles are written
+// to t. Same results as intersect() with a triangle at a time.
+uint32_t intersect(const Watertight_Ray &ray, const Triangle_Blocks &blocks,
+                   uint32_t start, uint32_t count, float t_max,
+                   float (&t)[TRIANGLE_BLOCK_SIZE]);
+
+// Closest hit among the triangles [start, end) within t_max, ties keep the
+// first triangle. triangle_index is the index of the triangle in the mesh.
+std::optional<Ray_Hit> closest_hit(const Watertight_Ray &ray,
+                                   const Triangle_Blocks &blocks,
+                                   uint32_t start, uint32_t end,
+                                   float t_max = RAY_MAX);
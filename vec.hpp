@@ -24,11 +24,15 @@ struct Vec3 {
   float dot(const Vec3 &v) const { return x * v.x + y * v.y + z * v.z; }
   float mag() const { return std::sqrt(x * x + y * y + z * z); }
   Vec3 normalized() const { return *this / mag(); }
+  // Unlike std::fmax and std::fmin these compile to single instructions, if
+  // one of the components is NaN the component of b is returned
   static Vec3 max(const Vec3 &a, const Vec3 &b) {
-    return Vec3(std::fmax(a.x, b.x), std::fmax(a.y, b.y), std::fmax(a.z, b.z));
+    return Vec3(a.x > b.x ? a.x : b.x, a.y > b.y ? a.y : b.y,
+                a.z > b.z ? a.z : b.z);
   }
   static Vec3 min(const Vec3 &a, const Vec3 &b) {
-    return Vec3(std::fmin(a.x, b.x), std::fmin(a.y, b.y), std::fmin(a.z, b.z));
+    return Vec3(a.x < b.x ? a.x : b.x, a.y < b.y ? a.y : b.y,
+                a.z < b.z ? a.z : b.z);
   }
   Vec3 clamped(const Vec3 &min, const Vec3 &max) const {
     return Vec3::min(Vec3::max(*this, min), max);
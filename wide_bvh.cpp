@@ -0,0 +1,479 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stack>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#define GEOPROC_X86_64
+#endif
+
+#include "wide_bvh.hpp"
+
+SIMD_Level detect_simd_level() {
+#ifdef GEOPROC_X86_64
+#if defined(__GNUC__) || defined(__clang__)
+  if (__builtin_cpu_supports("avx2")) return SIMD_Level::AVX2;
+#endif
+  // SSE2 is part of x86-64
+  return SIMD_Level::SSE;
+#else
+  return SIMD_Level::Scalar;
+#endif
+}
+
+template <uint32_t N>
+void Wide_BVH::collapse(const BVH_Tree &tree,
+                        std::vector<Wide_BVH_Node<N>> &nodes) {
+  constexpr float inf = std::numeric_limits<float>::infinity();
+  struct Stack_Item {
+    uint32_t binary_node;
+    uint32_t wide_node;
+  };
+  std::stack<Stack_Item> stack;
+  nodes.emplace_back();
+  stack.push({BVH_Tree::ROOT, 0});
+  while (!stack.empty()) {
+    auto [binary_node, wide_node] = stack.top();
+    stack.pop();
+
+    uint32_t children[N];
+    uint32_t num_children = 0;
+    const BVH_Node &node = tree.get_node(binary_node);
+    if (node.is_leaf()) {
+      // Only possible for the root
+      children[num_children++] = binary_node;
+    } else {
+      children[num_children++] = BVH_Node::left_child(binary_node);
+      children[num_children++] = node.right_child();
+    }
+    // Pull grandchildren up by opening the inner child with the largest
+    // surface area until the node is full
+    while (num_children < N) {
+      int best = -1;
+      float best_area = -inf;
+      for (uint32_t i = 0; i < num_children; i++) {
+        const BVH_Node &child = tree.get_node(children[i]);
+        if (child.is_leaf()) continue;
+        float area = child.aabb.calc_surface_area();
+        if (area > best_area) {
+          best_area = area;
+          best = i;
+        }
+      }
+      if (best < 0) break;
+      const BVH_Node &opened = tree.get_node(children[best]);
+      children[num_children++] = opened.right_child();
+      children[best] = BVH_Node::left_child(children[best]);
+    }
+
+    Wide_BVH_Node<N> wide;
+    for (uint32_t i = 0; i < N; i++) {
+      wide.min_x[i] = wide.min_y[i] = wide.min_z[i] = inf;
+      wide.max_x[i] = wide.max_y[i] = wide.max_z[i] = inf;
+      wide.offset[i] = 0;
+      wide.num_primitives[i] = 0;
+    }
+    wide.num_children = num_children;
+    for (uint32_t i = 0; i < num_children; i++) {
+      const BVH_Node &child = tree.get_node(children[i]);
+      wide.min_x[i] = child.aabb.min.x;
+      wide.min_y[i] = child.aabb.min.y;
+      wide.min_z[i] = child.aabb.min.z;
+      wide.max_x[i] = child.aabb.max.x;
+      wide.max_y[i] = child.aabb.max.y;
+      wide.max_z[i] = child.aabb.max.z;
+      if (child.is_leaf()) {
+        wide.offset[i] = child.start();
+        wide.num_primitives[i] = child.num_primitives;
+      } else {
+        wide.offset[i] = nodes.size();
+        nodes.emplace_back();
+        stack.push({children[i], wide.offset[i]});
+      }
+    }
+    nodes[wide_node] = wide;
+  }
+}
+
+Wide_BVH::Wide_BVH(const BVH_Tree &tree, SIMD_Level simd_level)
+    : simd_level(simd_level) {
+  map.reserve(tree.get_num_primitives());
+  for (uint32_t i = 0; i < tree.get_num_primitives(); i++)
+    map.push_back(tree.remap_index(i));
+  if (simd_level == SIMD_Level::AVX2) collapse(tree, nodes_8);
+  else collapse(tree, nodes_4);
+}
+
+namespace {
+// Same semantics as minps and maxps, if either operand is NaN the second one
+// is returned
+float lane_min(float a, float b) { return a < b ? a : b; }
+float lane_max(float a, float b) { return a > b ? a : b; }
+
+// Kernels test all children of a node at once. Ray kernels return a bit mask of
+// children hit within [0, t_max] and their entry distances, point kernels
+// return squared distances to all children. Like Slab_Ray, ray kernels pick
+// the near and far plane of each slab by the sign of the direction. A ray
+// parallel to a slab with its origin on one of the planes gives NaN for that
+// plane only, the running interval is passed second so that NaN is ignored.
+template <uint32_t N> struct Slab_Planes {
+  const float *near[3];
+  const float *far[3];
+
+  Slab_Planes(const Wide_BVH_Node<N> &node, const Slab_Ray &ray) {
+    const float *mins[3] = {node.min_x, node.min_y, node.min_z};
+    const float *maxs[3] = {node.max_x, node.max_y, node.max_z};
+    for (int axis = 0; axis < 3; axis++) {
+      near[axis] = ray.sign[axis] ? maxs[axis] : mins[axis];
+      far[axis] = ray.sign[axis] ? mins[axis] : maxs[axis];
+    }
+  }
+};
+
+template <uint32_t N>
+using Ray_Kernel = uint32_t (*)(const Wide_BVH_Node<N> &, const Slab_Ray &,
+                                float, float *);
+template <uint32_t N>
+using Point_Kernel = void (*)(const Wide_BVH_Node<N> &, const Vec3 &, float *);
+
+template <uint32_t N>
+uint32_t intersect_children_scalar(const Wide_BVH_Node<N> &node,
+                                   const Slab_Ray &ray, float t_max,
+                                   float *t_near) {
+  Slab_Planes<N> planes(node, ray);
+  uint32_t mask = 0;
+  for (uint32_t i = 0; i < N; i++) {
+    float t_enter = 0.0f;
+    float t_exit = t_max;
+    for (int axis = 0; axis < 3; axis++) {
+      float t_near_plane =
+          (planes.near[axis][i] - ray.origin[axis]) * ray.inv_dir[axis];
+      float t_far_plane =
+          (planes.far[axis][i] - ray.origin[axis]) * ray.inv_dir[axis];
+      t_enter = lane_max(t_near_plane, t_enter);
+      t_exit = lane_min(t_far_plane, t_exit);
+    }
+    t_near[i] = t_enter;
+    if (t_enter <= t_exit) mask |= 1u << i;
+  }
+  return mask;
+}
+
+template <uint32_t N>
+void distance_to_children_scalar(const Wide_BVH_Node<N> &node, const Vec3 &p,
+                                 float *d2) {
+  for (uint32_t i = 0; i < N; i++) {
+    const float mins[3] = {node.min_x[i], node.min_y[i], node.min_z[i]};
+    const float maxs[3] = {node.max_x[i], node.max_y[i], node.max_z[i]};
+    d2[i] = 0.0f;
+    for (int axis = 0; axis < 3; axis++) {
+      float below = mins[axis] - p[axis];
+      float above = p[axis] - maxs[axis];
+      float d = lane_max(lane_max(below, above), 0.0f);
+      d2[i] += d * d;
+    }
+  }
+}
+
+#ifdef GEOPROC_X86_64
+uint32_t intersect_children_sse(const Wide_BVH_Node<4> &node,
+                                const Slab_Ray &ray, float t_max,
+                                float *t_near) {
+  __m128 t_enter = _mm_setzero_ps();
+  __m128 t_exit = _mm_set1_ps(t_max);
+  Slab_Planes<4> planes(node, ray);
+  for (int axis = 0; axis < 3; axis++) {
+    __m128 origin = _mm_set1_ps(ray.origin[axis]);
+    __m128 inv_dir = _mm_set1_ps(ray.inv_dir[axis]);
+    __m128 t_near_plane = _mm_mul_ps(
+        _mm_sub_ps(_mm_load_ps(planes.near[axis]), origin), inv_dir);
+    __m128 t_far_plane = _mm_mul_ps(
+        _mm_sub_ps(_mm_load_ps(planes.far[axis]), origin), inv_dir);
+    t_enter = _mm_max_ps(t_near_plane, t_enter);
+    t_exit = _mm_min_ps(t_far_plane, t_exit);
+  }
+  _mm_storeu_ps(t_near, t_enter);
+  return _mm_movemask_ps(_mm_cmple_ps(t_enter, t_exit));
+}
+
+void distance_to_children_sse(const Wide_BVH_Node<4> &node, const Vec3 &p,
+                              float *d2) {
+  const float *mins[3] = {node.min_x, node.min_y, node.min_z};
+  const float *maxs[3] = {node.max_x, node.max_y, node.max_z};
+  __m128 sum = _mm_setzero_ps();
+  for (int axis = 0; axis < 3; axis++) {
+    __m128 c = _mm_set1_ps(p[axis]);
+    __m128 below = _mm_sub_ps(_mm_load_ps(mins[axis]), c);
+    __m128 above = _mm_sub_ps(c, _mm_load_ps(maxs[axis]));
+    __m128 d = _mm_max_ps(_mm_max_ps(below, above), _mm_setzero_ps());
+    sum = _mm_add_ps(sum, _mm_mul_ps(d, d));
+  }
+  _mm_storeu_ps(d2, sum);
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+// Compiled for AVX2 regardless of compiler flags, only called after
+// detect_simd_level() confirmed CPU support
+__attribute__((target("avx2"))) uint32_t
+intersect_children_avx2(const Wide_BVH_Node<8> &node, const Slab_Ray &ray,
+                        float t_max, float *t_near) {
+  __m256 t_enter = _mm256_setzero_ps();
+  __m256 t_exit = _mm256_set1_ps(t_max);
+  Slab_Planes<8> planes(node, ray);
+  for (int axis = 0; axis < 3; axis++) {
+    __m256 origin = _mm256_set1_ps(ray.origin[axis]);
+    __m256 inv_dir = _mm256_set1_ps(ray.inv_dir[axis]);
+    __m256 t_near_plane = _mm256_mul_ps(
+        _mm256_sub_ps(_mm256_load_ps(planes.near[axis]), origin), inv_dir);
+    __m256 t_far_plane = _mm256_mul_ps(
+        _mm256_sub_ps(_mm256_load_ps(planes.far[axis]), origin), inv_dir);
+    t_enter = _mm256_max_ps(t_near_plane, t_enter);
+    t_exit = _mm256_min_ps(t_far_plane, t_exit);
+  }
+  _mm256_storeu_ps(t_near, t_enter);
+  return _mm256_movemask_ps(_mm256_cmp_ps(t_enter, t_exit, _CMP_LE_OQ));
+}
+
+__attribute__((target("avx2"))) void
+distance_to_children_avx2(const Wide_BVH_Node<8> &node, const Vec3 &p,
+                          float *d2) {
+  const float *mins[3] = {node.min_x, node.min_y, node.min_z};
+  const float *maxs[3] = {node.max_x, node.max_y, node.max_z};
+  __m256 sum = _mm256_setzero_ps();
+  for (int axis = 0; axis < 3; axis++) {
+    __m256 c = _mm256_set1_ps(p[axis]);
+    __m256 below = _mm256_sub_ps(_mm256_load_ps(mins[axis]), c);
+    __m256 above = _mm256_sub_ps(c, _mm256_load_ps(maxs[axis]));
+    __m256 d = _mm256_max_ps(_mm256_max_ps(below, above), _mm256_setzero_ps());
+    sum = _mm256_add_ps(sum, _mm256_mul_ps(d, d));
+  }
+  _mm256_storeu_ps(d2, sum);
+}
+#endif
+#endif
+
+struct Stack_Item {
+  uint32_t offset;
+  uint32_t num_primitives;
+  float t;
+};
+
+// Each popped node pushes at most N children, and wide trees are no deeper
+// than the binary trees they are collapsed from
+template <typename T, uint32_t N> struct Traversal_Stack {
+  T items[N * BVH_MAX_DEPTH];
+  uint32_t size = 0;
+  bool empty() const { return size == 0; }
+  void push(const T &item) {
+    assert(size < N * BVH_MAX_DEPTH);
+    items[size++] = item;
+  }
+  T pop() { return items[--size]; }
+};
+
+// Push hit children so that the nearest one ends up on top of the stack
+template <uint32_t N>
+void push_sorted(Traversal_Stack<Stack_Item, N> &stack,
+                 const Wide_BVH_Node<N> &node, uint32_t mask, const float *t) {
+  Stack_Item items[N];
+  uint32_t num_items = 0;
+  for (uint32_t i = 0; i < N; i++) {
+    if (!((mask >> i) & 1)) continue;
+    Stack_Item item{node.offset[i], node.num_primitives[i], t[i]};
+    uint32_t j = num_items++;
+    for (; j > 0 && items[j - 1].t < item.t; j--) items[j] = items[j - 1];
+    items[j] = item;
+  }
+  for (uint32_t i = 0; i < num_items; i++) stack.push(items[i]);
+}
+
+template <uint32_t N, Ray_Kernel<N> intersect_children>
+size_t count_intersections_impl(const Ray &ray, const Wide_BVH &bvh,
+                                const std::vector<Triangle> &tris) {
+  const std::vector<Wide_BVH_Node<N>> &nodes = bvh.get_nodes<N>();
+  Slab_Ray slab_ray(ray);
+  Watertight_Ray watertight_ray(ray);
+  alignas(32) float t_near[N];
+  size_t num_hits = 0;
+  Traversal_Stack<uint32_t, N> stack;
+  stack.push(0);
+  while (!stack.empty()) {
+    const Wide_BVH_Node<N> &node = nodes[stack.pop()];
+    uint32_t mask = intersect_children(node, slab_ray, RAY_MAX, t_near) &
+                    node.children_mask();
+    for (uint32_t i = 0; i < N; i++) {
+      if (!((mask >> i) & 1)) continue;
+      if (node.num_primitives[i] == 0) {
+        stack.push(node.offset[i]);
+        continue;
+      }
+      uint32_t end = node.offset[i] + node.num_primitives[i];
+      for (uint32_t j = node.offset[i]; j < end; j++)
+        if (intersect(watertight_ray, tris[bvh.remap_index(j)]).has_value())
+          num_hits++;
+    }
+  }
+  return num_hits;
+}
+
+template <uint32_t N, Ray_Kernel<N> intersect_children>
+std::optional<Wide_BVH_Hit>
+closest_hit_impl(const Ray &ray, const Wide_BVH &bvh,
+                 const std::vector<Triangle> &tris) {
+  const std::vector<Wide_BVH_Node<N>> &nodes = bvh.get_nodes<N>();
+  Slab_Ray slab_ray(ray);
+  Watertight_Ray watertight_ray(ray);
+  alignas(32) float t_near[N];
+  std::optional<Wide_BVH_Hit> result;
+  float t_max = RAY_MAX;
+  Traversal_Stack<Stack_Item, N> stack;
+  stack.push({0, 0, 0.0f});
+  while (!stack.empty()) {
+    Stack_Item item = stack.pop();
+    if (item.t > t_max) continue;
+    if (item.num_primitives > 0) {
+      for (uint32_t j = item.offset; j < item.offset + item.num_primitives;
+           j++) {
+        uint32_t ti = bvh.remap_index(j);
+        auto hit = intersect(watertight_ray, tris[ti]);
+        if (!hit.has_value() || *hit > t_max) continue;
+        t_max = *hit;
+        result = {*hit, ti};
+      }
+      continue;
+    }
+    const Wide_BVH_Node<N> &node = nodes[item.offset];
+    uint32_t mask = intersect_children(node, slab_ray, t_max, t_near) &
+                    node.children_mask();
+    push_sorted(stack, node, mask, t_near);
+  }
+  return result;
+}
+
+template <uint32_t N, Point_Kernel<N> distance_to_children>
+std::optional<Closest_Point_Result>
+closest_point_impl(const Vec3 &p, const std::vector<Vec3> &points,
+                   const Wide_BVH &bvh) {
+  const std::vector<Wide_BVH_Node<N>> &nodes = bvh.get_nodes<N>();
+  alignas(32) float d2[N];
+  std::optional<Closest_Point_Result> result;
+  float best_d2 = std::numeric_limits<float>::infinity();
+  Traversal_Stack<Stack_Item, N> stack;
+  stack.push({0, 0, 0.0f});
+  while (!stack.empty()) {
+    Stack_Item item = stack.pop();
+    if (item.t > best_d2) continue;
+    if (item.num_primitives > 0) {
+      for (uint32_t j = item.offset; j < item.offset + item.num_primitives;
+           j++) {
+        uint32_t pi = bvh.remap_index(j);
+        Vec3 d = points[pi] - p;
+        float other_d2 = d.dot(d);
+        if (other_d2 >= best_d2) continue;
+        best_d2 = other_d2;
+        result = {pi, std::sqrt(other_d2)};
+      }
+      continue;
+    }
+    const Wide_BVH_Node<N> &node = nodes[item.offset];
+    distance_to_children(node, p, d2);
+    uint32_t mask = 0;
+    for (uint32_t i = 0; i < node.num_children; i++)
+      if (d2[i] <= best_d2) mask |= 1u << i;
+    push_sorted(stack, node, mask, d2);
+  }
+  return result;
+}
+} // namespace
+
+template <uint32_t N>
+uint32_t intersect_children(const Wide_BVH_Node<N> &node, const Slab_Ray &ray,
+                            float t_max, float *t_near,
+                            SIMD_Level simd_level) {
+  uint32_t mask = 0;
+  if constexpr (N == 8) {
+#if defined(GEOPROC_X86_64) && (defined(__GNUC__) || defined(__clang__))
+    if (simd_level == SIMD_Level::AVX2)
+      mask = intersect_children_avx2(node, ray, t_max, t_near);
+    else
+#endif
+      mask = intersect_children_scalar<8>(node, ray, t_max, t_near);
+  } else {
+#ifdef GEOPROC_X86_64
+    if (simd_level != SIMD_Level::Scalar)
+      mask = intersect_children_sse(node, ray, t_max, t_near);
+    else
+#endif
+      mask = intersect_children_scalar<N>(node, ray, t_max, t_near);
+  }
+  return mask & node.children_mask();
+}
+
+template uint32_t intersect_children(const Wide_BVH_Node<4> &,
+                                     const Slab_Ray &, float, float *,
+                                     SIMD_Level);
+template uint32_t intersect_children(const Wide_BVH_Node<8> &,
+                                     const Slab_Ray &, float, float *,
+                                     SIMD_Level);
+
+size_t count_intersections(const Ray &ray, const Wide_BVH &bvh,
+                           const std::vector<Triangle> &tris) {
+  switch (bvh.get_simd_level()) {
+#ifdef GEOPROC_X86_64
+#if defined(__GNUC__) || defined(__clang__)
+  case SIMD_Level::AVX2:
+    return count_intersections_impl<8, intersect_children_avx2>(ray, bvh,
+                                                                tris);
+#endif
+  case SIMD_Level::SSE:
+    return count_intersections_impl<4, intersect_children_sse>(ray, bvh, tris);
+#endif
+  default:
+    if (bvh.get_width() == 8)
+      return count_intersections_impl<8, intersect_children_scalar<8>>(ray, bvh,
+                                                                       tris);
+    return count_intersections_impl<4, intersect_children_scalar<4>>(ray, bvh,
+                                                                     tris);
+  }
+}
+
+std::optional<Wide_BVH_Hit> closest_hit(const Ray &ray, const Wide_BVH &bvh,
+                                        const std::vector<Triangle> &tris) {
+  switch (bvh.get_simd_level()) {
+#ifdef GEOPROC_X86_64
+#if defined(__GNUC__) || defined(__clang__)
+  case SIMD_Level::AVX2:
+    return closest_hit_impl<8, intersect_children_avx2>(ray, bvh, tris);
+#endif
+  case SIMD_Level::SSE:
+    return closest_hit_impl<4, intersect_children_sse>(ray, bvh, tris);
+#endif
+  default:
+    if (bvh.get_width() == 8)
+      return closest_hit_impl<8, intersect_children_scalar<8>>(ray, bvh, tris);
+    return closest_hit_impl<4, intersect_children_scalar<4>>(ray, bvh, tris);
+  }
+}
+
+std::optional<Closest_Point_Result>
+closest_point(const Vec3 &p, const std::vector<Vec3> &points,
+              const Wide_BVH &bvh) {
+  switch (bvh.get_simd_level()) {
+#ifdef GEOPROC_X86_64
+#if defined(__GNUC__) || defined(__clang__)
+  case SIMD_Level::AVX2:
+    return closest_point_impl<8, distance_to_children_avx2>(p, points, bvh);
+#endif
+  case SIMD_Level::SSE:
+    return closest_point_impl<4, distance_to_children_sse>(p, points, bvh);
+#endif
+  default:
+    if (bvh.get_width() == 8)
+      return closest_point_impl<8, distance_to_children_scalar<8>>(p, points,
+                                                                   bvh);
+    return closest_point_impl<4, distance_to_children_scalar<4>>(p, points,
+                                                                 bvh);
+  }
+}
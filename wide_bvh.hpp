@@ -0,0 +1,93 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+#include "bvh.hpp"
+#include "intersect.hpp"
+#include "ray.hpp"
+#include "triangle.hpp"
+#include "vec.hpp"
+
+enum class SIMD_Level {
+  Scalar,
+  // 4 wide nodes tested with SSE
+  SSE,
+  // 8 wide nodes tested with AVX2
+  AVX2,
+};
+
+// Best instruction set supported by the CPU we are running on
+SIMD_Level detect_simd_level();
+
+// Bounds of all children of a node are stored component wise (SoA) so that
+// they can be tested against a ray or a point with a single SIMD kernel
+template <uint32_t N> struct alignas(N * sizeof(float)) Wide_BVH_Node {
+  float min_x[N], min_y[N], min_z[N];
+  float max_x[N], max_y[N], max_z[N];
+  // Index of child node for inner children, index of first primitive for leaf
+  // children
+  uint32_t offset[N];
+  // Zero for inner children
+  uint32_t num_primitives[N];
+  // Lanes past the children are unused and must be masked out of test results
+  uint32_t num_children;
+  uint32_t children_mask() const { return (1u << num_children) - 1; }
+};
+
+// BVH with 4 or 8 children per node, collapsed from a binary BVH_Tree by
+// repeatedly opening the child with the largest surface area
+class Wide_BVH {
+  SIMD_Level simd_level;
+  std::vector<Wide_BVH_Node<4>> nodes_4;
+  std::vector<Wide_BVH_Node<8>> nodes_8;
+  std::vector<uint32_t> map;
+
+  template <uint32_t N>
+  static void collapse(const BVH_Tree &tree,
+                       std::vector<Wide_BVH_Node<N>> &nodes);
+
+public:
+  explicit Wide_BVH(const BVH_Tree &tree,
+                    SIMD_Level simd_level = detect_simd_level());
+  SIMD_Level get_simd_level() const { return simd_level; }
+  uint32_t get_width() const { return simd_level == SIMD_Level::AVX2 ? 8 : 4; }
+  uint32_t remap_index(uint32_t i) const {
+    assert(i < map.size());
+    return map[i];
+  }
+  template <uint32_t N> const std::vector<Wide_BVH_Node<N>> &get_nodes() const;
+};
+
+template <>
+inline const std::vector<Wide_BVH_Node<4>> &Wide_BVH::get_nodes<4>() const {
+  return nodes_4;
+}
+
+template <>
+inline const std::vector<Wide_BVH_Node<8>> &Wide_BVH::get_nodes<8>() const {
+  return nodes_8;
+}
+
+// Bit mask of the children of node that ray enters within [0, t_max], with
+// their entry distances stored in t_near. Tested with the same kernel as
+// traversals of a Wide_BVH built for simd_level.
+template <uint32_t N>
+uint32_t intersect_children(const Wide_BVH_Node<N> &node, const Slab_Ray &ray,
+                            float t_max, float *t_near,
+                            SIMD_Level simd_level);
+
+struct Wide_BVH_Hit {
+  float t;
+  uint32_t triangle_index;
+};
+
+size_t count_intersections(const Ray &ray, const Wide_BVH &bvh,
+                           const std::vector<Triangle> &tris);
+std::optional<Wide_BVH_Hit> closest_hit(const Ray &ray, const Wide_BVH &bvh,
+                                        const std::vector<Triangle> &tris);
+std::optional<Closest_Point_Result>
+closest_point(const Vec3 &p, const std::vector<Vec3> &points,
+              const Wide_BVH &bvh);